@@ -10,4 +10,22 @@ namespace arch {
 uint64_t GetClockNs() noexcept;
 time_t GetWallTimeSecs() noexcept;
 
+// ClockParams tells how to compute GetClockNs value from a raw TSC reading: (tsc * mult) >> shift.
+struct ClockParams {
+    uint64_t mult;
+    uint64_t shift;
+};
+
+// GetUserClockParams returns parameters of the clock for user space. Mult is zero if user space can't read the clock directly.
+ClockParams GetUserClockParams() noexcept;
+
+// StartPeriodicTimer makes local timer interrupt fire every TICK_NS.
+void StartPeriodicTimer() noexcept;
+
+// StartOneShotTimer makes local timer interrupt fire once after given delay.
+void StartOneShotTimer(uint64_t delay_ns) noexcept;
+
+// StopTimer stops local timer interrupts.
+void StopTimer() noexcept;
+
 }
@@ -32,8 +32,9 @@
 #define X86_SPURIOUS_IRQ 33
 #define X86_PANIC_BROADCAST_IRQ 34
 #define X86_SCHED_BROADCAST_IRQ 35
+#define X86_TLB_SHOOTDOWN_IRQ   36
 
-#define X86_EXTERNAL_IRQ_START 36
+#define X86_EXTERNAL_IRQ_START 37
 #define X86_MAX_IRQ            256
 #define X86_NUM_EXTERNAL_IRQS  (X86_MAX_IRQ - X86_EXTERNAL_IRQ_START)
 
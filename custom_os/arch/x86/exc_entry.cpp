@@ -60,6 +60,7 @@ void ExcEntryTimerHandler();
 void ExcEntryLapicSpuriousHandler();
 void ExcEntryPanicBroadcastHandler();
 void ExcEntrySchedWakeCpuHandler();
+void ExcEntryTlbShootdownHandler();
 
 typedef struct { char data[X86_EXTERNAL_IRQ_ENTRY_SIZE]; } ExternalIrqEntry;
 extern ExternalIrqEntry _external_irq_entries_start[];
@@ -95,6 +96,7 @@ void IdtInit() noexcept {
     IdtSet(X86_SPURIOUS_IRQ, (uint64_t)&ExcEntryLapicSpuriousHandler);
     IdtSet(X86_PANIC_BROADCAST_IRQ, (uint64_t)&ExcEntryPanicBroadcastHandler);
     IdtSet(X86_SCHED_BROADCAST_IRQ, (uint64_t)&ExcEntrySchedWakeCpuHandler);
+    IdtSet(X86_TLB_SHOOTDOWN_IRQ, (uint64_t)&ExcEntryTlbShootdownHandler);
 
     // Register external interrupts.
     size_t num_ext_irqs = &_external_irq_entries_end - _external_irq_entries_start;
@@ -121,6 +123,8 @@ void NmiHandler(arch::Registers* regs) {
 void ExternalIrqHandler(arch::Registers* regs) noexcept {
     lapic::Eoi();
     kern::IrqGenericEntry(regs->errcode);
+    kern::IrqEnable();
+    sched::PreemptIfNeeded();
 }
 
 void PanicBroadcastHandler() noexcept {
@@ -129,16 +133,20 @@ void PanicBroadcastHandler() noexcept {
 }
 
 void SchedWakeCpuHandler() noexcept {
+    lapic::Eoi();
+    sched::SetNeedResched();
     kern::IrqEnable();
-    sched::Preempt();
+    sched::PreemptIfNeeded();
 }
 
+void TlbShootdownHandler() noexcept {
+    lapic::Eoi();
+    mm::HandleTlbShootdown();
+}
 
 void TimerHandler(arch::Registers* regs) noexcept {
     lapic::Eoi();
-    if (PER_CPU_GET(cpu_id) == 0) {
-        time::PeriodicTick();
-    }
+    time::PeriodicTick();
     kern::IrqEnable();
     sched::TimerTick(regs->IsUser());
 }
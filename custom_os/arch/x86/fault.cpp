@@ -6,6 +6,7 @@
 #include "kernel/signal.h"
 #include "lib/stack_unwind.h"
 #include "linker.h"
+#include "mm/kfence.h"
 #include "mm/vmem.h"
 #include "per_cpu.h"
 #include "x86.h"
@@ -41,6 +42,10 @@ static void DoPageFault(arch::Registers& regs) noexcept {
     uint64_t fault_addr = x86::ReadCr2();
     sched::Task* task = sched::Current();
 
+    if (regs.IsKernel() && kfence::IsKfenceAddr(fault_addr)) {
+        kfence::ReportFault(regs, fault_addr, regs.errcode & X86_PF_ERRCODE_W);
+    }
+
     if (regs.IsKernel() && KERNEL_KASAN_SHADOW_MEMORY_START <= fault_addr && fault_addr < KERNEL_KASAN_SHADOW_MEMORY_START + KERNEL_KASAN_SHADOW_MEMORY_SIZE) {
         // Page fault was caused by KASAN routines on unmapped shadow area.
         ReportBadKernelPageFault(regs, fault_addr);
@@ -78,8 +83,11 @@ static void DoPageFault(arch::Registers& regs) noexcept {
     }
 
     auto status = task->vmem->HandlePageFault(fault_addr, flags);
-    if (!status.Ok() || *status == mm::FaultStatus::Ok) {
+    if (status.Ok() && *status == mm::FaultStatus::Ok) {
         // If everything is OK, just leave.
+        return;
+    }
+    if (!status.Ok() && regs.IsUser()) {
         // If an error occured, HandlePagefault already sent a signal to the process.
         return;
     }
@@ -5,6 +5,7 @@
 #include "arch/x86/msr.h"
 #include "arch/x86/rtc.h"
 #include "arch/x86/serial.h"
+#include "arch/x86/tsc.h"
 #include "arch/x86/vga.h"
 #include "arch/x86/x86.h"
 #include "drivers/acpi.h"
@@ -27,6 +28,9 @@ void* tmp_bootstrap_stack;
 uint32_t cpu_ids[MAX_CPUS];
 extern size_t cpu_count;
 
+// All CPUs are of the same model, so either all of them use PCIDs or none.
+bool pcid_enabled = false;
+
 PER_CPU_DEFINE(x86::Tss, cpu_tss);
 PER_CPU_DEFINE(x86::Gdt, cpu_gdt);
 
@@ -180,6 +184,11 @@ void InitCpuCommon() noexcept {
 
     cr4 |= x86::CR4_OSFXSR;
     cr4 |= x86::CR4_OSXMMEXCPT;
+    // Tag TLB entries with address space ids, so context switches don't flush them. PCID of the loaded CR3 is zero here.
+    if (x86::Cpuid(x86::CPUID_FEATURES).ecx & x86::CPUID_FEATURES_ECX_PCID) {
+        cr4 |= x86::CR4_PCIDE;
+        pcid_enabled = true;
+    }
     x86::WriteCr4(cr4);
 
 
@@ -205,6 +214,9 @@ extern "C" void InitApCpu() noexcept {
 
     printk("[kernel] CPU#%d is alive and running\n", PER_CPU_GET(cpu_id));
 
+    tsc::SyncApCpu();
+    sched::InitOnCpu();
+
     cpus_online.fetch_add(1, std::memory_order_relaxed);
 
     kern::IrqEnable();
@@ -219,6 +231,7 @@ void StartAndWaitCpu(uint32_t lapic_id) noexcept {
 
     // Wait until CPU becomes online.
     while (prev_online == cpus_online.load(std::memory_order_relaxed)) {
+        tsc::ServeSync();
     }
 }
 
@@ -241,6 +254,7 @@ namespace arch {
 
 void InitTimers() noexcept {
     hpet::Init();
+    tsc::Calibrate();
     lapic::CalibrateTimer();
     rtc::Init();
 }
@@ -284,6 +298,19 @@ void WakeAllCpus() noexcept {
     lapic::BroadcastIpi(X86_SCHED_BROADCAST_IRQ);
 }
 
+void WakeCpu(size_t cpu) noexcept {
+    // ICR is written in two steps, don't let an interrupt handler send its own IPI in between.
+    kern::WithoutIrqs([&]() {
+        lapic::SendIpi(cpu_ids[cpu], X86_SCHED_BROADCAST_IRQ);
+    });
+}
+
+void SendTlbShootdown(size_t cpu) noexcept {
+    kern::WithoutIrqs([&]() {
+        lapic::SendIpi(cpu_ids[cpu], X86_TLB_SHOOTDOWN_IRQ);
+    });
+}
+
 void BroadcastPanic() noexcept {
     if (lapic::IsInitialized()) {
         lapic::BroadcastIpi(X86_PANIC_BROADCAST_IRQ);
@@ -1,5 +1,7 @@
 #include <stdint.h>
 
+#include <algorithm>
+
 #include "arch/x86/arch/regs.h"
 #include "arch/x86/exc_asm.h"
 #include "arch/x86/lapic.h"
@@ -93,7 +95,6 @@ extern "C" void LapicSpuriousHandler(arch::Registers* regs) noexcept {
 }
 
 static uint64_t LapicTicksPer1Ms = 0;
-static uint64_t TscTicksPer1Ms = 0;
 
 
 void CalibrateTimer() noexcept {
@@ -107,14 +108,7 @@ void CalibrateTimer() noexcept {
 
     LapicTicksPer1Ms = (initial_count - final_count) / 10;
 
-    initial_count = x86::Rdtsc();
-    hpet::BusySleepMs(10);
-    final_count = x86::Rdtsc();
-
-    TscTicksPer1Ms = (final_count - initial_count) / 10;
-
     printk("[lapic] %lu ticks per 1 ms\n", LapicTicksPer1Ms);
-    printk("[tsc] %lu ticks per 1 ms\n", TscTicksPer1Ms);
 }
 
 void StartTimer() noexcept {
@@ -123,6 +117,21 @@ void StartTimer() noexcept {
     Write(LAPIC_TMR_INIT_CNT, time::TICK_NS / time::NS_IN_MSEC * LapicTicksPer1Ms);
 }
 
+void StartOneShotTimer(uint64_t delay_ns) noexcept {
+    // Avoid overflow of delay_ns * LapicTicksPer1Ms, caller just wakes up earlier and reprograms the timer.
+    delay_ns = std::min<uint64_t>(delay_ns, time::NS_IN_SEC);
+    uint64_t count = std::clamp<uint64_t>(delay_ns * LapicTicksPer1Ms / time::NS_IN_MSEC, 1, 0xFFFFFFFF);
+
+    Write(LAPIC_TMRDIV, LAPIC_TMR_X1);
+    Write(LAPIC_LVT_TMR, X86_TIMER_IRQ | LAPIC_TMR_ONESHOT);
+    Write(LAPIC_TMR_INIT_CNT, count);
+}
+
+void StopTimer() noexcept {
+    Write(LAPIC_LVT_TMR, X86_TIMER_IRQ | LAPIC_TMR_MASK);
+    Write(LAPIC_TMR_INIT_CNT, 0);
+}
+
 void Init() noexcept {
     // Determine LAPIC base address.
     uint64_t lapic_base_addr = x86::Rdmsr(IA32_APIC_BASE) & APIC_BASE_MASK;
@@ -178,7 +187,8 @@ void BroadcastIpi(int ipi) noexcept {
 }
 
 void SendIpi(uint32_t lapic_id, int ipi) noexcept {
-    Write(LAPIC_ICRH, (uint64_t)lapic_id << 56);
+    // Destination lives in bits 56..63 of ICR, i.e. in the top byte of ICRH.
+    Write(LAPIC_ICRH, lapic_id << 24);
     Write(LAPIC_ICRL, LAPIC_ICR_ASSERT | (ipi & 0xff));
 }
 
@@ -186,8 +196,16 @@ void SendIpi(uint32_t lapic_id, int ipi) noexcept {
 
 namespace arch {
 
-uint64_t GetClockNs() noexcept {
-    return x86::Rdtsc() / lapic::TscTicksPer1Ms * 1'000'000;
+void StartPeriodicTimer() noexcept {
+    lapic::StartTimer();
+}
+
+void StartOneShotTimer(uint64_t delay_ns) noexcept {
+    lapic::StartOneShotTimer(delay_ns);
+}
+
+void StopTimer() noexcept {
+    lapic::StopTimer();
 }
 
 }
@@ -13,6 +13,12 @@ bool IsInitialized() noexcept;
 // StartTimer initializes APIC timer. Should be called after lapic_calibrate_timer.
 void StartTimer() noexcept;
 
+// StartOneShotTimer makes APIC timer fire once after given delay. Long delays are truncated.
+void StartOneShotTimer(uint64_t delay_ns) noexcept;
+
+// StopTimer stops APIC timer.
+void StopTimer() noexcept;
+
 // CalibrateTimer calibrates APIC timer.
 void CalibrateTimer() noexcept;
 
@@ -122,7 +122,7 @@ uint64_t Thread::DoSwitchTo(Thread& next, uint64_t arg) noexcept {
 }
 
 void DoIdle() noexcept {
-    x86::Hlt();
+    x86::StiHlt();
 }
 
 void InitIdle(sched::Task& th) noexcept {
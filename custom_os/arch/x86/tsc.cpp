@@ -0,0 +1,126 @@
+#include <atomic>
+
+#include "arch/time.h"
+#include "arch/x86/tsc.h"
+#include "arch/x86/x86.h"
+#include "drivers/hpet.h"
+#include "kernel/per_cpu.h"
+#include "kernel/printk.h"
+#include "kernel/time.h"
+
+extern size_t cpu_count;
+
+// Offset which makes this CPU's TSC agree with the boot CPU one.
+PER_CPU_DEFINE(int64_t, tsc_offset);
+
+namespace tsc {
+
+namespace {
+
+constexpr uint32_t CPUID_EXT_MAX = 0x80000000;
+constexpr uint32_t CPUID_EXT_POWER = 0x80000007;
+constexpr uint32_t CPUID_EXT_POWER_INVARIANT_TSC = 1 << 8;
+
+constexpr uint64_t CALIBRATION_MS = 50;
+constexpr uint64_t FS_IN_NS = 1'000'000;
+
+// Counters are converted into nanoseconds as (counter * mult) >> CLOCK_SHIFT, which avoids division on the hot path.
+constexpr uint64_t CLOCK_SHIFT = 32;
+
+bool use_tsc = false;
+uint64_t tsc_mult = 0;
+uint64_t hpet_mult = 0;
+
+std::atomic<bool> sync_request = false;
+std::atomic<uint64_t> sync_reply = 0;
+
+uint64_t Scale(uint64_t counter, uint64_t mult) {
+    return (uint64_t)(((unsigned __int128)counter * mult) >> CLOCK_SHIFT);
+}
+
+bool HasInvariantTsc() {
+    if (x86::Cpuid(CPUID_EXT_MAX).eax < CPUID_EXT_POWER) {
+        return false;
+    }
+    return x86::Cpuid(CPUID_EXT_POWER).edx & CPUID_EXT_POWER_INVARIANT_TSC;
+}
+
+}
+
+void Calibrate() noexcept {
+    // Calibration runs on the boot CPU, which TSC is the reference for others.
+    PER_CPU_SET(tsc_offset, 0);
+
+    hpet_mult = (hpet::PeriodFs() << CLOCK_SHIFT) / FS_IN_NS;
+
+    uint64_t hpet_start = hpet::ReadCounter();
+    uint64_t tsc_start = x86::Rdtsc();
+    hpet::BusySleepMs(CALIBRATION_MS);
+    uint64_t tsc_end = x86::Rdtsc();
+    uint64_t hpet_end = hpet::ReadCounter();
+
+    uint64_t elapsed_ns = Scale(hpet_end - hpet_start, hpet_mult);
+    uint64_t tsc_per_ms = (tsc_end - tsc_start) * time::NS_IN_MSEC / elapsed_ns;
+    tsc_mult = (time::NS_IN_MSEC << CLOCK_SHIFT) / tsc_per_ms;
+
+    // TSC which rate depends on P-states or stops in deep C-states is useless for timekeeping.
+    use_tsc = HasInvariantTsc();
+
+    printk("[tsc] %lu ticks per 1 ms\n", tsc_per_ms);
+    printk("[clock] using %s clocksource\n", use_tsc ? "TSC" : "HPET");
+}
+
+bool IsClocksource() noexcept {
+    return use_tsc;
+}
+
+void SyncApCpu() noexcept {
+    uint64_t t0 = x86::Rdtsc();
+    sync_request.store(true);
+
+    uint64_t boot_tsc = 0;
+    while ((boot_tsc = sync_reply.exchange(0)) == 0) {
+    }
+    uint64_t t1 = x86::Rdtsc();
+
+    // Boot CPU read its TSC somewhere between t0 and t1, assume the middle.
+    int64_t offset = (int64_t)(boot_tsc - (t0 + (t1 - t0) / 2));
+
+    // Difference within the round trip time is a measurement noise, TSCs are most likely synchronized already.
+    if ((uint64_t)(offset < 0 ? -offset : offset) <= t1 - t0) {
+        offset = 0;
+    }
+    PER_CPU_SET(tsc_offset, offset);
+}
+
+void ServeSync() noexcept {
+    if (sync_request.exchange(false)) {
+        sync_reply.store(x86::Rdtsc());
+    }
+}
+
+}
+
+namespace arch {
+
+uint64_t GetClockNs() noexcept {
+    if (!tsc::use_tsc) {
+        return tsc::Scale(hpet::ReadCounter(), tsc::hpet_mult);
+    }
+    return tsc::Scale(x86::Rdtsc() + PER_CPU_GET(tsc_offset), tsc::tsc_mult);
+}
+
+ClockParams GetUserClockParams() noexcept {
+    // User space can't know which CPU it runs on, so only synchronized TSCs could be read directly.
+    if (!tsc::use_tsc) {
+        return {};
+    }
+    for (size_t cpu = 0; cpu < cpu_count; cpu++) {
+        if (*PER_CPU_PTR_FOR(cpu, tsc_offset) != 0) {
+            return {};
+        }
+    }
+    return {.mult = tsc::tsc_mult, .shift = tsc::CLOCK_SHIFT};
+}
+
+}
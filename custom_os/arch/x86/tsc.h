@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+namespace tsc {
+
+// Calibrate measures TSC frequency against HPET and selects the clocksource. HPET must be initialized.
+void Calibrate() noexcept;
+
+// IsClocksource returns true if arch::GetClockNs is backed by TSC rather than HPET.
+bool IsClocksource() noexcept;
+
+// SyncApCpu measures offset of this CPU's TSC from the boot CPU one. Boot CPU must be calling ServeSync meanwhile.
+void SyncApCpu() noexcept;
+
+// ServeSync answers pending SyncApCpu request. Called by boot CPU while it waits for AP to come online.
+void ServeSync() noexcept;
+
+}
@@ -20,8 +20,15 @@ constexpr uint64_t CR0_WP = 1 << 16;
 
 constexpr uint64_t CR4_OSFXSR = 1 << 9;
 constexpr uint64_t CR4_OSXMMEXCPT = 1 << 10;
+constexpr uint64_t CR4_PCIDE = 1 << 17;
 constexpr uint64_t CR4_OSXSAVE = 1 << 18;
 
+// Keep TLB entries tagged with the loaded PCID.
+constexpr uint64_t CR3_NOFLUSH = 1ull << 63;
+
+constexpr uint32_t CPUID_FEATURES = 1;
+constexpr uint32_t CPUID_FEATURES_ECX_PCID = 1 << 17;
+
 constexpr size_t FXSAVE_AREA_SIZE_BYTES = 512;
 constexpr size_t FXSAVE_AREA_ALIGNMENT = 16;
 
@@ -86,6 +93,11 @@ inline void Hlt() noexcept {
     __asm__ volatile ("hlt");
 }
 
+// StiHlt enables interrupts and halts. Interrupt pending before sti is delivered only after hlt, so it can't be missed.
+inline void StiHlt() noexcept {
+    __asm__ volatile ("sti; hlt");
+}
+
 [[noreturn]] inline void HltForever() noexcept {
     for (;;) {
         Hlt();
@@ -214,4 +226,19 @@ inline void Invlpg(uint64_t addr) noexcept {
     __asm__ volatile ("invlpg (%0)" : : "r"(addr) : "memory");
 }
 
+// ClearNonTemporal zeroes memory with stores which bypass caches. Size must be a multiple of 32 bytes.
+inline void ClearNonTemporal(void* addr, size_t size) noexcept {
+    for (uint8_t* p = (uint8_t*)addr; p < (uint8_t*)addr + size; p += 32) {
+        __asm__ volatile (
+            "movnti %1, (%0)\n"
+            "movnti %1, 8(%0)\n"
+            "movnti %1, 16(%0)\n"
+            "movnti %1, 24(%0)\n"
+            : : "r"(p), "r"(0ull) : "memory"
+        );
+    }
+    // Non-temporal stores are weakly ordered.
+    __asm__ volatile ("sfence" : : : "memory");
+}
+
 }
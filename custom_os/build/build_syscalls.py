@@ -1,8 +1,12 @@
+import os
+import re
 import sys
 from struct import unpack, pack
 from elftools.elf.elffile import ELFFile
 
-SYS_max = 21
+# Number of syscalls is taken from the kernel header, so adding one doesn't require changes here.
+with open(os.path.join(os.path.dirname(__file__), "..", "kernel", "syscall.h")) as f:
+    SYS_max = int(re.search(r"\bSYS_max\s*=\s*(\d+)", f.read()).group(1))
 
 # в дальнейшем мы предполагаем, что у нас 2 аргумента
 assert (len(sys.argv) == 2)
@@ -76,4 +76,4 @@ for k, v in global_config.items():
         if v["default"]:
             emit_conf(k, "1")
     else:
-        emit_conf(k, v["default"])
+        emit_conf(k, str(v["default"]))
@@ -27,3 +27,11 @@
 #define KERNEL_KASAN_SHADOW_MEMORY_START 0xffff960000000000
 #define KERNEL_KASAN_SHADOW_MEMORY_SIZE  (KERNEL_DIRECT_PHYS_MAPPING_SIZE / 8)
 #define KERNEL_KASAN_SHADOW_IMAGE_MEMORY_START 0xffffc80000000000
+
+// Vmalloc area spans a single top level entry, so its page tables are shared by all address spaces.
+#define KERNEL_VMALLOC_START 0xffffc90000000000
+#define KERNEL_VMALLOC_SIZE  511 * GB
+
+// KFENCE pool takes the last GB of the vmalloc top level entry, sharing its page tables.
+#define KERNEL_KFENCE_START (KERNEL_VMALLOC_START + KERNEL_VMALLOC_SIZE)
+#define KERNEL_KFENCE_SIZE  1 * GB
@@ -31,6 +31,9 @@
 #define ATA_CMD_WRITE_DMA 0xca
 
 #define ATA_SELECT_MASTER 0xa0
+#define ATA_SELECT_SLAVE  0xb0
+
+#define ATA_IDENTIFY_LBA28_SECTORS 60
 
 #define ATA_SECTOR_SIZE 512
 
@@ -39,13 +42,18 @@
 
 namespace ata {
 
-struct AtaBlockDevice : public BlockDevice {
+struct AtaBlockDevice;
+
+// AtaChannel is an IDE channel with up to two drives. Drives of a channel share its registers, so requests to both
+// of them go through one queue.
+struct AtaChannel {
 private:
+    SpinLock lock_;
     ListHead<BlockDevice::BaseRequest, &BlockDevice::BaseRequest::list> req_queue_;
     pci::PrdtEntry* prdt_ = nullptr;
     uint16_t io_base_;
     uint16_t io_ctrl_base_;
-    uint16_t bar4_;
+    uint16_t bar4_ = 0;
 
 private:
     enum AtaReg : uint16_t {
@@ -111,33 +119,7 @@ private:
         return 0;
     }
 
-    void IssueDmaCommand(BlockDevice::BaseRequest& req) noexcept {
-        prdt_[0].buf_addr = (uint32_t)(uintptr_t)VIRT_TO_PHYS(req.buf.data);
-        prdt_[0].byte_count = req.buf.size;
-        prdt_[0].mark = pci::PRDT_MARK_END;
-
-        int lba = req.sector;
-        int cmd = req.flags.Has(BlockDevice::RequestFlag::Write) ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
-
-        // Setup bus mastering registers.
-        x86::Outb(BmrRegPort(BMR_REG_COMMAND), 0);
-        x86::Outl(BmrRegPort(BMR_REG_PRDT), (uintptr_t)VIRT_TO_PHYS(prdt_));
-
-        // Setup ATA registers.
-        x86::Outb(RegPort(ATA_REG_DRIVE), ATA_SELECT_MASTER | 0x40 | ((lba >> 24) & 0x0f));
-        x86::Outb(RegPort(ATA_REG_FEAT), 0);
-        x86::Outb(RegPort(ATA_REG_SECCOUNT), req.buf.size / ATA_SECTOR_SIZE);
-        x86::Outb(RegPort(ATA_REG_LBA_LO), lba & 0xff);
-        x86::Outb(RegPort(ATA_REG_LBA_MID), (lba >> 8) & 0xff);
-        x86::Outb(RegPort(ATA_REG_LBA_HIGH), (lba >> 16) & 0xff);
-        x86::Outb(RegPort(ATA_REG_COMMAND), cmd);
-
-        if (req.flags.Has(BlockDevice::RequestFlag::Write)) {
-            x86::Outb(BmrRegPort(BMR_REG_COMMAND), BMR_START);
-        } else {
-            x86::Outb(BmrRegPort(BMR_REG_COMMAND), BMR_START | BMR_READ);
-        }
-    }
+    void IssueDmaCommand(BlockDevice::BaseRequest& req) noexcept;
 
 public:
     void IrqHandler() noexcept {
@@ -170,11 +152,11 @@ public:
             printk("[ide] ata error %d lba=%lu\n", err, req->sector);
         }
 
-        EndRequest(std::move(req));
+        req->dev->EndRequest(std::move(req));
         return;
     }
 
-    kern::Errno Submit(BlockDevice::RequestPtr req) noexcept override {
+    kern::Errno Submit(BlockDevice::RequestPtr req) noexcept {
         printk("[ata] %s request to lba=%lu seccount=%lu\n", req->flags.Has(BlockDevice::RequestFlag::Write) ? "WRITE" : "READ", req->sector, req->buf.size / ATA_SECTOR_SIZE);
 
         IrqSafeScopeLocker locker(lock_);
@@ -187,11 +169,9 @@ public:
         return kern::ENOERR;
     }
 
-    kern::Errno Init(pci::Device& pciDev) noexcept {
-        sector_size_ = ATA_SECTOR_SIZE;
-
-        // Select master.
-        x86::Outb(RegPort(ATA_REG_DRIVE), ATA_SELECT_MASTER);
+    // Identify checks that the drive is present and returns its size in sectors.
+    kern::Result<size_t> Identify(uint8_t select) noexcept {
+        x86::Outb(RegPort(ATA_REG_DRIVE), select);
         x86::Outb(ControlRegPort(), 1 << 1);
         x86::Outb(RegPort(ATA_REG_SECCOUNT), 0);
         x86::Outb(RegPort(ATA_REG_LBA_LO), 0);
@@ -199,14 +179,14 @@ public:
         x86::Outb(RegPort(ATA_REG_LBA_HIGH), 0);
         x86::Outb(RegPort(ATA_REG_COMMAND), ATA_CMD_IDENTIFY);
         if (x86::Inb(AltStatusRegPort()) == 0) {
-            printk("[ata] no ATA controller found\n");
+            printk("[ata] no ATA drive 0x%x found\n", select);
             return kern::ENOENT;
         }
 
         uint8_t lba_lo = x86::Inb(RegPort(ATA_REG_LBA_LO));
         uint8_t lba_hi = x86::Inb(RegPort(ATA_REG_LBA_HIGH));
         if (lba_lo != 0 || lba_hi != 0) {
-            printk("cannot init ATA primary master, lba_lo = %d, lba_hi = %d\n", lba_lo, lba_hi);
+            printk("cannot init ATA drive 0x%x, lba_lo = %d, lba_hi = %d\n", select, lba_lo, lba_hi);
             return kern::EINVAL;
         }
 
@@ -216,11 +196,21 @@ public:
             return kern::EIO;
         }
 
+        size_t sector_count = 0;
         for (int i = 0; i < 256; i++) {
-            x86::Inw(RegPort(ATA_REG_DATA));
+            uint16_t word = x86::Inw(RegPort(ATA_REG_DATA));
+            // Words 60-61 hold the number of sectors addressable with LBA28.
+            if (i == ATA_IDENTIFY_LBA28_SECTORS) {
+                sector_count |= word;
+            } else if (i == ATA_IDENTIFY_LBA28_SECTORS + 1) {
+                sector_count |= (size_t)word << 16;
+            }
         }
         x86::Outb(ControlRegPort(), 0);
+        return sector_count;
+    }
 
+    kern::Errno Init(pci::Device& pciDev) noexcept {
         bar4_ = pciDev.ReadBar4() & 0xfffffffc;
         BUG_ON(bar4_ == 0);
 
@@ -233,17 +223,77 @@ public:
         return kern::ENOERR;
     }
 
-    AtaBlockDevice(uint16_t io_base, uint16_t io_ctrl_base)
+    AtaChannel(uint16_t io_base, uint16_t io_ctrl_base)
         : io_base_(io_base)
         , io_ctrl_base_(io_ctrl_base)
     {}
 };
 
-static AtaBlockDevice primary_master(0x1f0, 0x3f6);
+struct AtaBlockDevice : public BlockDevice {
+private:
+    AtaChannel& channel_;
+
+public:
+    const uint8_t select_;
+
+    kern::Errno Submit(BlockDevice::RequestPtr req) noexcept override {
+        req->dev = this;
+        return channel_.Submit(std::move(req));
+    }
+
+    kern::Errno Init() noexcept {
+        auto sectors = channel_.Identify(select_);
+        if (!sectors.Ok()) {
+            return sectors.Err();
+        }
+        sector_size_ = ATA_SECTOR_SIZE;
+        sector_count_ = *sectors;
+        return kern::ENOERR;
+    }
+
+    AtaBlockDevice(AtaChannel& channel, uint8_t select)
+        : channel_(channel)
+        , select_(select)
+    {}
+};
+
+void AtaChannel::IssueDmaCommand(BlockDevice::BaseRequest& req) noexcept {
+    prdt_[0].buf_addr = (uint32_t)(uintptr_t)VIRT_TO_PHYS(req.buf.data);
+    prdt_[0].byte_count = req.buf.size;
+    prdt_[0].mark = pci::PRDT_MARK_END;
+
+    int lba = req.sector;
+    int cmd = req.flags.Has(BlockDevice::RequestFlag::Write) ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    uint8_t select = static_cast<AtaBlockDevice*>(req.dev)->select_;
+
+    // Setup bus mastering registers.
+    x86::Outb(BmrRegPort(BMR_REG_COMMAND), 0);
+    x86::Outl(BmrRegPort(BMR_REG_PRDT), (uintptr_t)VIRT_TO_PHYS(prdt_));
+
+    // Setup ATA registers.
+    x86::Outb(RegPort(ATA_REG_DRIVE), select | 0x40 | ((lba >> 24) & 0x0f));
+    x86::Outb(RegPort(ATA_REG_FEAT), 0);
+    x86::Outb(RegPort(ATA_REG_SECCOUNT), req.buf.size / ATA_SECTOR_SIZE);
+    x86::Outb(RegPort(ATA_REG_LBA_LO), lba & 0xff);
+    x86::Outb(RegPort(ATA_REG_LBA_MID), (lba >> 8) & 0xff);
+    x86::Outb(RegPort(ATA_REG_LBA_HIGH), (lba >> 16) & 0xff);
+    x86::Outb(RegPort(ATA_REG_COMMAND), cmd);
+
+    if (req.flags.Has(BlockDevice::RequestFlag::Write)) {
+        x86::Outb(BmrRegPort(BMR_REG_COMMAND), BMR_START);
+    } else {
+        x86::Outb(BmrRegPort(BMR_REG_COMMAND), BMR_START | BMR_READ);
+    }
+}
+
+static AtaChannel primary_channel(0x1f0, 0x3f6);
+static AtaBlockDevice primary_master(primary_channel, ATA_SELECT_MASTER);
+// Optional second disk, used for swap.
+static AtaBlockDevice primary_slave(primary_channel, ATA_SELECT_SLAVE);
 
 static void Ide1Handler(unsigned int irq) {
     UNUSED(irq);
-    primary_master.IrqHandler();
+    primary_channel.IrqHandler();
 }
 
 static void Ide2Handler(unsigned int irq) {
@@ -259,11 +309,17 @@ void Init() {
 
     printk("[ide] found IDE controller, PCI bus=0x%x, dev=0x%x, func=0x%d, id=0x%x\n", pciDev.bus_, pciDev.dev_, pciDev.func_);
     pciDev.EnableBusMastering();
-    kern::Errno err = primary_master.Init(pciDev);
+    kern::Errno err = primary_master.Init();
     if (!err.Ok()) {
         printk("[ide] cannot init master: %e", err.Code());
         return;
     }
+    err = primary_channel.Init(pciDev);
+    if (!err.Ok()) {
+        printk("[ide] cannot init primary channel: %e", err.Code());
+        return;
+    }
+    bool has_slave = primary_slave.Init().Ok();
 
     ioapic::Enable(14, 41);
     ioapic::Enable(15, 42);
@@ -274,6 +330,11 @@ void Init() {
     if (auto err = BlockDevice::Register(primary_master, "ata"); !err.Ok()) {
         panic("cannot register ata block device: %e\n", err.Code());
     }
+    if (has_slave) {
+        if (auto err = BlockDevice::Register(primary_slave, "ata1"); !err.Ok()) {
+            panic("cannot register ata block device: %e\n", err.Code());
+        }
+    }
 }
 
 }
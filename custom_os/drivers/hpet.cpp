@@ -39,10 +39,14 @@ NO_KASAN void Init() {
     period_fs = (uint32_t)(ReadReg(GENERAL_CAPABILITIES_REGISTER) >> 32);
 }
 
-inline uint64_t ReadCounter() {
+uint64_t ReadCounter() {
     return ReadReg(MAIN_COUNTER_VALUE_REGISTER);
 }
 
+uint64_t PeriodFs() {
+    return period_fs;
+}
+
 static inline bool CheckTmr(uint64_t cnt_val, uint64_t lhs) {
     return (cnt_val) * period_fs < lhs * time::MS_2_FS;
 }
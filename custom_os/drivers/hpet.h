@@ -11,4 +11,10 @@ constexpr uint32_t GENERAL_CAPABILITIES_REGISTER = 0x0;
 void Init();
 void BusySleepMs(uint64_t ms);
 
+// ReadCounter returns value of the main counter.
+uint64_t ReadCounter();
+
+// PeriodFs returns main counter tick period in femtoseconds.
+uint64_t PeriodFs();
+
 }
@@ -20,6 +20,7 @@ class BlockDevice {
 protected:
     SpinLock lock_;
     size_t sector_size_ = 0;
+    size_t sector_count_ = 0;
     const char* name_ = nullptr;
 
 public:
@@ -67,5 +68,9 @@ public:
         return sector_size_;
     }
 
+    size_t SectorCount() const noexcept {
+        return sector_count_;
+    }
+
     virtual kern::Errno Submit(RequestPtr req) noexcept = 0;
 };
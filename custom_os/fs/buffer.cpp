@@ -11,30 +11,88 @@
 #include "lib/spinlock.h"
 
 #include "mm/kmalloc.h"
+#include "mm/lru.h"
 #include "mm/new.h"
+#include "mm/reclaim.h"
 
 namespace fs {
 
 namespace {
 mm::TypedObjectAllocator<Buffer> buffer_alloc;
 
+// Buffers of all pools, nested locks of the pools are taken under the LRU lock.
+mm::Lru<Buffer, &Buffer::lru_list> buffer_lru;
+
+}
+
+class BufferShrinker : public mm::Shrinker {
+public:
+    size_t Count() noexcept override {
+        return buffer_lru.Size();
+    }
+
+    mm::ShrinkResult Scan(size_t nr) noexcept override {
+        ListHead<Buffer, &Buffer::lru_list> evicted;
+        mm::ShrinkResult res;
+        res.scanned = buffer_lru.Scan(nr, [&](Buffer& buf) {
+            if (!buf.pool->EvictBuffer(buf)) {
+                return false;
+            }
+            evicted.InsertLast(buf);
+            return true;
+        });
+
+        while (!evicted.Empty()) {
+            Buffer* buf = &evicted.First();
+            buf->lru_list.Remove();
+            res.freed_pages += 1 << buf->page->Order();
+            mm::FreePage(buf->page);
+            delete buf;
+        }
+        return res;
+    }
+};
+
+namespace {
+
+BufferShrinker buffer_shrinker;
+
+}
+
+void BufferPool::RegisterShrinker() noexcept {
+    mm::RegisterShrinker(buffer_shrinker);
 }
 
 BufferPool::~BufferPool() {
+    IrqSafeScopeLocker locker(buffer_lru.lock_);
     for (auto it = buffers_.begin(); it != buffers_.end();) {
-        auto next = ++it;
+        auto next = it;
+        ++next;
+        buffer_lru.RemoveLocked(*it);
         it->Unref();
         it = next;
     }
 }
 
+bool BufferPool::EvictBuffer(Buffer& buf) noexcept {
+    IrqSafeScopeLocker locker(lock_);
+    if (!buf.HasFlag(Buffer::UpToDate) || buf.HasFlag(Buffer::Locked | Buffer::Dirty) || buf.RefCount() != 1) {
+        return false;
+    }
+
+    buffers_.erase(buffers_.iterator_to(buf));
+    buf.ClearFlag(Buffer::InPool);
+    buf.Unref();
+    return true;
+}
+
 BufferPtr Buffer::New(size_t size) noexcept {
     BufferPtr buf(new (buffer_alloc) Buffer(size));
     if (!buf) {
         return nullptr;
     }
 
-    buf->page = mm::AllocPage(DIV_ROUNDUP(size, PAGE_SIZE));
+    buf->page = mm::AllocPage(mm::PageAllocOrderBySize(size));
     if (buf->page == nullptr) {
         return nullptr;
     }
@@ -103,6 +161,7 @@ kern::Result<BufferPtr> BufferPool::ReadBuffer(size_t index) noexcept {
     });
 
     if (buf) {
+        buf->SetFlag(Buffer::Referenced);
         buf->WaitUpToDate();
         return buf;
     }
@@ -130,6 +189,7 @@ kern::Result<BufferPtr> BufferPool::ReadBuffer(size_t index) noexcept {
         buf->WaitUpToDate();
         return buf;
     }
+    buffer_lru.Add(*new_buf);
 
     if (auto err = ReadAsync(new_buf, dev_); !err.Ok()) {
         new_buf->Unref();
@@ -19,6 +19,10 @@ public:
     static constexpr uint32_t Dirty = 1 << 1;
     static constexpr uint32_t UpToDate = 1 << 2;
     static constexpr uint32_t InPool = 1 << 3;
+    // Buffer is on the LRU list of the buffer pools, see mm/lru.h.
+    static constexpr uint32_t Lru = 1 << 4;
+    static constexpr uint32_t Active = 1 << 5;
+    static constexpr uint32_t Referenced = 1 << 6;
 
 private:
     Buffer(size_t size)
@@ -39,6 +43,7 @@ public:
     boost::intrusive::set_member_hook<> buffer_pool_node;
 
     ListNode dirty_list;
+    ListNode lru_list;
 
 public:
     static BufferPtr New(size_t size) noexcept;
@@ -59,6 +64,18 @@ public:
         wq.WakeAll();
     }
 
+    bool HasFlag(uint32_t f) const noexcept {
+        return flags.load(std::memory_order_relaxed) & f;
+    }
+
+    void SetFlag(uint32_t f) noexcept {
+        flags.fetch_or(f, std::memory_order_relaxed);
+    }
+
+    void ClearFlag(uint32_t f) noexcept {
+        flags.fetch_and(~f, std::memory_order_relaxed);
+    }
+
     void MarkDirty() noexcept;
 
     const void* Data() const noexcept {
@@ -96,6 +113,11 @@ private:
 private:
     BufferPtr FindBufferLocked(size_t index) noexcept;
 
+    // EvictBuffer removes the buffer from the pool if it's clean and nobody else references it. Buffer is left unreferenced.
+    bool EvictBuffer(Buffer& buf) noexcept;
+
+    friend class BufferShrinker;
+
 public:
     BufferPool(BlockDevice* dev, size_t block_size)
         : dev_(dev)
@@ -105,6 +127,9 @@ public:
     ~BufferPool();
 
     kern::Result<BufferPtr> ReadBuffer(size_t index) noexcept;
+
+    // RegisterShrinker lets the memory reclaim evict idle buffers of all pools.
+    static void RegisterShrinker() noexcept;
 };
 
 }
@@ -180,6 +180,7 @@ kern::Errno Ext2Inode::Lookup(vfs::Dentry& dentry) noexcept {
         }
 
 
+        uint32_t ino = 0;
         OnDiskDirEntryHead* head = (OnDiskDirEntryHead*)page->Virt();
         uint8_t* end = AdvancePointer((uint8_t*)head, PAGE_SIZE);
         for (; (uint8_t*)head < end; head = AdvancePointer(head, head->rec_len)) {
@@ -191,13 +192,20 @@ kern::Errno Ext2Inode::Lookup(vfs::Dentry& dentry) noexcept {
                 continue;
             }
 
-            auto inode = fs->ReadInode(head->inode);
-            if (!inode.Ok()) {
-                return inode.Err();
-            }
-            dentry.SetInode(std::move(*inode));
-            return kern::ENOERR;
+            ino = head->inode;
+            break;
+        }
+        page->Unref();
+
+        if (ino == 0) {
+            continue;
         }
+        auto inode = fs->ReadInode(ino);
+        if (!inode.Ok()) {
+            return inode.Err();
+        }
+        dentry.SetInode(std::move(*inode));
+        return kern::ENOERR;
     }
 
     dentry.MakeInvalid();
@@ -207,11 +215,10 @@ kern::Errno Ext2Inode::Lookup(vfs::Dentry& dentry) noexcept {
 kern::Errno Ext2Inode::ReadPage(mm::Page& page) noexcept {
     auto fs = reinterpret_cast<Ext2FsRoot*>(owner_);
 
-    memset(page.Virt(), '\0', PAGE_SIZE);
-
     size_t size = size_.load(std::memory_order_relaxed);
     size_t offset = page.pc_index * PAGE_SIZE;
     if (offset >= size) {
+        memset(page.Virt(), '\0', PAGE_SIZE);
         return kern::ENOERR;
     }
 
@@ -223,6 +230,7 @@ kern::Errno Ext2Inode::ReadPage(mm::Page& page) noexcept {
 
     // Page containing block is not yet allocated on disk.
     if (*block_id == 0) {
+        memset(page.Virt(), '\0', PAGE_SIZE);
         return kern::ENOERR;
     }
 
@@ -231,8 +239,10 @@ kern::Errno Ext2Inode::ReadPage(mm::Page& page) noexcept {
         return block_buf.Err();
     }
 
+    // Only the tail past the end of file needs zeroing.
     size_t sz = std::min<size_t>(PAGE_SIZE, size - offset);
     memcpy(page.Virt(), block_buf->Data(), sz);
+    memset((uint8_t*)page.Virt() + sz, '\0', PAGE_SIZE - sz);
 
     printk("[ext2] read page, inode=%lu page_idx=%lu\n", id_, page.pc_index, sz);
 
@@ -7,19 +7,22 @@
 namespace vfs {
 
 kern::Result<mm::Page*> Inode::LoadPage(size_t idx) noexcept {
-    mm::Page* page = page_cache_.GetPage(idx);
+    mm::Page* page = page_cache_.GetPage(idx, this);
     if (!page) {
         return kern::ENOMEM;
     }
     PageCache::LockPage(*page);
-    auto ret = ReadPage(*page);
-    if (!ret.Ok()) {
-        PageCache::UnlockPage(*page);
-        page->Unref();
-        return ret;
+    if (!page->HasFlag(mm::Page::UpToDate)) {
+        // Page could be mapped into user space, so read it only once: later it's updated in place.
+        auto ret = ReadPage(*page);
+        if (!ret.Ok()) {
+            PageCache::UnlockPage(*page);
+            page->Unref();
+            return ret;
+        }
+        page->SetFlag(mm::Page::UpToDate);
     }
     PageCache::UnlockPage(*page);
-    page->Unref();
     return page;
 }
 
@@ -52,6 +55,7 @@ kern::Result<size_t> InodeFile::ReadAt(mm::MemBuf buf, size_t offset) noexcept {
 
         size_t to_copy = MIN(max_size_to_copy - read, PAGE_SIZE - offset_in_page);
         auto err = buf.CopyFrom((const void*)((char*)page->Virt() + offset_in_page), to_copy);
+        page->Unref();
         if (!err.Ok()) {
             return err;
         }
@@ -95,11 +99,11 @@ kern::Result<size_t> InodeFile::WriteAt(mm::MemBuf buf, size_t offset) noexcept
 
         size_t to_copy = MIN(buf.Size(), PAGE_SIZE - offset_in_page);
         auto err = buf.CopyTo((void*)((char*)page->Virt() + offset_in_page), to_copy);
-        if (!err.Ok()) {
-            return err;
+        if (err.Ok()) {
+            err = inode.WritePage(**page);
         }
-
-        if (auto err = inode.WritePage(**page); !err.Ok()) {
+        page->Unref();
+        if (!err.Ok()) {
             return err;
         }
 
@@ -1,7 +1,10 @@
 #include "fs/page_cache.h"
+#include "fs/vfs.h"
 #include "kernel/wait.h"
 #include "kernel/panic.h"
 #include "kernel/time.h"
+#include "mm/lru.h"
+#include "mm/reclaim.h"
 
 constexpr size_t MAX_PAGE_WAIT_QUEUES_BITS = 8;
 
@@ -17,6 +20,47 @@ kern::WaitQueue& PageWaitQueue(mm::Page& page) {
 SpinLock ditry_pages_lock;
 ListHead<mm::Page, &mm::Page::pc_dirty_list> dirty_pages;
 
+// Pages of all caches, nested locks of the caches are taken under the LRU lock.
+mm::Lru<mm::Page, &mm::Page::lru_list> page_lru;
+
+}
+
+class PageCacheShrinker : public mm::Shrinker {
+public:
+    size_t Count() noexcept override {
+        return page_lru.Size();
+    }
+
+    mm::ShrinkResult Scan(size_t nr) noexcept override {
+        ListHead<mm::Page, &mm::Page::lru_list> evicted;
+        mm::ShrinkResult res;
+        res.scanned = page_lru.Scan(nr, [&](mm::Page& page) {
+            auto inode = static_cast<vfs::Inode*>(page.pc_owner);
+            if (!inode->page_cache_.EvictPage(page)) {
+                return false;
+            }
+            evicted.InsertLast(page);
+            return true;
+        });
+
+        while (!evicted.Empty()) {
+            mm::Page& page = evicted.First();
+            page.lru_list.Remove();
+            mm::FreePage(&page);
+            res.freed_pages++;
+        }
+        return res;
+    }
+};
+
+namespace {
+
+PageCacheShrinker page_cache_shrinker;
+
+}
+
+void PageCache::RegisterShrinker() noexcept {
+    mm::RegisterShrinker(page_cache_shrinker);
 }
 
 void PageCache::MarkDirty(mm::Page& page) noexcept {
@@ -29,6 +73,31 @@ void PageCache::MarkDirty(mm::Page& page) noexcept {
     dirty_pages.InsertLast(page);
 }
 
+void PageCache::WritebackDirty() noexcept {
+    for (;;) {
+        IrqSafeScopeLocker locker(ditry_pages_lock);
+        if (dirty_pages.Empty()) {
+            break;
+        }
+        mm::Page& page = dirty_pages.First();
+        page.pc_dirty_list.Remove();
+        // Reference pins the page while it's written: clean unreferenced pages could be migrated.
+        page.Ref();
+        // Clear the flag before copying: writes that race with writeback will mark the page dirty again.
+        page.ClearFlag(mm::Page::Dirty);
+        locker.Unlock();
+
+        auto inode = static_cast<vfs::Inode*>(page.pc_owner);
+        LockPage(page);
+        auto err = inode->WritePage(page);
+        UnlockPage(page);
+        page.Unref();
+        if (!err.Ok()) {
+            printk("[writeback] failed to write page: %e\n", err.Code());
+        }
+    }
+}
+
 void PageCache::LockPage(mm::Page& page) noexcept {
     PageWaitQueue(page).WaitCond([&]() {
         return !page.TestAndSetFlag(mm::Page::Locked);
@@ -49,36 +118,100 @@ mm::Page* PageCache::GetPageLocked(size_t index) noexcept {
     return nullptr;
 }
 
-mm::Page* PageCache::GetPage(size_t index) noexcept {
+mm::Page* PageCache::GetPage(size_t index, void* owner) noexcept {
     mm::Page* page = WithIrqSafeLocked(lock_, [&]() {
-        return GetPageLocked(index);
+        mm::Page* p = GetPageLocked(index);
+        if (p) {
+            p->Ref();
+        }
+        return p;
     });
 
     if (page) {
+        page->SetFlag(mm::Page::Referenced);
         return page;
     }
 
-    mm::Page* new_page = mm::AllocPage(0);
+    mm::Page* new_page = mm::AllocPage(0, mm::AllocFlag::Movable);
     if (!new_page) {
         return nullptr;
     }
     new_page->pc_index = index;
-    new_page->SetFlag(mm::Page::InFileCache);
-    new_page->Ref();
+    // Reclaim reads the owner as soon as the page is on the LRU, even before it's read.
+    new_page->pc_owner = owner;
 
     // Check if someone have inserted page while we were in the allocator.
     page = WithIrqSafeLocked(lock_, [&]() {
         mm::Page* p = GetPageLocked(index);
         if (p) {
+            p->Ref();
             return p;
         }
+        // One reference is held by the cache, another one is returned to the caller.
+        new_page->Ref();
+        new_page->Ref();
+        new_page->ClearFlag(mm::Page::UpToDate | mm::Page::Dirty);
+        new_page->SetFlag(mm::Page::InFileCache);
         pages_head_.InsertFirst(*new_page);
         return new_page;
     });
 
     if (page != new_page) {
         mm::FreePage(new_page);
+    } else {
+        page_lru.Add(*page);
     }
 
     return page;
 }
+
+bool PageCache::EvictPage(mm::Page& page) noexcept {
+    IrqSafeScopeLocker locker(lock_);
+    if (!page.HasFlag(mm::Page::InFileCache) || GetPageLocked(page.pc_index) != &page) {
+        return false;
+    }
+    // Writeback takes its reference before cleaning the page, so check flags first.
+    if (page.HasFlag(mm::Page::Locked | mm::Page::Dirty) || page.ref_count.RefCount() != 1) {
+        return false;
+    }
+
+    page.pc_list.Remove();
+    page.ClearFlag(mm::Page::InFileCache | mm::Page::UpToDate);
+    page.Unref();
+    return true;
+}
+
+bool PageCache::MigratePage(mm::Page& page, mm::Page& new_page) noexcept {
+    IrqSafeScopeLocker locker(lock_);
+    if (!page.HasFlag(mm::Page::InFileCache) || GetPageLocked(page.pc_index) != &page) {
+        return false;
+    }
+    // Readers, writeback and mappings hold references, so the cache reference alone means the page is idle.
+    if (page.HasFlag(mm::Page::Locked | mm::Page::Dirty) || page.ref_count.RefCount() != 1) {
+        return false;
+    }
+
+    memcpy(new_page.Virt(), page.Virt(), PAGE_SIZE);
+    new_page.pc_owner = page.pc_owner;
+    new_page.pc_index = page.pc_index;
+    new_page.ClearFlag(mm::Page::Dirty | mm::Page::Locked);
+    new_page.SetFlag(mm::Page::UpToDate | mm::Page::InFileCache);
+    new_page.Ref();
+    new_page.pc_list.Insert(page.pc_list.prev, &page.pc_list);
+
+    page.pc_list.Remove();
+    page.ClearFlag(mm::Page::InFileCache | mm::Page::UpToDate);
+    page.Unref();
+    page_lru.ReplaceLocked(page, new_page);
+    return true;
+}
+
+bool PageCache::MigrateCachedPage(mm::Page& page, mm::Page& new_page) noexcept {
+    // Cached pages leave the LRU under its lock before they are freed, so the owner can't change while it's held.
+    IrqSafeScopeLocker locker(page_lru.lock_);
+    if (!page.HasFlag(mm::Page::Lru) || !page.HasFlag(mm::Page::InFileCache) || !page.HasFlag(mm::Page::UpToDate)) {
+        return false;
+    }
+    auto inode = static_cast<vfs::Inode*>(page.pc_owner);
+    return inode->page_cache_.MigratePage(page, new_page);
+}
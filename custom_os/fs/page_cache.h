@@ -13,12 +13,36 @@ private:
 
     mm::Page* GetPageLocked(size_t index) noexcept;
 
+    // EvictPage removes the page from the cache if it's clean and nobody else references it. Page is left unreferenced.
+    bool EvictPage(mm::Page& page) noexcept;
+
+    // MigratePage replaces the page with a copy in new_page, if nobody else references it. Must be called with the LRU
+    // lock held. Old page is left unreferenced.
+    bool MigratePage(mm::Page& page, mm::Page& new_page) noexcept;
+
+    friend class PageCacheShrinker;
+
 public:
     PageCache() = default;
-    mm::Page* GetPage(size_t index) noexcept;
+
+    // GetPage finds or allocates a page of the cache at given index, owner is the inode of the cache. Returned page is
+    // referenced, caller must Unref it.
+    mm::Page* GetPage(size_t index, void* owner) noexcept;
+
+    // MigrateCachedPage replaces a page of any cache with a copy in new_page, if it's still cached and idle. The page
+    // may be evicted and reused meanwhile, so it's only a candidate. Old page is left unreferenced.
+    static bool MigrateCachedPage(mm::Page& page, mm::Page& new_page) noexcept;
 
 public:
+    // MarkDirty queues page written through a shared mapping for writeback.
     static void MarkDirty(mm::Page& page) noexcept;
+
+    // WritebackDirty passes all dirty pages to their file systems.
+    static void WritebackDirty() noexcept;
+
     static void LockPage(mm::Page& page) noexcept;
+
+    // RegisterShrinker lets the memory reclaim evict idle pages of all caches.
+    static void RegisterShrinker() noexcept;
     static void UnlockPage(mm::Page& page) noexcept;
 };
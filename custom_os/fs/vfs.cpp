@@ -314,6 +314,8 @@ kern::Errno SysClose(sched::Task* curr, int32_t fd) noexcept {
 REGISTER_SYSCALL(close, SysClose);
 
 void Init() {
+    PageCache::RegisterShrinker();
+    fs::BufferPool::RegisterShrinker();
 }
 
 } // namespace vfs
@@ -57,6 +57,7 @@ public:
 
     virtual kern::Errno Sync() noexcept = 0;
 
+    // LoadPage returns up to date page of the page cache. Returned page is referenced, caller must Unref it.
     kern::Result<mm::Page*> LoadPage(size_t idx) noexcept;
 
     bool IsDir() const {
@@ -165,6 +166,7 @@ public:
         return kern::ENOSYS;
     }
 
+    // LoadPage returns referenced page of the file content at given index.
     virtual kern::Result<mm::Page*> LoadPage(size_t) noexcept {
         return kern::ENOSYS;
     }
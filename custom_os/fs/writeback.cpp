@@ -40,6 +40,9 @@ void DoWriteback(BufferPtr buf) noexcept {
 
 void BuffersWritebackThread(void*) noexcept {
     for (;;) {
+        // Pages dirtied through shared mappings turn into dirty buffers.
+        PageCache::WritebackDirty();
+
         for (;;) {
             IrqSafeScopeLocker locker(dirty_buffers_lock);
             if (dirty_buffers.Empty()) {
@@ -78,11 +81,17 @@ void BuffersWritebackStart() noexcept {
     }
 }
 
-kern::Errno SysSync(sched::Task*) noexcept {
+void Sync() noexcept {
+    PageCache::WritebackDirty();
+
     IrqSafeScopeLocker locker(dirty_buffers_lock);
     sync_wq.WaitCondLocked(locker, [&]() {
         return dirty_buffers.Empty();
     });
+}
+
+kern::Errno SysSync(sched::Task*) noexcept {
+    Sync();
     return kern::ENOERR;
 }
 REGISTER_SYSCALL(sync, SysSync);
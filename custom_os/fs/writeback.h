@@ -4,4 +4,7 @@ namespace fs {
 
 void BuffersWritebackStart() noexcept;
 
+// Sync writes back all dirty pages and buffers and waits for completion.
+void Sync() noexcept;
+
 }
@@ -16,7 +16,12 @@ from testlib.tasks import multiboot
 from testlib.tasks import lapic
 from testlib.tasks import page_alloc
 from testlib.tasks import slab_alloc
+from testlib.tasks import vmalloc
+from testlib.tasks import kfence
 from testlib.tasks import pipes
+from testlib.tasks import sched
+from testlib.tasks import reclaim
+from testlib.tasks import swap
 from testlib.tasks import fpu_context
 from testlib.tasks import signal_delivery
 
@@ -62,6 +67,20 @@ TASKS = [
             slab_alloc.TestSlabAlloc,
         ],
     ),
+    Task(
+        name="vmalloc",
+        max_score=100,
+        tests=[
+            vmalloc.TestVmalloc,
+        ],
+    ),
+    Task(
+        name="kfence",
+        max_score=100,
+        tests=[
+            kfence.TestKfence,
+        ],
+    ),
     Task(
         name="signal-delivery",
         max_score=200,
@@ -83,6 +102,27 @@ TASKS = [
             pipes.TestPipes,
         ],
     ),
+    Task(
+        name="sched",
+        max_score=100,
+        tests=[
+            sched.TestSched,
+        ],
+    ),
+    Task(
+        name="reclaim",
+        max_score=100,
+        tests=[
+            reclaim.TestReclaim,
+        ],
+    ),
+    Task(
+        name="swap",
+        max_score=100,
+        tests=[
+            swap.TestSwap,
+        ],
+    ),
 ]
 
 def run_pre_build(tester):
@@ -51,6 +51,8 @@ kern::Result<sched::TaskPtr> DoClone(void* ip, void* sp, int flags) noexcept {
         child->file_table = std::move(*new_ft);
 
         child->sigactions = curr->sigactions;
+
+        sched::SetNice(child.Val().Get(), curr->nice);
     }
 
     if (auto err = arch::Thread::CloneCurrent(&child->arch_thread, flags, ip, sp); !err.Ok()) {
@@ -56,7 +56,7 @@ static kern::Errno Execve(sched::Task* curr, vfs::FilePtr new_exe, const mm::Mem
     }
 
     curr->vmem = std::move(*new_vmem);
-    curr->vmem->SwitchTo();
+    curr->vmem->Activate();
 
     for (int i = 0; i < hdr->e_phnum; i++) {
         Elf64_Phdr* phdr = (Elf64_Phdr*)(phdrs.get() + i * hdr->e_phentsize);
@@ -126,7 +126,7 @@ Errno Execve(vfs::PathPtr path, const mm::MemBuf& argv, const mm::MemBuf& env) n
 
     curr->vmem = std::move(curr_vmem);
     if (curr->vmem) {
-        curr->vmem->SwitchTo();
+        curr->vmem->Activate();
     }
 
     return res;
@@ -16,12 +16,16 @@
 #include "kernel/printk.h"
 #include "kernel/sched.h"
 #include "kernel/time.h"
+#include "kernel/vsyscall.h"
 #include "lib/shared_ptr.h"
 #include "linker.h"
 #include "mm/kasan.h"
+#include "mm/kfence.h"
 #include "mm/kmalloc.h"
 #include "mm/new.h"
 #include "mm/page_alloc.h"
+#include "mm/reclaim.h"
+#include "mm/swap.h"
 #include "mm/vmem.h"
 
 namespace arch {
@@ -168,6 +172,10 @@ __attribute__((weak)) void KernelPid1() noexcept {
 // InitAndRun finishes kernel initialization calling initializers which require PID 1 created or process context.
 void InitAndRun(void*) noexcept {
     fs::BuffersWritebackStart();
+    mm::ZeroPagesStart();
+    mm::SwapStart();
+    // All shrinkers are registered by now.
+    mm::ReclaimStart();
 
     KernelPid1();
 }
@@ -184,11 +192,13 @@ extern "C" void KernelMain() noexcept {
     DumpMemory();
 
     mm::InitGlobalVmem();
+    kern::InitVsyscall();
     kasan::Init();
 
     mm::InitPageAlloc();
     mm::InitKmalloc();
     mm::InitVmem();
+    kfence::Init();
 
     kern::IrqEnable();
     arch::InitTimers();
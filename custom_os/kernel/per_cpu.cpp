@@ -19,6 +19,8 @@ void InitPerCpu() {
         if (!per_cpu_section_addr) {
             panic("cannot allocate memory for per-cpu section (CPU %d)", i);
         }
+        // Per-cpu variables are zero-initialized like any other global.
+        memset(per_cpu_section_addr, 0, pgcnt * PAGE_SIZE);
         per_cpu_sections[i] = (uintptr_t)per_cpu_section_addr;
     }
 }
@@ -6,9 +6,11 @@
 
 extern uintptr_t per_cpu_sections[];
 
+// Every CPU gets its own copy of the whole section, so variables don't need cache line alignment to avoid false sharing.
+// Keep them packed: .per_cpu lives at address 0 and must not overlap with the multiboot header.
 #define PER_CPU_DEFINE(type, varname) \
     PER_CPU_DECLARE(type, varname); \
-    __attribute__((section(".per_cpu"), aligned(CACHE_LINE_SIZE_BYTES))) type __per_cpu_##varname
+    __attribute__((section(".per_cpu"))) type __per_cpu_##varname
 
 #define PER_CPU_DECLARE(type, varname) extern "C" type __per_cpu_##varname
 
@@ -22,24 +22,141 @@ namespace arch {
 
 void DoIdle() noexcept;
 void InitIdle(sched::Task&) noexcept;
+void WakeCpu(size_t cpu) noexcept;
 
 }
 
 constexpr size_t MAX_TASK_COUNT = 1 << 18;
 
+// How often busy CPUs try to pull tasks from the most loaded CPU.
+constexpr uint64_t LOAD_BALANCE_INTERVAL_TICKS = 20;
+
+using namespace time::literals;
+
+// Period during which every runnable task should get the CPU at least once.
+constexpr uint64_t SCHED_LATENCY_NS = 6_ms;
+// Minimal time slice, so that a long run queue doesn't turn into a context switch storm.
+constexpr uint64_t SCHED_MIN_GRANULARITY_NS = 750'000_ns;
+// Vruntime lag after which a queued task preempts the current one.
+constexpr uint64_t SCHED_WAKEUP_GRANULARITY_NS = 1_ms;
+
+namespace sched {
+struct RunQueue;
+}
+
 size_t cpu_count = 0;
 PER_CPU_DEFINE(size_t, preempt_count);
 PER_CPU_DEFINE(sched::Task*, task_idle);
 PER_CPU_DEFINE(sched::Task*, task_current);
+PER_CPU_DEFINE(sched::RunQueue*, run_queue);
+PER_CPU_DEFINE(uint64_t, load_balance_ticks);
+// Set when current task should be switched out as soon as it's safe to do so.
+PER_CPU_DEFINE(bool, need_resched);
 
 namespace sched {
 
+// Weights of nice levels -20..19. Each nice level changes CPU share by ~10%.
+static constexpr uint64_t NICE_TO_WEIGHT[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
+static_assert(NICE_TO_WEIGHT[-NICE_MIN] == NICE_0_WEIGHT);
+
+struct TaskVruntimeKey {
+    using type = uint64_t;
+
+    uint64_t operator()(const Task& task) const noexcept {
+        return task.vruntime;
+    }
+};
+
 struct RunQueue {
     SpinLock lock;
-    ListHead<Task, &Task::run_queue_list> TasksHead;
+
+    // Queued tasks ordered by vruntime. Running task is not in the tree, so its vruntime could change freely.
+    boost::intrusive::multiset<
+        Task,
+        boost::intrusive::member_hook<Task, boost::intrusive::set_member_hook<>, &Task::run_queue_node>,
+        boost::intrusive::key_of_value<TaskVruntimeKey>
+    > tasks_tree;
+
+    // Monotonically growing lower bound of vruntime on this CPU. New, woken up and migrated tasks are placed relative to it.
+    uint64_t min_vruntime = 0;
+
+    // Sum of weights of queued tasks.
+    uint64_t queued_weight = 0;
+
+    // Number of tasks in tasks_tree. Modified under the lock, but read locklessly by load balancer.
+    std::atomic<size_t> nr_queued = 0;
+
+    size_t cpu;
+
+    RunQueue(size_t cpu) noexcept
+        : cpu(cpu)
+    {}
+
+    void Enqueue(Task& task) noexcept {
+        task.cpu = cpu;
+        tasks_tree.insert(task);
+        queued_weight += task.weight;
+        nr_queued.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Dequeue(Task& task) noexcept {
+        tasks_tree.erase(tasks_tree.iterator_to(task));
+        queued_weight -= task.weight;
+        nr_queued.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    Task* Leftmost() noexcept {
+        if (tasks_tree.empty()) {
+            return nullptr;
+        }
+        return &*tasks_tree.begin();
+    }
+
+    size_t Load() const noexcept {
+        return nr_queued.load(std::memory_order_relaxed);
+    }
 };
 
-static RunQueue global_rq;
+static RunQueue* CpuRunQueue(size_t cpu) {
+    return *PER_CPU_PTR_FOR(cpu, run_queue);
+}
+
+// LockTaskRunQueue locks the run queue which owns the task. Task may migrate while we are spinning, so recheck after locking.
+static RunQueue* LockTaskRunQueue(Task* task) {
+    for (;;) {
+        RunQueue* rq = CpuRunQueue(task->cpu);
+        rq->lock.RawLock();
+        if (rq->cpu == task->cpu) {
+            return rq;
+        }
+        rq->lock.RawUnlock();
+    }
+}
+
+// LockRunQueuePair locks both run queues in CPU order to avoid deadlocks between CPUs balancing each other.
+static void LockRunQueuePair(RunQueue& a, RunQueue& b) {
+    if (a.cpu < b.cpu) {
+        a.lock.RawLock();
+        b.lock.RawLock();
+    } else {
+        b.lock.RawLock();
+        a.lock.RawLock();
+    }
+}
+
+static void UnlockRunQueuePair(RunQueue& a, RunQueue& b) {
+    a.lock.RawUnlock();
+    b.lock.RawUnlock();
+}
 
 static SpinLock pid_bitmap_lock;
 static SeqBitmap* pid_bitmap = nullptr;
@@ -67,6 +184,7 @@ kern::Result<TaskPtr> AllocTask(mm::AllocFlags af_flags) {
     task->pid = pid;
     task->state = TASK_STARTING;
     task->running = false;
+    task->cpu = PER_CPU_GET(cpu_id);
     task->Ref();
 
     WithIrqSafeLocked(all_tasks_lock, [&]() {
@@ -78,18 +196,38 @@ kern::Result<TaskPtr> AllocTask(mm::AllocFlags af_flags) {
 
 void Init() {
     pid_bitmap = new (mm::AllocFlag::NoSleep) SeqBitmap(MAX_TASK_COUNT, 1, mm::AllocFlag::NoSleep);
+
+    // Run queues of all CPUs must exist before the first WakeTask, because tasks may be woken up on any CPU.
+    for (size_t cpu = 0; cpu < cpu_count; cpu++) {
+        RunQueue* rq = new (mm::AllocFlag::NoSleep) RunQueue(cpu);
+        if (!rq) {
+            panic("cannot allocate run queue for CPU#%lu", cpu);
+        }
+        *PER_CPU_PTR_FOR(cpu, run_queue) = rq;
+    }
+}
+
+void SetNice(Task* task, int nice) {
+    nice = std::clamp(nice, NICE_MIN, NICE_MAX);
+    task->nice = nice;
+    task->weight = NICE_TO_WEIGHT[nice - NICE_MIN];
 }
 
 void PreemptDisable() {
     (*PER_CPU_PTR(preempt_count))++;
 }
 
+bool Preemptible() {
+    return PER_CPU_GET(preempt_count) == 0;
+}
+
 void PreemptEnable() {
     (*PER_CPU_PTR(preempt_count))--;
-}
 
-bool Preemptible() {
-    return PER_CPU_GET(preempt_count) == 0;
+    // Timer tick or wakeup could happen inside the critical section, don't wait for the next tick to handle it.
+    if (PER_CPU_GET(need_resched) && Preemptible() && kern::IsIrqEnabled()) {
+        PreemptIfNeeded();
+    }
 }
 
 void InitOnCpu() {
@@ -103,9 +241,13 @@ void InitOnCpu() {
     idle_task->vmem = nullptr;
     arch::InitIdle(*idle_task);
 
+    idle_task->cpu = PER_CPU_GET(cpu_id);
+
     PER_CPU_SET(task_current, idle_task);
     PER_CPU_SET(task_idle, idle_task);
     PER_CPU_SET(preempt_count, 1);
+    PER_CPU_SET(load_balance_ticks, 0);
+    PER_CPU_SET(need_resched, false);
 }
 
 
@@ -115,7 +257,15 @@ void Start() {
     // This is the idle task.
     for (;;) {
         Preempt();
-        arch::DoIdle();
+
+        // Check for work with IRQs disabled: wakeup IPI sent after the check stays pending until DoIdle halts.
+        kern::IrqDisable();
+        if (!PER_CPU_GET(need_resched) && PER_CPU_GET(run_queue)->Load() == 0) {
+            time::StopTickIdle();
+            arch::DoIdle();
+        } else {
+            kern::IrqEnable();
+        }
     }
 }
 
@@ -123,6 +273,59 @@ static bool IsIdle(Task* task) {
     return task == PER_CPU_GET(task_idle);
 }
 
+// AccountRuntime charges CPU time consumed since the last accounting to the task. Must be called on the CPU running the task.
+static void AccountRuntime(Task* task) {
+    uint64_t now = time::NowMonotonic().nanoseconds;
+    if (now <= task->exec_start_ns) {
+        return;
+    }
+
+    uint64_t delta = now - task->exec_start_ns;
+    task->exec_start_ns = now;
+    task->sum_exec_ns += delta;
+    task->vruntime += delta * NICE_0_WEIGHT / task->weight;
+}
+
+// TimeSlice returns how long the task could run before giving CPU to others.
+// Scheduling period is split between all runnable tasks proportionally to their weights.
+static uint64_t TimeSlice(const RunQueue& rq, const Task& task) {
+    size_t nr_running = rq.Load() + 1;
+    uint64_t period = SCHED_LATENCY_NS;
+    if (nr_running > SCHED_LATENCY_NS / SCHED_MIN_GRANULARITY_NS) {
+        period = nr_running * SCHED_MIN_GRANULARITY_NS;
+    }
+    return std::max(period * task.weight / (rq.queued_weight + task.weight), SCHED_MIN_GRANULARITY_NS);
+}
+
+// ShouldPreemptLocked checks if current task exhausted its time slice or a queued task is too far behind it.
+static bool ShouldPreemptLocked(const RunQueue& rq, Task* curr) {
+    if (rq.tasks_tree.empty()) {
+        return false;
+    }
+
+    if (curr->sum_exec_ns - curr->slice_start_ns >= TimeSlice(rq, *curr)) {
+        return true;
+    }
+
+    // Woken up tasks are placed near min_vruntime, so IO-bound tasks preempt CPU hogs without waiting for the slice end.
+    const Task& first = *rq.tasks_tree.begin();
+    return first.vruntime + SCHED_WAKEUP_GRANULARITY_NS < curr->vruntime;
+}
+
+// ShouldPreempt charges runtime to the current task and checks if it should give the CPU away.
+static bool ShouldPreempt(Task* curr) {
+    AccountRuntime(curr);
+
+    bool res = false;
+    kern::WithoutIrqs([&]() {
+        RunQueue* rq = PER_CPU_GET(run_queue);
+        res = WithRawLocked(rq->lock, [&]() {
+            return ShouldPreemptLocked(*rq, curr);
+        });
+    });
+    return res;
+}
+
 void Preempt() {
     Task* curr = sched::Current();
     if (!curr) {
@@ -139,39 +342,195 @@ void Preempt() {
         return;
     }
 
-    if (curr->ticks <= 50) {
-        // Time slice not exceeded.
+    if (ShouldPreempt(curr)) {
+        Yield();
+    }
+}
+
+void SetNeedResched() {
+    PER_CPU_SET(need_resched, true);
+}
+
+void PreemptIfNeeded() {
+    if (!PER_CPU_GET(need_resched) || !Preemptible()) {
+        return;
+    }
+
+    Task* curr = sched::Current();
+    if (!curr) {
+        return;
+    }
+
+    // Task is going to sleep, it will call Yield by itself.
+    if (!IsIdle(curr) && curr->state != TASK_RUNNABLE) {
         return;
     }
 
     Yield();
-    curr->ticks = 0;
-    return;
 }
 
-static Task* PickNextLocked() {
-    if (global_rq.TasksHead.Empty()) {
+static Task* PickNextLocked(RunQueue& rq) {
+    Task* task = rq.Leftmost();
+    if (!task) {
         return nullptr;
     }
 
-    Task* task = &global_rq.TasksHead.First();
     task->Ref();
-    task->run_queue_list.Remove();
+    rq.Dequeue(*task);
+    rq.min_vruntime = std::max(rq.min_vruntime, task->vruntime);
+
+    task->exec_start_ns = time::NowMonotonic().nanoseconds;
+    task->slice_start_ns = task->sum_exec_ns;
 
     task->lock.RawLock();
     return task;
 }
 
-void WakeTask(Task* task) {
-    IrqSafeScopeLocker grq_locker(global_rq.lock);
-    IrqSafeScopeLocker task_locker(task->lock);
+// PlaceTask adjusts vruntime of a task entering the run queue after sleep or creation.
+// Sleepers get a bonus of half of the scheduling period, but cannot accumulate credit while sleeping.
+static void PlaceTask(const RunQueue& rq, Task& task) {
+    uint64_t vruntime = rq.min_vruntime;
+    if (task.state == TASK_STARTING) {
+        // New tasks start at the end of the line, so forking doesn't give more CPU.
+        vruntime += SCHED_MIN_GRANULARITY_NS;
+    } else if (vruntime > SCHED_LATENCY_NS / 2) {
+        vruntime -= SCHED_LATENCY_NS / 2;
+    } else {
+        vruntime = 0;
+    }
+    task.vruntime = std::max(task.vruntime, vruntime);
+}
 
-    if (task->state == TASK_WAITING || task->state == TASK_STARTING) {
-        task->state = TASK_RUNNABLE;
-        if (!task->running) {
-            global_rq.TasksHead.InsertLast(*task);
+// FindBusiestCpu returns CPU with the longest run queue, or cpu_count if no CPU has more than min_load queued tasks.
+static size_t FindBusiestCpu(size_t this_cpu, size_t min_load) {
+    size_t busiest = cpu_count;
+    size_t busiest_load = min_load;
+    for (size_t cpu = 0; cpu < cpu_count; cpu++) {
+        if (cpu == this_cpu) {
+            continue;
+        }
+        size_t load = CpuRunQueue(cpu)->Load();
+        if (load > busiest_load) {
+            busiest = cpu;
+            busiest_load = load;
         }
     }
+    return busiest;
+}
+
+// PullTasks migrates at most count tasks from src to dst. Returns number of migrated tasks. IRQs must be disabled.
+static size_t PullTasks(RunQueue& dst, RunQueue& src, size_t count) {
+    LockRunQueuePair(dst, src);
+
+    size_t pulled = 0;
+    while (pulled < count && !src.tasks_tree.empty()) {
+        // Tasks on a run queue are never running, so they can be moved freely.
+        // Take the rightmost task: it would wait the longest on the source CPU.
+        Task& task = *src.tasks_tree.rbegin();
+        src.Dequeue(task);
+
+        // Vruntime is relative to the run queue, rebase it on the destination.
+        task.vruntime = task.vruntime - std::min(task.vruntime, src.min_vruntime) + dst.min_vruntime;
+        dst.Enqueue(task);
+        pulled++;
+    }
+
+    UnlockRunQueuePair(dst, src);
+    return pulled;
+}
+
+// StealTask pulls one task from the busiest CPU into this CPU's run queue. Used when this CPU has nothing to run.
+static bool StealTask(RunQueue& rq) {
+    size_t victim = FindBusiestCpu(rq.cpu, 0);
+    if (victim == cpu_count) {
+        return false;
+    }
+    return PullTasks(rq, *CpuRunQueue(victim), 1) > 0;
+}
+
+// LoadBalance evens out run queue lengths between this CPU and the busiest one. IRQs must be disabled.
+static void LoadBalance() {
+    RunQueue* rq = PER_CPU_GET(run_queue);
+    size_t load = rq->Load();
+
+    size_t victim = FindBusiestCpu(rq->cpu, load + 1);
+    if (victim == cpu_count) {
+        return;
+    }
+
+    size_t victim_load = CpuRunQueue(victim)->Load();
+    if (victim_load <= load + 1) {
+        return;
+    }
+    PullTasks(*rq, *CpuRunQueue(victim), (victim_load - load) / 2);
+}
+
+// FindIdleCpu returns some CPU running its idle task, or cpu_count if all CPUs are busy.
+static size_t FindIdleCpu() {
+    for (size_t cpu = 0; cpu < cpu_count; cpu++) {
+        // Only pointers are compared, so racing with context switch on that CPU is harmless.
+        if (*PER_CPU_PTR_FOR(cpu, task_current) == *PER_CPU_PTR_FOR(cpu, task_idle)) {
+            return cpu;
+        }
+    }
+    return cpu_count;
+}
+
+// ReschedCpu asks the CPU to reschedule: local CPU does it on interrupt return, remote CPUs get an IPI.
+static void ReschedCpu(size_t cpu) {
+    if (cpu == PER_CPU_GET(cpu_id)) {
+        SetNeedResched();
+    } else {
+        arch::WakeCpu(cpu);
+    }
+}
+
+// KickAfterWakeup makes sure that woken up task doesn't wait for the next timer tick to run.
+// Its CPU is kicked if it idles or if the task should preempt the current one, otherwise some idle CPU is kicked to steal it.
+static void KickAfterWakeup(size_t cpu, uint64_t vruntime) {
+    size_t this_cpu = PER_CPU_GET(cpu_id);
+    Task* curr = *PER_CPU_PTR_FOR(cpu, task_current);
+
+    if (curr == *PER_CPU_PTR_FOR(cpu, task_idle)) {
+        ReschedCpu(cpu);
+        return;
+    }
+
+    // Only our own current task is guaranteed to be alive, don't peek into tasks running on other CPUs.
+    if (cpu == this_cpu && vruntime + SCHED_WAKEUP_GRANULARITY_NS < curr->vruntime) {
+        SetNeedResched();
+        return;
+    }
+
+    size_t idle_cpu = FindIdleCpu();
+    if (idle_cpu != cpu_count) {
+        ReschedCpu(idle_cpu);
+    }
+}
+
+void WakeTask(Task* task) {
+    kern::WithoutIrqs([&]() {
+        RunQueue* rq = LockTaskRunQueue(task);
+        task->lock.RawLock();
+
+        bool enqueued = false;
+        if (task->state == TASK_WAITING || task->state == TASK_STARTING) {
+            if (!task->running) {
+                PlaceTask(*rq, *task);
+                rq->Enqueue(*task);
+                enqueued = true;
+            }
+            task->state = TASK_RUNNABLE;
+        }
+
+        uint64_t vruntime = task->vruntime;
+        task->lock.RawUnlock();
+        rq->lock.RawUnlock();
+
+        if (enqueued) {
+            KickAfterWakeup(rq->cpu, vruntime);
+        }
+    });
 }
 
 // SchedFinishContextSwitch completes context switch. Should be called in Yield and in all process entry points. Called from assembly.
@@ -181,19 +540,23 @@ extern "C" void SchedFinishContextSwitch(Task* prev) {
     Task* curr = sched::Current();
     mm::Vmem* next_vm = curr->vmem.get();
     if (next_vm) {
-        next_vm->SwitchTo();
+        next_vm->Activate();
     }
 
     if (prev->pid != 0) {
-        global_rq.lock.RawLock();
+        // Previous task ran on this CPU, so it's owned by our run queue.
+        RunQueue* rq = PER_CPU_GET(run_queue);
+        BUG_ON(prev->cpu != rq->cpu);
+
+        rq->lock.RawLock();
         prev->lock.RawLock();
 
         prev->running = false;
         if (prev->state == TASK_RUNNABLE) {
-            global_rq.TasksHead.InsertLast(*prev);
+            rq->Enqueue(*prev);
         }
 
-        global_rq.lock.RawUnlock();
+        rq->lock.RawUnlock();
         prev->lock.RawUnlock();
 
         prev->Unref();
@@ -207,13 +570,25 @@ void Yield() {
     BUG_ON(!kern::IsIrqEnabled());
 
     kern::IrqDisable();
+    PER_CPU_SET(need_resched, false);
 
     Task* curr = sched::Current();
+    RunQueue* rq = PER_CPU_GET(run_queue);
+
+    if (!IsIdle(curr)) {
+        AccountRuntime(curr);
+    }
 
-    Task* next = WithRawLocked(global_rq.lock, []() {
-        return PickNextLocked();
+    Task* next = WithRawLocked(rq->lock, [&]() {
+        return PickNextLocked(*rq);
     });
 
+    if (!next && StealTask(*rq)) {
+        next = WithRawLocked(rq->lock, [&]() {
+            return PickNextLocked(*rq);
+        });
+    }
+
     BUG_ON_NULL(curr);
     BUG_ON(curr == next);
 
@@ -235,6 +610,11 @@ void Yield() {
     } else {
         next->running = true;
         next->lock.RawUnlock();
+
+        // Running tasks need ticks for preemption.
+        if (IsIdle(curr)) {
+            time::RestartTick();
+        }
     }
 
     PER_CPU_SET(task_current, next);
@@ -249,13 +629,33 @@ void TimerTick(bool /* from_user */) noexcept {
     if (IsIdle(curr)) {
         return;
     }
-    curr->ticks++;
+
+    PER_CPU_ADD(load_balance_ticks, 1);
+    if (PER_CPU_GET(load_balance_ticks) >= LOAD_BALANCE_INTERVAL_TICKS) {
+        PER_CPU_SET(load_balance_ticks, 0);
+        kern::WithoutIrqs([]() {
+            LoadBalance();
+        });
+
+        // Idle CPUs don't tick, so they can't steal by themselves. Wake one up if we have extra work.
+        if (PER_CPU_GET(run_queue)->Load() > 0) {
+            size_t idle_cpu = FindIdleCpu();
+            if (idle_cpu != cpu_count) {
+                ReschedCpu(idle_cpu);
+            }
+        }
+    }
+
+    // Remember the decision even if preemption is disabled now: PreemptEnable will act on it.
+    if (curr->state == TASK_RUNNABLE && ShouldPreempt(curr)) {
+        SetNeedResched();
+    }
 
     if (!Preemptible()) {
         return;
     }
 
-    Preempt();
+    PreemptIfNeeded();
     kern::SignalDeliver();
 }
 
@@ -326,7 +726,7 @@ static void ReparentChildren(Task& task) {
 
     if (curr->vmem) {
         // We are going to destroy process vmem, switch to safe zone.
-        mm::Vmem::GLOBAL.SwitchTo();
+        mm::Vmem::GLOBAL.Activate();
         curr->vmem.reset();
     }
 
@@ -447,6 +847,13 @@ int64_t SysSchedYield(Task*) noexcept {
 }
 REGISTER_SYSCALL(sched_yield, SysSchedYield);
 
+// SysNice returns 20 - nice, so that negative nice values couldn't be confused with errors.
+int64_t SysNice(Task* task, int inc) noexcept {
+    SetNice(task, task->nice + std::clamp(inc, NICE_MIN - NICE_MAX, NICE_MAX - NICE_MIN));
+    return 20 - task->nice;
+}
+REGISTER_SYSCALL(nice, SysNice);
+
 int64_t SysSleep(sched::Task*, uint64_t seconds) noexcept {
     using namespace time::literals;
     time::SleepUntil(time::NowMonotonic().Add(seconds * 1_s));
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <boost/intrusive/set.hpp>
 #include <concepts>
 #include <cstddef>
 #include <functional>
@@ -17,6 +18,7 @@
 
 namespace arch {
 
+// DoIdle halts CPU until the next interrupt. Must be called with IRQs disabled, returns with IRQs enabled.
 void DoIdle() noexcept;
 void InitIdle(sched::Task&) noexcept;
 
@@ -32,6 +34,12 @@ typedef enum state {
     TASK_DEAD = 4,
 } state_t;
 
+// Weight of a task with zero nice value.
+constexpr uint64_t NICE_0_WEIGHT = 1024;
+
+constexpr int NICE_MIN = -20;
+constexpr int NICE_MAX = 19;
+
 struct Task;
 
 using TaskPtr = IntrusiveSharedPtr<Task, NoOpRefCountedTracker<Task>>;
@@ -46,7 +54,6 @@ struct Task {
 
     int64_t pid = -1;
     state_t state = TASK_STARTING;
-    int ticks = 0;
     std::unique_ptr<mm::Vmem> vmem;
     uint32_t exitcode = 0;
 
@@ -65,10 +72,22 @@ struct Task {
     // Wait queue for waiting on children.
     kern::WaitQueue wq;
 
-    // Scheduler queue.
-    ListNode run_queue_list;
+    // Scheduler queue, ordered by vruntime.
+    boost::intrusive::set_member_hook<> run_queue_node;
     bool running = false;
 
+    // CPU which run queue owns the task. Protected by the lock of that run queue.
+    size_t cpu = 0;
+
+    // Fair scheduling state. Virtual runtime is a CPU time scaled by the task weight: tasks with the smallest vruntime run first.
+    uint64_t vruntime = 0;
+    uint64_t exec_start_ns = 0;
+    uint64_t sum_exec_ns = 0;
+    // Value of sum_exec_ns when the task was picked to run, used to measure its current time slice.
+    uint64_t slice_start_ns = 0;
+    int nice = 0;
+    uint64_t weight = NICE_0_WEIGHT;
+
     ListNode all_tasks_list;
     void Ref() noexcept {
         refs.Ref();
@@ -102,9 +121,15 @@ void Preempt();
 // PreemptDisable disables preemption on current CPU. Reentrant.
 void PreemptDisable();
 
-// PreemptEnable enables preemption on current CPU. Reentrant.
+// PreemptEnable enables preemption on current CPU. Reentrant. Reschedules if it was requested while preemption was disabled.
 void PreemptEnable();
 
+// SetNeedResched asks current CPU to reschedule as soon as preemption is possible.
+void SetNeedResched();
+
+// PreemptIfNeeded switches to another task if rescheduling was requested. Called on interrupt and syscall return with IRQs enabled.
+void PreemptIfNeeded();
+
 // TimerTick should be called by timer interrupt.
 void TimerTick(bool from_user);
 
@@ -119,6 +144,9 @@ constexpr uint64_t TASK_EXIT_CODE_MASK = 0xff;
 // WakeTask wakes the task and pushes it on run queue, if needed.
 void WakeTask(Task* task);
 
+// SetNice changes nice value of the task and its scheduling weight. Task must not be on a run queue.
+void SetNice(Task* task, int nice);
+
 // AllocTask allocates PID, task and register it on all_tasks_list.
 kern::Result<TaskPtr> AllocTask(mm::AllocFlags af_flags);
 
@@ -21,6 +21,7 @@ extern "C" int64_t DoSyscall(uint64_t sysno) {
     SyscallDef def = (&__start_syscalls_table)[sysno];
     BUG_ON(def.n != sysno);
     int64_t res = def.entry();
+    sched::PreemptIfNeeded();
     kern::SignalDeliver();
     return res;
 }
@@ -28,8 +28,10 @@ constexpr uint64_t SYS_sched_yield = 17;
 constexpr uint64_t SYS_sync = 18;
 constexpr uint64_t SYS_sleep = 19;
 constexpr uint64_t SYS_gettimeofday = 20;
+constexpr uint64_t SYS_nice = 21;
+constexpr uint64_t SYS_msync = 22;
 
-constexpr uint64_t SYS_max = 21;
+constexpr uint64_t SYS_max = 23;
 
 template <typename T>
 struct IsKernResult;
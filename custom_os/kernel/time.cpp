@@ -2,10 +2,15 @@
 #include "kernel/irq.h"
 #include "kernel/time.h"
 #include "kernel/error.h"
+#include "kernel/panic.h"
 #include "kernel/per_cpu.h"
 #include "kernel/sched.h"
 #include "kernel/syscall.h"
+#include "kernel/vsyscall.h"
 #include "lib/seqlock.h"
+#include "mm/new.h"
+
+extern size_t cpu_count;
 
 struct HrClock {
     sync::SeqLock seqlock;
@@ -16,6 +21,9 @@ struct HrClock {
 
 static HrClock hr_clock;
 
+// Set on CPUs which stopped periodic ticks while idle.
+PER_CPU_DEFINE(bool, tick_stopped);
+
 namespace time {
 
 static void Sync() {
@@ -25,21 +33,17 @@ static void Sync() {
             uint64_t curr_ns = arch::GetClockNs();
             hr_clock.clock_total_ns += curr_ns - hr_clock.clock_last_ns;
             hr_clock.clock_last_ns = curr_ns;
+            kern::VsyscallUpdateClock(hr_clock.wall_time_start_secs, hr_clock.clock_last_ns);
         });
     });
 }
 
-void Init() {
-    Update();
-}
-
 Time Now() noexcept {
     uint64_t ns = 0;
     hr_clock.seqlock.Read([&]() {
         uint64_t curr_ns = arch::GetClockNs();
         uint64_t delta_ns = curr_ns - hr_clock.clock_last_ns;
-        time_t secs_since_start = delta_ns / NS_IN_SEC;
-        ns = (hr_clock.wall_time_start_secs + secs_since_start) * NS_IN_SEC + delta_ns;
+        ns = hr_clock.wall_time_start_secs * NS_IN_SEC + delta_ns;
     });
     return Time(ns);
 }
@@ -53,48 +57,225 @@ Time NowMonotonic() noexcept {
     return Time(ns);
 }
 
-namespace {
+// TimerWheel is a per-CPU hierarchical timing wheel. Level L has SLOTS slots, each covering SLOTS^L ticks.
+// Timers are inserted and cancelled in O(1); a slot of level L+1 is cascaded into lower levels when level L wraps around.
+class TimerWheel {
+public:
+    static constexpr size_t LEVELS = 4;
+    static constexpr size_t SLOT_BITS = 6;
+    static constexpr size_t SLOTS = 1 << SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+    // Timers further in the future are parked in the farthest slot and cascaded again.
+    static constexpr uint64_t MAX_DELTA = (uint64_t(1) << (LEVELS * SLOT_BITS)) - 1;
 
-ListHead<TimerBase, &TimerBase::list_> AllTimers;
-SpinLock AllTimersLock;
+    using Slot = ListHead<TimerBase, &TimerBase::list_>;
 
-void CheckTimers() noexcept {
-    auto now = NowMonotonic();
+    SpinLock lock;
 
-    IrqSafeScopeLocker locker(AllTimersLock);
-    if (AllTimers.Empty()) {
-        return;
-    }
+    // Timer which callback is running right now, Cancel waits for it to finish.
+    std::atomic<TimerBase*> running_timer = nullptr;
 
-    for (TimerBase& timer : AllTimers) {
-        if (timer.deadline_.After(now)) {
-            continue;
+    TimerWheel(uint64_t now_ns) noexcept
+        : clk_(now_ns / TICK_NS)
+    {}
+
+    void AddLocked(TimerBase& timer) noexcept {
+        timer.wheel_ = this;
+        timer.expires_ = std::max(timer.deadline_.nanoseconds / TICK_NS, clk_);
+        Place(timer);
+        if (next_valid_) {
+            next_deadline_ns_ = std::min(next_deadline_ns_, timer.deadline_.nanoseconds);
         }
+    }
 
+    void RemoveLocked(TimerBase& timer) noexcept {
         timer.list_.Remove();
-        timer.finished_ = true;
+        level_count_[timer.level_]--;
+        if (timer.deadline_.nanoseconds <= next_deadline_ns_) {
+            next_valid_ = false;
+        }
+    }
+
+    // PopExpiredLocked advances the wheel up to now and returns one expired timer or nullptr.
+    TimerBase* PopExpiredLocked(uint64_t now_ns) noexcept {
+        uint64_t now_tick = now_ns / TICK_NS;
+        for (;;) {
+            Slot& slot = slots_[0][clk_ & SLOT_MASK];
+            for (TimerBase& timer : slot) {
+                // Current tick is not over yet, or the timer was parked because of MAX_DELTA.
+                if (timer.deadline_.nanoseconds > now_ns) {
+                    continue;
+                }
+                RemoveLocked(timer);
+                return &timer;
+            }
+
+            if (clk_ >= now_tick) {
+                return nullptr;
+            }
+            Forward(now_tick);
+        }
+    }
+
+    // NextDeadlineLocked returns the earliest deadline among pending timers or UINT64_MAX.
+    uint64_t NextDeadlineLocked() noexcept {
+        if (!next_valid_) {
+            next_deadline_ns_ = ComputeNextDeadline();
+            next_valid_ = true;
+        }
+        return next_deadline_ns_;
+    }
+
+private:
+    Slot slots_[LEVELS][SLOTS];
+    size_t level_count_[LEVELS] = {};
+
+    // All ticks before clk_ are processed.
+    uint64_t clk_;
+
+    // Cached earliest deadline, valid only if next_valid_ is set.
+    uint64_t next_deadline_ns_ = UINT64_MAX;
+    bool next_valid_ = true;
+
+    static uint64_t SlotIndex(uint64_t tick, size_t level) noexcept {
+        return (tick >> (level * SLOT_BITS)) & SLOT_MASK;
+    }
+
+    void Place(TimerBase& timer) noexcept {
+        uint64_t expires = timer.expires_;
+        uint64_t delta = expires - clk_;
+        if (delta > MAX_DELTA) {
+            expires = clk_ + MAX_DELTA;
+            delta = MAX_DELTA;
+        }
+
+        size_t level = 0;
+        while (delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS))) {
+            level++;
+        }
+
+        timer.level_ = level;
+        level_count_[level]++;
+        slots_[level][SlotIndex(expires, level)].InsertLast(timer);
+    }
+
+    // Cascade moves timers of the current slot of the level into lower levels.
+    void Cascade(size_t level) noexcept {
+        Slot& slot = slots_[level][SlotIndex(clk_, level)];
+        while (!slot.Empty()) {
+            TimerBase& timer = slot.First();
+            timer.list_.Remove();
+            level_count_[level]--;
+            Place(timer);
+        }
+    }
+
+    // Forward moves clk_ to the next tick which may have work, but not past now_tick.
+    // Ticks covered only by empty levels are skipped at once, so waking up from a long tickless idle is cheap.
+    void Forward(uint64_t now_tick) noexcept {
+        uint64_t step = 1;
+        for (size_t level = 0; level < LEVELS && level_count_[level] == 0; level++) {
+            step <<= SLOT_BITS;
+        }
+        clk_ = std::min((clk_ | (step - 1)) + 1, now_tick);
+
+        for (size_t level = 1; level < LEVELS && SlotIndex(clk_, level - 1) == 0; level++) {
+            Cascade(level);
+        }
+    }
+
+    uint64_t ComputeNextDeadline() noexcept {
+        uint64_t deadline = UINT64_MAX;
+        for (size_t level = 0; level < LEVELS; level++) {
+            if (level_count_[level] == 0) {
+                continue;
+            }
+
+            // Slots of a level are ordered by time starting from the current one.
+            // Current slot of upper levels is already cascaded, so it may only hold timers from the next round.
+            uint64_t start = (clk_ >> (level * SLOT_BITS)) + (level > 0 ? 1 : 0);
+            for (size_t i = 0; i < SLOTS; i++) {
+                Slot& slot = slots_[level][(start + i) & SLOT_MASK];
+                if (slot.Empty()) {
+                    continue;
+                }
+                for (TimerBase& timer : slot) {
+                    deadline = std::min(deadline, timer.deadline_.nanoseconds);
+                }
+                break;
+            }
+        }
+        return deadline;
+    }
+};
+
+}
+
+PER_CPU_DEFINE(time::TimerWheel*, timer_wheel);
+
+namespace time {
+
+namespace {
+
+void CheckTimers() noexcept {
+    TimerWheel* wheel = PER_CPU_GET(timer_wheel);
+    auto now = NowMonotonic();
+
+    for (;;) {
+        IrqSafeScopeLocker locker(wheel->lock);
+        TimerBase* timer = wheel->PopExpiredLocked(now.nanoseconds);
+        if (!timer) {
+            return;
+        }
+
+        timer->finished_ = true;
+        wheel->running_timer.store(timer);
         locker.Unlock();
-        timer();
-        break;
+
+        (*timer)();
+        wheel->running_timer.store(nullptr);
     }
 }
 
 }
 
+void Init() {
+    Update();
+
+    uint64_t now = NowMonotonic().nanoseconds;
+    for (size_t cpu = 0; cpu < cpu_count; cpu++) {
+        TimerWheel* wheel = new (mm::AllocFlag::NoSleep) TimerWheel(now);
+        if (!wheel) {
+            panic("cannot allocate timer wheel for CPU#%lu", cpu);
+        }
+        *PER_CPU_PTR_FOR(cpu, timer_wheel) = wheel;
+    }
+}
+
 TimerBase::TimerBase(Time deadline) noexcept
     : deadline_(deadline)
 {
-    IrqSafeScopeLocker locker(AllTimersLock);
-    AllTimers.InsertLast(*this);
+    kern::WithoutIrqs([&]() {
+        TimerWheel* wheel = PER_CPU_GET(timer_wheel);
+        WithRawLocked(wheel->lock, [&]() {
+            wheel->AddLocked(*this);
+        });
+    });
 }
 
 void TimerBase::Cancel() noexcept {
-    IrqSafeScopeLocker locker(AllTimersLock);
-    if (finished_) {
-        return;
+    {
+        IrqSafeScopeLocker locker(wheel_->lock);
+        if (!finished_) {
+            finished_ = true;
+            wheel_->RemoveLocked(*this);
+            return;
+        }
+    }
+
+    // Timer has fired: callback may still run on the owning CPU and use objects we're going to destroy.
+    while (wheel_->running_timer.load() == this) {
     }
-    finished_ = true;
-    list_.Remove();
 }
 
 void SleepUntil(Time deadline) noexcept {
@@ -110,6 +291,32 @@ void PeriodicTick() noexcept {
     CheckTimers();
 }
 
+void StopTickIdle() noexcept {
+    PER_CPU_SET(tick_stopped, true);
+
+    TimerWheel* wheel = PER_CPU_GET(timer_wheel);
+    uint64_t deadline = WithRawLocked(wheel->lock, [&]() {
+        return wheel->NextDeadlineLocked();
+    });
+
+    // No timers on this CPU, only IPI or device interrupt could wake it up.
+    if (deadline == UINT64_MAX) {
+        arch::StopTimer();
+        return;
+    }
+
+    uint64_t now = NowMonotonic().nanoseconds;
+    arch::StartOneShotTimer(deadline > now ? deadline - now : 0);
+}
+
+void RestartTick() noexcept {
+    if (!PER_CPU_GET(tick_stopped)) {
+        return;
+    }
+    PER_CPU_SET(tick_stopped, false);
+    arch::StartPeriodicTimer();
+}
+
 timeval NanosecondsToTimeval(uint64_t ns) noexcept {
     timeval tv;
     tv.tv_sec = ns / NS_IN_SEC;
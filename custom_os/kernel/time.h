@@ -77,12 +77,19 @@ constexpr uint64_t operator""_ns(unsigned long long int ns) {
 
 }
 
+class TimerWheel;
+
 class TimerBase {
 public:
     Time deadline_;
     ListNode list_;
     bool finished_ = false;
 
+    // Per-CPU wheel the timer is queued on, its tick and wheel level.
+    TimerWheel* wheel_ = nullptr;
+    uint64_t expires_ = 0;
+    size_t level_ = 0;
+
     TimerBase(const TimerBase&) = delete;
     TimerBase(TimerBase&&) = delete;
 
@@ -119,6 +126,12 @@ void SleepUntil(Time deadline) noexcept;
 
 void Update();
 void PeriodicTick() noexcept;
+
+// StopTickIdle stops periodic ticks on idle CPU. Timekeeping CPU is woken up at the next timer deadline instead. IRQs must be disabled.
+void StopTickIdle() noexcept;
+
+// RestartTick resumes periodic ticks stopped by StopTickIdle. IRQs must be disabled.
+void RestartTick() noexcept;
 void Init();
 
 timeval NanosecondsToTimeval(uint64_t nsecs) noexcept;
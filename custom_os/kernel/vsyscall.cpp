@@ -1,2 +1,102 @@
 #include "kernel/vsyscall.h"
 
+#include "arch/time.h"
+#include "kernel/panic.h"
+#include "linker.h"
+#include "mm/kasan.h"
+#include "mm/paging.h"
+#include "mm/vmem.h"
+
+namespace {
+
+// VsyscallClock mirrors HrClock for user space. Sequence is odd while kernel updates it.
+struct VsyscallClock {
+    uint64_t seq;
+    // Raw clock conversion: clock_ns = (tsc * mult) >> shift. Zero mult means user space must use the syscall.
+    uint64_t mult;
+    uint64_t shift;
+    uint64_t wall_time_start_secs;
+    uint64_t clock_last_ns;
+};
+
+VSYSCALL_DATA VsyscallClock vsyscall_clock;
+
+}
+
+// Code below runs in user mode from the vsyscall page: it must not call anything and must not touch memory outside of
+// vsyscall pages and its arguments. Only builtins are used, because inline functions are not inlined at -O0.
+extern "C" VSYSCALL NO_KASAN int VsyscallGettimeofday(timeval* tv) {
+    uint64_t seq = 0;
+    uint64_t mult = 0;
+    uint64_t shift = 0;
+    uint64_t wall_time_start_secs = 0;
+    uint64_t clock_last_ns = 0;
+    uint64_t tsc = 0;
+
+    for (;;) {
+        seq = __atomic_load_n(&vsyscall_clock.seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+
+        mult = __atomic_load_n(&vsyscall_clock.mult, __ATOMIC_RELAXED);
+        shift = __atomic_load_n(&vsyscall_clock.shift, __ATOMIC_RELAXED);
+        wall_time_start_secs = __atomic_load_n(&vsyscall_clock.wall_time_start_secs, __ATOMIC_RELAXED);
+        clock_last_ns = __atomic_load_n(&vsyscall_clock.clock_last_ns, __ATOMIC_RELAXED);
+        tsc = __builtin_ia32_rdtsc();
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&vsyscall_clock.seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+
+    if (mult == 0) {
+        return -1;
+    }
+
+    uint64_t clock_ns = (uint64_t)(((unsigned __int128)tsc * mult) >> shift);
+    uint64_t delta_ns = clock_ns > clock_last_ns ? clock_ns - clock_last_ns : 0;
+    uint64_t ns = wall_time_start_secs * 1'000'000'000 + delta_ns;
+
+    tv->tv_sec = ns / 1'000'000'000;
+    tv->tv_usec = ns % 1'000'000'000 / 1000;
+    return 0;
+}
+
+namespace kern {
+
+void VsyscallUpdateClock(uint64_t wall_time_start_secs, uint64_t clock_last_ns) noexcept {
+    arch::ClockParams params = arch::GetUserClockParams();
+
+    uint64_t seq = vsyscall_clock.seq;
+    __atomic_store_n(&vsyscall_clock.seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    vsyscall_clock.mult = params.mult;
+    vsyscall_clock.shift = params.shift;
+    vsyscall_clock.wall_time_start_secs = wall_time_start_secs;
+    vsyscall_clock.clock_last_ns = clock_last_ns;
+
+    __atomic_store_n(&vsyscall_clock.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void InitVsyscall() noexcept {
+    BUG_ON((uintptr_t)&VsyscallGettimeofday != (uintptr_t)&_vsyscall_start);
+
+    // Pages are mapped preserving their layout in the kernel image, so RIP-relative accesses from code to data still work.
+    for (uintptr_t addr = (uintptr_t)&_vsyscall_start; addr < (uintptr_t)&_vsyscall_end; addr += PAGE_SIZE) {
+        uintptr_t phys_addr = addr - KERNEL_IMAGE_START + (uintptr_t)&_phys_start_hh;
+        uint64_t flags = PTE_USER;
+        if (addr >= (uintptr_t)&_vsyscall_data_start) {
+            flags |= PTE_NX;
+        }
+
+        auto res = mm::Vmem::GLOBAL.Map4KbPage(VSYSCALL_ADDR + (addr - (uintptr_t)&_vsyscall_start), phys_addr, flags, mm::AllocFlag::SkipKasan);
+        if (!res.Ok()) {
+            panic("cannot map vsyscall page: %e", res.Err().Code());
+        }
+    }
+}
+
+}
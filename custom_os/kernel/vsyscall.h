@@ -1,5 +1,18 @@
 #pragma once
 
+#include "uapi/vsyscall.h"
+
+#include <cstdint>
+
 #define VSYSCALL_DATA __attribute__((section(".vsyscall.data")))
 #define VSYSCALL __attribute__((section(".vsyscall")))
 
+namespace kern {
+
+// InitVsyscall maps vsyscall code and data pages into the global address space, every Vmem inherits them from there.
+void InitVsyscall() noexcept;
+
+// VsyscallUpdateClock publishes clock state for user space. Must be called with HrClock write lock held.
+void VsyscallUpdateClock(uint64_t wall_time_start_secs, uint64_t clock_last_ns) noexcept;
+
+}
@@ -30,6 +30,10 @@ public:
         return flags_ != 0;
     }
 
+    constexpr friend bool operator==(BitFlags l, BitFlags r) noexcept {
+        return l.flags_ == r.flags_;
+    }
+
     constexpr friend BitFlags operator|(BitFlags l, BitFlags r) noexcept {
         return BitFlags(l.flags_ | r.flags_);
     }
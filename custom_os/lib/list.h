@@ -89,6 +89,11 @@ public:
         return *ContainerOf<T, ListNode, Field>(head_.next);
     }
 
+    T& Last() {
+        BUG_ON(Empty());
+        return *ContainerOf<T, ListNode, Field>(head_.prev);
+    }
+
     Iterator begin() {
         return Iterator(head_.next);
     }
@@ -21,6 +21,14 @@ void Mutex::RawLock() noexcept {
     });
 }
 
+bool Mutex::RawTryLock() noexcept {
+    if (!lock_.RawTryLock()) {
+        return false;
+    }
+    owner_ = sched::Current();
+    return true;
+}
+
 void Mutex::RawUnlock() noexcept {
     AssertHeld();
     owner_ = nullptr;
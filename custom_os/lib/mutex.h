@@ -19,6 +19,7 @@ private:
 
 public:
     void RawLock() noexcept;
+    bool RawTryLock() noexcept;
     void RawUnlock() noexcept;
 
     void AssertHeld();
@@ -1,6 +1,5 @@
 #include "lib/seq_bitmap.h"
-#include "mm/page_alloc.h"
-#include "mm/paging.h"
+#include "mm/vmalloc.h"
 #include "lib/common.h"
 #include "kernel/panic.h"
 
@@ -10,16 +9,16 @@ SeqBitmap::SeqBitmap(int32_t max_n, int32_t start, mm::AllocFlags flags) noexcep
     : max_n_(max_n)
     , start_(start)
 {
-    size_t chunks_total = DIV_ROUNDUP(max_n_, kNumsPerChunk);
-    size_t pgcnt = DIV_ROUNDUP(chunks_total, PAGE_SIZE);
-    data_ = (uint64_t*)mm::AllocPageSimple(pgcnt, flags);
+    size_t size = DIV_ROUNDUP(max_n_, kNumsPerChunk) * sizeof(uint64_t);
+    data_ = (uint64_t*)mm::Kvmalloc(size, flags);
     if (!data_) {
         panic("no space for seq bitmap");
     }
+    memset(data_, 0, size);
 }
 
 SeqBitmap::~SeqBitmap() noexcept {
-    mm::FreePageSimple(data_);
+    mm::Kvfree(data_);
 }
 
 int32_t SeqBitmap::Alloc() noexcept {
@@ -17,5 +17,9 @@ extern uint8_t _phys_end_per_cpu;
 extern uint8_t _rip_fixups_start[];
 extern uint8_t _rip_fixups_end;
 
+extern uint8_t _vsyscall_start;
+extern uint8_t _vsyscall_data_start;
+extern uint8_t _vsyscall_end;
+
 extern uint8_t _ctors_start;
 extern uint8_t _ctors_end;
@@ -0,0 +1,234 @@
+#include "fs/vfs.h"
+#include "kernel/printk.h"
+#include "kernel/sched.h"
+#include "mm/page_alloc.h"
+#include "mm/vmem.h"
+
+namespace mm {
+
+extern PageAlloc page_allocator;
+
+Page* DoAllocPage(size_t order, AllocFlags flags) noexcept;
+size_t DrainPerCpuPages() noexcept;
+bool IsolateFreeBlocks(Page* block, size_t order, ListHead<Page, &Page::pa_free_list>& isolated) noexcept;
+void PutbackFreeBlocks(ListHead<Page, &Page::pa_free_list>& isolated) noexcept;
+
+namespace {
+
+// Compaction tries only the blocks with the fewest used pages.
+constexpr size_t COMPACT_MAX_BLOCKS = 8;
+
+using PageList = ListHead<Page, &Page::pa_free_list>;
+
+// Only one CPU compacts at a time, others fail their allocations instead of fighting for the same blocks.
+std::atomic<bool> compacting = false;
+
+std::atomic<uint64_t> compact_stall = 0;
+std::atomic<uint64_t> compact_success = 0;
+std::atomic<uint64_t> compact_fail = 0;
+std::atomic<uint64_t> pages_migrated = 0;
+
+// MigrateCachePages moves page cache pages nobody else references out of the block. Old pages are added to the migrated list.
+void MigrateCachePages(Page* block, size_t count, PageList& migrated) noexcept {
+    for (size_t i = 0; i < count; i++) {
+        Page* page = &block[i];
+        // Racy check, the page may be evicted and reused even while the new page is allocated. MigrateCachedPage
+        // repeats it under the LRU lock.
+        if (!page->HasFlag(Page::Used) || !page->HasFlag(Page::InFileCache) || !page->HasFlag(Page::UpToDate)) {
+            continue;
+        }
+
+        Page* new_page = AllocPage(0, AllocFlag::Movable);
+        if (!new_page) {
+            return;
+        }
+        if (PageCache::MigrateCachedPage(*page, *new_page)) {
+            migrated.InsertLast(*page);
+        } else {
+            FreePage(new_page);
+        }
+    }
+}
+
+// CompactBlock empties the aligned block of 2^order pages and allocates it with given migrate type.
+Page* CompactBlock(Page* block, size_t order, MigrateType type) noexcept {
+    PageList isolated;
+    if (!IsolateFreeBlocks(block, order, isolated)) {
+        return nullptr;
+    }
+
+    // There is no reverse mapping: anonymous pages are found only in the address space of the current task.
+    size_t count = 1 << order;
+    PageList migrated;
+    MigrateCachePages(block, count, migrated);
+    sched::Task* task = sched::Current();
+    if (task && task->vmem) {
+        task->vmem->MigratePages(block, count, migrated);
+    }
+
+    // Pages freed meanwhile are back on the free lists.
+    size_t taken = 0;
+    bool ok = IsolateFreeBlocks(block, order, isolated);
+    for (Page& page : isolated) {
+        taken += 1 << page.Order();
+    }
+    for ([[maybe_unused]] Page& page : migrated) {
+        taken++;
+    }
+
+    if (!ok || taken != count) {
+        PutbackFreeBlocks(isolated);
+        while (!migrated.Empty()) {
+            Page* page = &migrated.First();
+            page->pa_free_list.Remove();
+            FreePage(page);
+        }
+        return nullptr;
+    }
+
+    while (!isolated.Empty()) {
+        isolated.First().pa_free_list.Remove();
+    }
+    while (!migrated.Empty()) {
+        Page* page = &migrated.First();
+        page->pa_free_list.Remove();
+        // Allocated block is accounted as a whole by the caller.
+        page->Area()->pages_allocated.fetch_sub(1, std::memory_order_relaxed);
+        pages_migrated.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (type == MIGRATE_MOVABLE) {
+            block[i].SetFlag(Page::Movable);
+        } else {
+            block[i].ClearFlag(Page::Movable);
+        }
+    }
+    block->SetOrder(order);
+    return block;
+}
+
+// PickBlocks finds aligned blocks of 2^order pages with the fewest used pages, skipping ones pinned by unmovable pages.
+size_t PickBlocks(size_t order, Page* (&blocks)[COMPACT_MAX_BLOCKS]) noexcept {
+    size_t used_pages[COMPACT_MAX_BLOCKS];
+    size_t picked = 0;
+    size_t count = 1 << order;
+
+    for (size_t i = 0; i < page_allocator.area_count; i++) {
+        PageAllocArea& area = page_allocator.areas[i];
+        for (size_t idx = 0; idx + count <= area.size_in_pages; idx += count) {
+            Page* block = &area.pages[idx];
+            // Racy check, IsolateFreeBlocks repeats it under the lock.
+            size_t used = 0;
+            for (size_t j = 0; j < count; j++) {
+                if (!block[j].HasFlag(Page::Used)) {
+                    continue;
+                }
+                if (!block[j].HasFlag(Page::Movable)) {
+                    used = count;
+                    break;
+                }
+                used++;
+            }
+            if (used == count || used == 0) {
+                continue;
+            }
+
+            // Keep picked blocks sorted by number of used pages.
+            size_t pos = picked;
+            while (pos > 0 && used_pages[pos - 1] > used) {
+                pos--;
+            }
+            if (pos == COMPACT_MAX_BLOCKS) {
+                continue;
+            }
+            for (size_t j = std::min(picked, COMPACT_MAX_BLOCKS - 1); j > pos; j--) {
+                blocks[j] = blocks[j - 1];
+                used_pages[j] = used_pages[j - 1];
+            }
+            blocks[pos] = block;
+            used_pages[pos] = used;
+            picked = std::min(picked + 1, COMPACT_MAX_BLOCKS);
+        }
+    }
+    return picked;
+}
+
+}
+
+// CompactPages relocates movable pages to build a free block of given order and allocates it.
+// Called by AllocPage on failure, the result isn't accounted yet.
+Page* CompactPages(size_t order, AllocFlags flags) noexcept {
+    if (compacting.exchange(true, std::memory_order_acquire)) {
+        return nullptr;
+    }
+    compact_stall.fetch_add(1, std::memory_order_relaxed);
+
+    // Cached pages could complete a free block without any migration.
+    DrainPerCpuPages();
+    Page* page = DoAllocPage(order, flags);
+
+    if (!page) {
+        MigrateType type = flags.Has(AllocFlag::Movable) ? MIGRATE_MOVABLE : MIGRATE_UNMOVABLE;
+        Page* blocks[COMPACT_MAX_BLOCKS];
+        size_t picked = PickBlocks(order, blocks);
+        for (size_t i = 0; i < picked && !page; i++) {
+            page = CompactBlock(blocks[i], order, type);
+        }
+    }
+
+    if (page) {
+        compact_success.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        compact_fail.fetch_add(1, std::memory_order_relaxed);
+    }
+    compacting.store(false, std::memory_order_release);
+    return page;
+}
+
+int FragmentationIndex(size_t order) noexcept {
+    size_t counts[MIGRATE_TYPES][PAGE_MAX_ALLOCATION_ORDER + 1];
+    FreeBlockCounts(counts);
+
+    size_t blocks = 0;
+    size_t free_pages = 0;
+    for (size_t type = 0; type < MIGRATE_TYPES; type++) {
+        for (size_t o = 0; o <= PAGE_MAX_ALLOCATION_ORDER; o++) {
+            if (o >= order && counts[type][o] > 0) {
+                return -1000;
+            }
+            blocks += counts[type][o];
+            free_pages += counts[type][o] << o;
+        }
+    }
+    if (blocks == 0) {
+        return 0;
+    }
+    return 1000 - (1000 + free_pages * 1000 / (1ull << order)) / blocks;
+}
+
+void DumpFragmentation() noexcept {
+    size_t counts[MIGRATE_TYPES][PAGE_MAX_ALLOCATION_ORDER + 1];
+    FreeBlockCounts(counts);
+
+    const char* names[MIGRATE_TYPES] = {"unmovable", "movable"};
+    for (size_t type = 0; type < MIGRATE_TYPES; type++) {
+        printk("[mm] free blocks by order (%s):", names[type]);
+        for (size_t order = 0; order <= PAGE_MAX_ALLOCATION_ORDER; order++) {
+            printk(" %lu", counts[type][order]);
+        }
+        printk("\n");
+    }
+
+    printk("[mm] fragmentation index by order:");
+    for (size_t order = 0; order <= PAGE_MAX_ALLOCATION_ORDER; order++) {
+        printk(" %d", FragmentationIndex(order));
+    }
+    printk("\n");
+
+    printk("[mm] compaction: %lu stalls, %lu succeeded, %lu failed, %lu pages migrated\n",
+        compact_stall.load(std::memory_order_relaxed), compact_success.load(std::memory_order_relaxed),
+        compact_fail.load(std::memory_order_relaxed), pages_migrated.load(std::memory_order_relaxed));
+}
+
+}
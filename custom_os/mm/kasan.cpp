@@ -215,6 +215,14 @@ inline bool AccessOk(uintptr_t addr, size_t sz) {
     if (!IsEnabled()) {
         return true;
     }
+    // Vmalloc memory has no shadow: its pages are tracked through the direct mapping only.
+    if (KERNEL_VMALLOC_START <= addr && addr - KERNEL_VMALLOC_START < KERNEL_VMALLOC_SIZE) {
+        return true;
+    }
+    // KFENCE pool is checked by guard pages.
+    if (KERNEL_KFENCE_START <= addr && addr - KERNEL_KFENCE_START < KERNEL_KFENCE_SIZE) {
+        return true;
+    }
     switch (sz) {
         case 0:
         case 1:
@@ -0,0 +1,257 @@
+#include "arch/ptr.h"
+#include "kernel/panic.h"
+#include "kernel/printk.h"
+#include "kernel/sched.h"
+#include "lib/common.h"
+#include "lib/list.h"
+#include "lib/locking.h"
+#include "lib/stack_unwind.h"
+#include "mm/kfence.h"
+#include "mm/paging.h"
+
+PER_CPU_DEFINE(size_t, kfence_countdown);
+
+namespace mm {
+
+extern mm::Pte* vmalloc_p3;
+mm::Pte* EnsureNextTable(mm::Pte* tbl, size_t idx, uint64_t raw_flags, mm::AllocFlags af_flags) noexcept;
+
+}
+
+namespace kfence {
+
+namespace {
+
+// Number of objects in the pool. Each of them takes a page followed by a guard page.
+constexpr size_t KFENCE_NUM_OBJECTS = 255;
+
+// Bytes of the object page around the object are filled with the canary and checked on free.
+constexpr uint8_t KFENCE_CANARY = 0xaa;
+
+static_assert((2 * KFENCE_NUM_OBJECTS + 1) * PAGE_SIZE <= KERNEL_KFENCE_SIZE);
+
+enum class SlotState {
+    Unused,
+    Allocated,
+    Freed,
+};
+
+struct Slot {
+    ListNode free_list;
+
+    SlotState state = SlotState::Unused;
+    uintptr_t addr = 0;
+    size_t size = 0;
+
+    mm::Pte* pte = nullptr;
+    mm::Page* page = nullptr;
+
+    size_t alloc_cpu = 0;
+    size_t free_cpu = 0;
+    int32_t alloc_pid = 0;
+    int32_t free_pid = 0;
+    unwind::UnwindedStack alloc_stack;
+    unwind::UnwindedStack free_stack;
+};
+
+SpinLock pool_lock;
+
+Slot slots[KFENCE_NUM_OBJECTS];
+
+// Freed slots go to the tail, so freed objects stay unmapped as long as possible.
+ListHead<Slot, &Slot::free_list> free_slots;
+
+// Guard page of slot i precedes its object page, the last guard page follows the last object.
+uintptr_t SlotPage(size_t i) noexcept {
+    return KERNEL_KFENCE_START + (2 * i + 1) * PAGE_SIZE;
+}
+
+size_t SlotIndex(const Slot& slot) noexcept {
+    return &slot - slots;
+}
+
+int32_t CurrentPid() noexcept {
+    return sched::Current() ? sched::Current()->pid : 0;
+}
+
+// CheckCanary returns the first corrupted byte around the object or 0.
+uintptr_t CheckCanary(const Slot& slot) noexcept {
+    uintptr_t page = SlotPage(SlotIndex(slot));
+    for (uintptr_t addr = page; addr < page + PAGE_SIZE; addr++) {
+        if (addr == slot.addr) {
+            addr += slot.size - 1;
+            continue;
+        }
+        if (*(volatile uint8_t*)addr != KFENCE_CANARY) {
+            return addr;
+        }
+    }
+    return 0;
+}
+
+[[noreturn]] void ReportFinish(const Slot* slot) noexcept {
+    if (slot) {
+        printk("Object %p of %lu bytes\n", slot->addr, slot->size);
+        if (slot->state != SlotState::Unused) {
+            printk("Allocated on CPU#%x in PID %d at:\n", slot->alloc_cpu, slot->alloc_pid);
+            slot->alloc_stack.Print();
+        }
+        if (slot->state == SlotState::Freed) {
+            printk("Freed on CPU#%x in PID %d at:\n", slot->free_cpu, slot->free_pid);
+            slot->free_stack.Print();
+        }
+    }
+    kern::PanicFinish();
+}
+
+[[noreturn]] void ReportFree(const Slot* slot, void* addr, const char* what) noexcept {
+    kern::PanicStart();
+    printk("KFENCE: %s of %p on CPU#%x in PID %d at:\n", what, addr, PER_CPU_GET(cpu_id), CurrentPid());
+    unwind::PrintStack(unwind::StackIter::FromHere(), 2);
+    ReportFinish(slot);
+}
+
+}
+
+void* AllocSlow(size_t size, size_t alignment, mm::AllocFlags flags) noexcept {
+    PER_CPU_SET(kfence_countdown, CONFIG_KFENCE_SAMPLE_INTERVAL);
+    if (size == 0 || size > PAGE_SIZE) {
+        return nullptr;
+    }
+
+    Slot* slot = WithIrqSafeLocked(pool_lock, [&]() -> Slot* {
+        if (free_slots.Empty()) {
+            return nullptr;
+        }
+        Slot* first = &free_slots.First();
+        first->free_list.Remove();
+        return first;
+    });
+    if (!slot) {
+        return nullptr;
+    }
+
+    size_t idx = SlotIndex(*slot);
+    uintptr_t page = SlotPage(idx);
+    // Alternate sides of the page to catch both overflows and underflows on the guard pages.
+    if (idx % 2 == 0) {
+        slot->addr = ALIGN_DOWN(page + PAGE_SIZE - size, alignment);
+    } else {
+        slot->addr = page;
+    }
+    slot->size = size;
+    slot->alloc_cpu = PER_CPU_GET(cpu_id);
+    slot->alloc_pid = CurrentPid();
+    slot->alloc_stack = unwind::UnwindedStack::FromStackIter(unwind::StackIter::FromHere(), 1);
+
+    mm::PteSet(slot->pte, 0, (uint64_t)VIRT_TO_PHYS(slot->page->Virt()) | PTE_PRESENT | PTE_WRITE | PTE_NX);
+    // Fresh objects are full of the canary too, which exposes reads of uninitialized memory.
+    memset((void*)page, KFENCE_CANARY, PAGE_SIZE);
+    if (flags.Has(mm::AllocFlag::Zero)) {
+        memset((void*)slot->addr, 0, size);
+    }
+
+    slot->state = SlotState::Allocated;
+    return (void*)slot->addr;
+}
+
+void Free(void* addr) noexcept {
+    uintptr_t offset = (uintptr_t)addr - KERNEL_KFENCE_START;
+    size_t idx = offset / (2 * PAGE_SIZE);
+    Slot* slot = idx < KFENCE_NUM_OBJECTS ? &slots[idx] : nullptr;
+
+    if (!slot || slot->addr != (uintptr_t)addr || slot->state == SlotState::Unused) {
+        ReportFree(slot, addr, "invalid free");
+    }
+    if (slot->state == SlotState::Freed) {
+        ReportFree(slot, addr, "double free");
+    }
+    if (uintptr_t corrupted = CheckCanary(*slot)) {
+        kern::PanicStart();
+        printk("KFENCE: memory corruption at %p near object %p on CPU#%x in PID %d, detected on free at:\n",
+            corrupted, addr, PER_CPU_GET(cpu_id), CurrentPid());
+        unwind::PrintStack(unwind::StackIter::FromHere(), 1);
+        ReportFinish(slot);
+    }
+
+    slot->free_cpu = PER_CPU_GET(cpu_id);
+    slot->free_pid = CurrentPid();
+    slot->free_stack = unwind::UnwindedStack::FromStackIter(unwind::StackIter::FromHere(), 1);
+    slot->state = SlotState::Freed;
+
+    // Only the local TLB is flushed: other CPUs could miss accesses through stale entries for a while, but freeing
+    // never waits for them, so objects could be freed with IRQs disabled.
+    mm::PteSet(slot->pte, 0, 0);
+    arch::TlbInvalidate(SlotPage(idx));
+
+    WithIrqSafeLocked(pool_lock, [&]() {
+        free_slots.InsertLast(*slot);
+    });
+}
+
+void ReportFault(arch::Registers& regs, uintptr_t addr, bool write) noexcept {
+    uintptr_t offset = addr - KERNEL_KFENCE_START;
+    size_t page_idx = offset / PAGE_SIZE;
+    const Slot* slot = nullptr;
+    const char* what = "invalid access";
+
+    if (page_idx % 2 == 1 && page_idx / 2 < KFENCE_NUM_OBJECTS) {
+        slot = &slots[page_idx / 2];
+        if (slot->state == SlotState::Freed) {
+            what = "use-after-free";
+        }
+    } else if (page_idx / 2 <= KFENCE_NUM_OBJECTS) {
+        // A guard page: blame the closest allocated neighbour.
+        const Slot* left = page_idx >= 2 ? &slots[page_idx / 2 - 1] : nullptr;
+        const Slot* right = page_idx / 2 < KFENCE_NUM_OBJECTS ? &slots[page_idx / 2] : nullptr;
+        if (left && left->state != SlotState::Allocated) {
+            left = nullptr;
+        }
+        if (right && right->state != SlotState::Allocated) {
+            right = nullptr;
+        }
+        if (left && (!right || addr - (left->addr + left->size) < right->addr - addr)) {
+            slot = left;
+        } else {
+            slot = right;
+        }
+        if (slot) {
+            what = "out-of-bounds access";
+        }
+    }
+
+    kern::PanicStart();
+    printk("KFENCE: %s, %s at %p on CPU#%x in PID %d at:\n", what, write ? "WRITE" : "READ", addr, PER_CPU_GET(cpu_id), CurrentPid());
+    unwind::PrintStack(unwind::StackIter::FromRegs(regs));
+    ReportFinish(slot);
+}
+
+void Init() noexcept {
+    for (size_t i = 0; i < KFENCE_NUM_OBJECTS; i++) {
+        Slot& slot = slots[i];
+        slot.page = mm::AllocPage(0, mm::AllocFlag::SkipKasan);
+        if (!slot.page) {
+            panic("kfence: cannot allocate pool pages");
+        }
+
+        uintptr_t page = SlotPage(i);
+        mm::Pte* tbl = mm::vmalloc_p3;
+        for (size_t idx : {P3E_FROM_ADDR(page), P2E_FROM_ADDR(page)}) {
+            tbl = mm::EnsureNextTable(tbl, idx, PTE_WRITE, mm::AllocFlag::SkipKasan);
+            if (!tbl) {
+                panic("kfence: cannot allocate pool page tables");
+            }
+        }
+        // Object pages are mapped only while allocated, guard pages are never mapped.
+        slot.pte = &tbl[P1E_FROM_ADDR(page)];
+
+        WithIrqSafeLocked(pool_lock, [&]() {
+            free_slots.InsertLast(slot);
+        });
+    }
+
+    printk("[kfence] pool of %lu objects at %p, sampling 1 of %lu allocations\n", KFENCE_NUM_OBJECTS, KERNEL_KFENCE_START,
+        (size_t)CONFIG_KFENCE_SAMPLE_INTERVAL);
+}
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "arch/regs.h"
+#include "defs.h"
+#include "kernel/per_cpu.h"
+#include "mm/page_alloc.h"
+
+// Allocations left before the next sampled one on this CPU.
+PER_CPU_DECLARE(size_t, kfence_countdown);
+
+namespace kfence {
+
+#ifdef CONFIG_KFENCE
+
+// AllocSlow places the object into the pool if it fits and a slot is free.
+void* AllocSlow(size_t size, size_t alignment, mm::AllocFlags flags) noexcept;
+
+// Alloc places every CONFIG_KFENCE_SAMPLE_INTERVAL-th heap allocation of a CPU between guard pages of the KFENCE pool.
+// Returns nullptr for allocations which aren't sampled.
+inline void* Alloc(size_t size, size_t alignment, mm::AllocFlags flags) noexcept {
+    // Racy on preemption, which only shifts the next sample.
+    size_t left = PER_CPU_GET(kfence_countdown);
+    if (left > 1) {
+        PER_CPU_SET(kfence_countdown, left - 1);
+        return nullptr;
+    }
+    return AllocSlow(size, alignment, flags);
+}
+
+inline bool IsKfenceAddr(uintptr_t addr) noexcept {
+    return KERNEL_KFENCE_START <= addr && addr - KERNEL_KFENCE_START < KERNEL_KFENCE_SIZE;
+}
+
+inline bool IsKfenceAddr(const void* addr) noexcept {
+    return IsKfenceAddr((uintptr_t)addr);
+}
+
+// Free checks the object for corruption and unmaps it, so later accesses fault.
+void Free(void* addr) noexcept;
+
+// ReportFault reports an access to a guard page or a freed object of the pool.
+[[noreturn]] void ReportFault(arch::Registers& regs, uintptr_t addr, bool write) noexcept;
+
+// Init allocates pages of the pool. Allocations aren't sampled before.
+void Init() noexcept;
+
+#else // no KFENCE
+
+inline void* Alloc(size_t, size_t, mm::AllocFlags) noexcept {
+    return nullptr;
+}
+
+inline bool IsKfenceAddr(uintptr_t) noexcept {
+    return false;
+}
+
+inline bool IsKfenceAddr(const void*) noexcept {
+    return false;
+}
+
+inline void Free(void*) noexcept {}
+
+[[noreturn]] inline void ReportFault(arch::Registers&, uintptr_t, bool) noexcept {
+    __builtin_unreachable();
+}
+
+inline void Init() noexcept {}
+
+#endif // KFENCE
+
+}
@@ -4,6 +4,7 @@
 #include "kernel/printk.h"
 #include "lib/common.h"
 #include "mm/kasan.h"
+#include "mm/kfence.h"
 #include "mm/kmalloc.h"
 #include "mm/obj_alloc.h"
 #include "mm/page_alloc.h"
@@ -45,11 +46,11 @@ void* Kmalloc(size_t sz, AllocFlags flags) {
         }
         return page->Virt();
     }
-    void* ptr = kallocs[curr].Alloc(flags);
+    void* ptr = kallocs[curr].Alloc(sz, flags);
     if (!ptr) {
         return nullptr;
     }
-    if (!flags.Has(AllocFlag::SkipKasan)) {
+    if (!flags.Has(AllocFlag::SkipKasan) && !kfence::IsKfenceAddr(ptr)) {
         // TODO: why two calls?
         kasan::Poison((uintptr_t)ptr, KMALLOC_SIZES[curr]);
         kasan::Unpoison((uintptr_t)ptr, sz);
@@ -58,6 +59,10 @@ void* Kmalloc(size_t sz, AllocFlags flags) {
 }
 
 void Kfree(void* addr) {
+    if (kfence::IsKfenceAddr(addr)) {
+        kfence::Free(addr);
+        return;
+    }
     Page* page = Page::FromAddr(addr);
     BUG_ON_NULL(page);
     if (page->HasFlag(Page::InObjAlloc)) {
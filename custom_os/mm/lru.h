@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+
+#include "lib/list.h"
+#include "lib/locking.h"
+#include "lib/spinlock.h"
+
+namespace mm {
+
+// Lru ages cached objects on two lists. New objects start on the inactive list, objects referenced again while inactive
+// are promoted to the active list, so a single pass over a large file doesn't push out the working set.
+// T must provide HasFlag, SetFlag, ClearFlag and Lru, Active, Referenced flags.
+template <typename T, ListNode T::* Field>
+class Lru {
+public:
+    // Owners of cached objects take their locks nested in this one.
+    SpinLock lock_;
+
+private:
+    ListHead<T, Field> active_;
+    ListHead<T, Field> inactive_;
+    size_t nr_active_ = 0;
+    size_t nr_inactive_ = 0;
+
+    // Deactivate moves up to nr objects from the tail of the active list to the inactive list, while it's bigger.
+    // Objects referenced since the last pass get another round on the active list.
+    void Deactivate(size_t nr) noexcept {
+        for (size_t i = 0; i < nr && nr_active_ > nr_inactive_; i++) {
+            T& obj = active_.Last();
+            (obj.*Field).Remove();
+            if (obj.HasFlag(T::Referenced)) {
+                obj.ClearFlag(T::Referenced);
+                active_.InsertFirst(obj);
+                continue;
+            }
+            obj.ClearFlag(T::Active);
+            inactive_.InsertFirst(obj);
+            nr_active_--;
+            nr_inactive_++;
+        }
+    }
+
+public:
+    void AddLocked(T& obj) noexcept {
+        obj.ClearFlag(T::Active | T::Referenced);
+        obj.SetFlag(T::Lru);
+        inactive_.InsertFirst(obj);
+        nr_inactive_++;
+    }
+
+    // Add puts the new object at the head of the inactive list.
+    void Add(T& obj) noexcept {
+        IrqSafeScopeLocker locker(lock_);
+        AddLocked(obj);
+    }
+
+    void RemoveLocked(T& obj) noexcept {
+        if (!obj.HasFlag(T::Lru)) {
+            return;
+        }
+        (obj.*Field).Remove();
+        if (obj.HasFlag(T::Active)) {
+            nr_active_--;
+        } else {
+            nr_inactive_--;
+        }
+        obj.ClearFlag(T::Lru | T::Active | T::Referenced);
+    }
+
+    void ReplaceLocked(T& old_obj, T& obj) noexcept {
+        if (!old_obj.HasFlag(T::Lru)) {
+            AddLocked(obj);
+            return;
+        }
+        ListNode* prev = (old_obj.*Field).prev;
+        (old_obj.*Field).Remove();
+        (obj.*Field).Insert(prev, prev->next);
+        obj.ClearFlag(T::Active | T::Referenced);
+        obj.SetFlag(T::Lru | (old_obj.HasFlag(T::Active) ? T::Active : 0));
+        old_obj.ClearFlag(T::Lru | T::Active | T::Referenced);
+    }
+
+    // Replace puts the new object at the place of the old one, or adds it if the old one isn't on the lists.
+    void Replace(T& old_obj, T& obj) noexcept {
+        IrqSafeScopeLocker locker(lock_);
+        ReplaceLocked(old_obj, obj);
+    }
+
+    // Size returns number of objects on both lists. Racy, used to size reclaim passes.
+    size_t Size() const noexcept {
+        return nr_active_ + nr_inactive_;
+    }
+
+    // Scan looks at up to nr objects from the tail of the inactive list. Referenced or busy objects are activated,
+    // others are passed to evict, which returns true if the object was taken out of its cache. Evicted objects are
+    // already off the lists, so evict may reuse their list node. Returns the number of scanned objects.
+    template <typename Fn>
+    size_t Scan(size_t nr, Fn evict) noexcept {
+        IrqSafeScopeLocker locker(lock_);
+        Deactivate(nr);
+
+        size_t scanned = 0;
+        for (; scanned < nr && nr_inactive_ > 0; scanned++) {
+            T& obj = inactive_.Last();
+            (obj.*Field).Remove();
+            nr_inactive_--;
+
+            if (!obj.HasFlag(T::Referenced)) {
+                obj.ClearFlag(T::Lru);
+                if (evict(obj)) {
+                    continue;
+                }
+                obj.SetFlag(T::Lru);
+            }
+            obj.ClearFlag(T::Referenced);
+            obj.SetFlag(T::Active);
+            active_.InsertFirst(obj);
+            nr_active_++;
+        }
+        return scanned;
+    }
+};
+
+}
@@ -2,13 +2,15 @@
 #include "mm/kmalloc.h"
 #include "mm/page_alloc.h"
 #include "mm/new.h"
+#include "mm/vmalloc.h"
 
 void* operator new(size_t size, mm::AllocFlags flags) noexcept {
     return mm::Kmalloc(size, flags);
 }
 
+// Arrays could be large (tables indexed by fd or id), they don't need physically contiguous memory.
 void* operator new[](size_t size, mm::AllocFlags flags) noexcept {
-    return mm::Kmalloc(size, flags);
+    return mm::Kvmalloc(size, flags);
 }
 
 void* operator new(size_t size, mm::ObjectAllocator& alloc, mm::AllocFlags flags) noexcept {
@@ -46,9 +48,9 @@ void operator delete(void* ptr, size_t) noexcept {
 }
 
 void operator delete[](void* ptr) noexcept {
-    mm::Kfree(ptr);
+    mm::Kvfree(ptr);
 }
 
 void operator delete[](void* ptr, size_t) {
-    mm::Kfree(ptr);
+    mm::Kvfree(ptr);
 }
@@ -1,24 +1,88 @@
 #include "mm/obj_alloc.h"
 #include "defs.h"
+#include "kernel/per_cpu.h"
 #include "lib/list.h"
 #include "lib/locking.h"
+#include "mm/kfence.h"
 #include "mm/page_alloc.h"
 #include <cstddef>
 #include <cstdint>
 
 namespace mm {
 
+namespace {
+
+// Slabs larger than this are used only for objects which don't fit into smaller ones.
+constexpr size_t MAX_SLAB_ORDER = 3;
+
+std::atomic<ObjectAllocator*> all_allocators = nullptr;
+
+// SlabOrder returns the smallest slab order wasting at most 1/8 of the slab, or the order with the least waste.
+size_t SlabOrder(size_t obj_size) noexcept {
+    size_t min_order = PageAllocOrderBySize(obj_size);
+    if (min_order >= MAX_SLAB_ORDER) {
+        return min_order;
+    }
+
+    size_t best_order = min_order;
+    size_t best_waste_permille = 1000;
+    for (size_t order = min_order; order <= MAX_SLAB_ORDER; order++) {
+        size_t slab_size = PAGE_SIZE << order;
+        size_t waste_permille = (slab_size % obj_size) * 1000 / slab_size;
+        if (waste_permille <= 125) {
+            return order;
+        }
+        if (waste_permille < best_waste_permille) {
+            best_order = order;
+            best_waste_permille = waste_permille;
+        }
+    }
+    return best_order;
+}
+
+}
+
+ObjectAllocator::ObjectAllocator(size_t obj_size, size_t alignment, bool use_magazines) noexcept
+    : obj_size_(obj_size),
+      obj_size_aligned(ALIGN_UP(obj_size, alignment)),
+      alignment_(alignment),
+      use_magazines_(use_magazines)
+{
+    slab_order_ = SlabOrder(obj_size_aligned);
+    objs_per_slab_ = (PAGE_SIZE << slab_order_) / obj_size_aligned;
+
+    next_allocator_ = all_allocators.load(std::memory_order_relaxed);
+    while (!all_allocators.compare_exchange_weak(next_allocator_, this, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+}
+
 Page* ObjectAllocator::AllocPage(AllocFlags flags) noexcept {
-    size_t order = PageAllocOrderBySize(obj_size_aligned);
-    Page* page = mm::AllocPage(order, flags);
+    Page* page = mm::AllocPage(slab_order_, flags);
     if (!page) {
         return nullptr;
     }
-    page->SetFlag(Page::InObjAlloc);
-    page->oa_owner = this;
+    // Every page of the slab points to the allocator, objects could be freed by address from any of them.
+    for (size_t i = 0; i < (1ull << slab_order_); i++) {
+        page[i].SetFlag(Page::InObjAlloc);
+        page[i].oa_owner = this;
+    }
+    slab_count_++;
     return page;
 }
 
+Page* ObjectAllocator::SlabHead(Page* page) const noexcept {
+    // Buddy blocks are aligned to their size.
+    return page - (page->Id() & ((1ull << slab_order_) - 1));
+}
+
+void ObjectAllocator::FreeSlab(Page* page) noexcept {
+    for (size_t i = 0; i < (1ull << slab_order_); i++) {
+        page[i].ClearFlag(Page::InObjAlloc);
+    }
+    slab_count_--;
+    FreePage(page);
+}
+
 NO_KASAN inline void* fit_first (Page* page_ptr) noexcept {
     Forward_List_Node* first_free = (Forward_List_Node*)page_ptr->oa_freelist;
     page_ptr->oa_freelist = first_free->next;
@@ -31,28 +95,33 @@ NO_KASAN inline void* fit_first (Page* page_ptr) noexcept {
     return first_free;
 }
 
-NO_KASAN void* ObjectAllocator::Alloc(AllocFlags flags) noexcept {
-    bool can_split = PageAllocOrderBySize(obj_size_aligned * 2) == 0;
-    if (!can_split) {
-        Page* page = AllocPage(flags);
-        if (!page) {
-            return nullptr;
-        }
+namespace {
+
+// Magazines themselves come from an allocator without magazines.
+ObjectAllocator magazine_alloc(sizeof(ObjectAllocator::Magazine), alignof(ObjectAllocator::Magazine), false);
 
-        if (!flags.Has(AllocFlag::SkipKasan)) {
-            kasan::RecordAlloc((uintptr_t)page->Virt(), obj_size_aligned);
+}
+
+ObjectAllocator::Magazine* ObjectAllocator::LocalMagazine() noexcept {
+    if (!use_magazines_) {
+        return nullptr;
+    }
+    Magazine*& mag = magazines_[PER_CPU_GET(cpu_id)];
+    if (!mag) {
+        mag = (Magazine*)magazine_alloc.Alloc();
+        if (mag) {
+            mag->count = 0;
         }
-        return page->Virt();
     }
-    IrqSafeScopeLocker locker (this->lock_);
+    return mag;
+}
+
+NO_KASAN void* ObjectAllocator::AllocLocked(AllocFlags flags) noexcept {
     if (!free_pages_head_.Empty()) {
-        void* result = fit_first(free_pages_head_.begin().Value());
-        if (!flags.Has(AllocFlag::SkipKasan)) {
-            kasan::RecordAlloc((uintptr_t)result, obj_size_aligned);
-        }
-        return result;
+        used_objs_++;
+        return fit_first(free_pages_head_.begin().Value());
     }
-    
+
     Page* page = AllocPage(flags);
     if (!page) {
         return nullptr;
@@ -83,30 +152,52 @@ NO_KASAN void* ObjectAllocator::Alloc(AllocFlags flags) noexcept {
     if (page->oa_freelist) {
         free_pages_head_.InsertFirst(*page);
     }
-
-    if (!flags.Has(AllocFlag::SkipKasan)) {
-        kasan::RecordAlloc((uintptr_t)result, obj_size_aligned);
-    }
+    used_objs_++;
 
     return result;
 }
 
-NO_KASAN void ObjectAllocator::Free(void* obj) noexcept {
-    bool can_split = obj_size_aligned <= (PAGE_SIZE / 2);
-    Page* page = Page::FromAddr(obj);
-    BUG_ON(!page->HasFlag(Page::InObjAlloc));
-    ObjectAllocator* owner = (ObjectAllocator*)(page->oa_owner);
-    BUG_ON(owner != this);
-    kasan::PreFree((uintptr_t)obj, obj_size_aligned);
-    kasan::RecordFree((uintptr_t)obj, obj_size_aligned);
+NO_KASAN void* ObjectAllocator::Alloc(AllocFlags flags) noexcept {
+    return Alloc(obj_size_, flags);
+}
 
-    if (!can_split) {
-        FreePage(page);
-        return;
+NO_KASAN void* ObjectAllocator::Alloc(size_t size, AllocFlags flags) noexcept {
+    if (void* obj = kfence::Alloc(size, alignment_, flags)) {
+        return obj;
     }
-    Forward_List_Node* dealloc_block = (Forward_List_Node*) obj;
 
-    IrqSafeScopeLocker locker (this->lock_);
+    void* result = nullptr;
+    kern::WithoutIrqs([&]() {
+        Magazine* mag = LocalMagazine();
+        if (!mag) {
+            result = WithRawLocked(lock_, [&]() { return AllocLocked(flags); });
+            return;
+        }
+
+        if (mag->count == 0) {
+            RawScopeLocker locker(lock_);
+            while (mag->count < MAGAZINE_BATCH) {
+                void* obj = AllocLocked(flags);
+                if (!obj) {
+                    break;
+                }
+                mag->objs[mag->count++] = obj;
+            }
+        }
+        if (mag->count > 0) {
+            result = mag->objs[--mag->count];
+        }
+    });
+
+    if (result && !flags.Has(AllocFlag::SkipKasan)) {
+        kasan::RecordAlloc((uintptr_t)result, obj_size_aligned);
+    }
+    return result;
+}
+
+NO_KASAN void ObjectAllocator::FreeLocked(void* obj) noexcept {
+    Page* page = SlabHead(Page::FromAddr(obj));
+    Forward_List_Node* dealloc_block = (Forward_List_Node*) obj;
 
     if (!page->oa_freelist) {
         free_pages_head_.InsertFirst(*page);
@@ -117,17 +208,69 @@ NO_KASAN void ObjectAllocator::Free(void* obj) noexcept {
     
     
     page->oa_used_blocks--;
+    used_objs_--;
     
     if (page->oa_used_blocks == 0 && page->oa_page_list.next != page->oa_page_list.prev) {
         page->oa_page_list.Remove();
-        locker.Unlock();
-        FreePage(page);
+        FreeSlab(page);
+    }
+}
+
+NO_KASAN void ObjectAllocator::Free(void* obj) noexcept {
+    if (kfence::IsKfenceAddr(obj)) {
+        kfence::Free(obj);
         return;
     }
+
+    Page* page = Page::FromAddr(obj);
+    BUG_ON(!page->HasFlag(Page::InObjAlloc));
+    ObjectAllocator* owner = (ObjectAllocator*)(page->oa_owner);
+    BUG_ON(owner != this);
+    kasan::PreFree((uintptr_t)obj, obj_size_aligned);
+    kasan::RecordFree((uintptr_t)obj, obj_size_aligned);
+
+    kern::WithoutIrqs([&]() {
+        Magazine* mag = LocalMagazine();
+        if (!mag) {
+            WithRawLocked(lock_, [&]() { FreeLocked(obj); });
+            return;
+        }
+
+        if (mag->count == MAGAZINE_SIZE) {
+            // Return the coldest objects to slabs.
+            RawScopeLocker locker(lock_);
+            for (size_t i = 0; i < MAGAZINE_BATCH; i++) {
+                FreeLocked(mag->objs[i]);
+            }
+            mag->count -= MAGAZINE_BATCH;
+            memmove(&mag->objs[0], &mag->objs[MAGAZINE_BATCH], mag->count * sizeof(void*));
+        }
+        mag->objs[mag->count++] = obj;
+    });
 }
 
 ObjectAllocator* ObjectAllocator::FromPage(Page* page) noexcept {
     return (ObjectAllocator*)page->oa_owner;
 }
 
+void ObjectAllocator::DumpStats() noexcept {
+    printk("[mm] object allocators: size, slab order, objects per slab, slabs, used objects, wasted bytes\n");
+    for (ObjectAllocator* a = all_allocators.load(std::memory_order_acquire); a; a = a->next_allocator_) {
+        size_t slab_count = 0;
+        size_t used_objs = 0;
+        WithIrqSafeLocked(a->lock_, [&]() {
+            slab_count = a->slab_count_;
+            used_objs = a->used_objs_;
+        });
+        if (slab_count == 0) {
+            continue;
+        }
+
+        // Everything in slabs which isn't requested object memory: padding, slab tails and free objects.
+        size_t slab_bytes = slab_count * (PAGE_SIZE << a->slab_order_);
+        size_t waste = slab_bytes - used_objs * a->obj_size_;
+        printk("[mm]   %lu %lu %lu %lu %lu %lu (%lu%%)\n", a->obj_size_, a->slab_order_, a->objs_per_slab_, slab_count, used_objs, waste, waste * 100 / slab_bytes);
+    }
+}
+
 }
\ No newline at end of file
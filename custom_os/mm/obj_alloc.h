@@ -15,32 +15,76 @@ struct Forward_List_Node {
 };
 
 class ObjectAllocator {
+public:
+    // Number of free objects cached per CPU.
+    constexpr static size_t MAGAZINE_SIZE = 16;
+    // Number of objects moved between a magazine and slabs at once.
+    constexpr static size_t MAGAZINE_BATCH = MAGAZINE_SIZE / 2;
+
+    // Magazine is a per-cpu cache of free objects, it allows to allocate and free objects without taking the lock.
+    struct Magazine {
+        size_t count;
+        void* objs[MAGAZINE_SIZE];
+    };
+
 private:
     SpinLock lock_;
     size_t obj_size_ = 0;
     size_t obj_size_aligned = 0;
+    size_t alignment_ = 0;
+
+    // Slabs are blocks of 2^slab_order_ pages shared by several objects.
+    size_t slab_order_ = 0;
+    size_t objs_per_slab_ = 0;
+
+    // Statistics, protected by lock_. Objects cached in magazines are counted as used.
+    size_t slab_count_ = 0;
+    size_t used_objs_ = 0;
 
-    size_t allocated_count_ = 0;
     ListHead<Page, &Page::oa_page_list> free_pages_head_;
 
+    // All allocators are linked together for statistics.
+    ObjectAllocator* next_allocator_ = nullptr;
+
+    bool use_magazines_ = true;
+    // Magazines are allocated on first use on a CPU.
+    Magazine* magazines_[MAX_CPUS] = {};
+
+    // LocalMagazine returns magazine of the current CPU. Must be called with IRQs disabled.
+    Magazine* LocalMagazine() noexcept;
+
+    // AllocLocked takes an object from slabs. Must be called with lock_ held.
+    void* AllocLocked(AllocFlags flags) noexcept;
+
+    // FreeLocked returns an object to its slab. Must be called with lock_ held.
+    void FreeLocked(void* obj) noexcept;
+
+    // SlabHead returns the first page of the slab containing given page.
+    Page* SlabHead(Page* page) const noexcept;
+
+    // FreeSlab returns empty slab to the page allocator.
+    void FreeSlab(Page* page) noexcept;
+
 protected:
     constexpr static size_t MIN_ALLOC_ALIGNMENT = 8; 
 public:
     ObjectAllocator() noexcept = default;
-    ObjectAllocator(size_t obj_size, size_t alignment = MIN_ALLOC_ALIGNMENT) noexcept
-        : obj_size_(obj_size), 
-           obj_size_aligned(ALIGN_UP(obj_size, alignment)) 
-    {}
+    ObjectAllocator(size_t obj_size, size_t alignment = MIN_ALLOC_ALIGNMENT, bool use_magazines = true) noexcept;
 
     static ObjectAllocator* FromPage(Page* page) noexcept;
 
     Page* AllocPage(AllocFlags flags) noexcept;
     void* Alloc(AllocFlags flags = {}) noexcept;
+    // Alloc allocates an object for size bytes, at most ObjectSize. Sampled objects catch accesses past size.
+    void* Alloc(size_t size, AllocFlags flags) noexcept;
     void Free(void* t) noexcept;
 
     size_t ObjectSize() const noexcept {
         return obj_size_;
     }
+
+    // DumpStats prints slab usage and internal fragmentation of every object allocator.
+    static void DumpStats() noexcept;
 };
 
 template <typename T>
@@ -1,20 +1,153 @@
+#include "kernel/per_cpu.h"
 #include "mm/page_alloc.h"
 #include "mm/new.h"
 #include "lib/locking.h"
 
+extern size_t cpu_count;
+
 namespace mm {
 
 extern PageAlloc page_allocator;
 
+// Order-0 pages are cached per CPU, so the common single page allocation doesn't take the global lock.
+// Caches are refilled from and drained to the buddy free lists in batches.
+constexpr size_t PCP_BATCH = 16;
+constexpr size_t PCP_HIGH = 4 * PCP_BATCH;
+
 namespace {
 
+// PerCpuPages lives outside of the per-cpu section: the section must stay small.
+// Failing allocations drain caches of all CPUs, so it has a lock.
+struct alignas(CACHE_LINE_SIZE_BYTES) PerCpuPages {
+    SpinLock lock;
+    // Cached pages stay marked as used, so buddies never merge with them.
+    Page* pages[MIGRATE_TYPES][PCP_HIGH];
+    size_t count[MIGRATE_TYPES] = {};
+};
+
+PerCpuPages pcp_pages[MAX_CPUS];
+
 SpinLock page_alloc_lock;
 
+constexpr size_t PAGEBLOCK_PAGES = 1 << PAGEBLOCK_ORDER;
+
+Page* PageblockHead(Page* page) noexcept {
+    return &page->Area()->pages[ALIGN_DOWN(page->Id(), PAGEBLOCK_PAGES)];
+}
+
+MigrateType PageblockType(Page* page) noexcept {
+    return PageblockHead(page)->HasFlag(Page::MovableBlock) ? MIGRATE_MOVABLE : MIGRATE_UNMOVABLE;
+}
+
+void SetPageblockType(Page* head, MigrateType type) noexcept {
+    if (type == MIGRATE_MOVABLE) {
+        head->SetFlag(Page::MovableBlock);
+    } else {
+        head->ClearFlag(Page::MovableBlock);
+    }
+}
+
+// MoveFreePages moves free blocks of the pageblock to the free lists of given type.
+void MoveFreePages(Page* head, MigrateType type) noexcept {
+    PageAllocArea* area = head->Area();
+    size_t end = std::min(head->Id() + PAGEBLOCK_PAGES, area->size_in_pages);
+    for (size_t idx = head->Id(); idx < end; ) {
+        Page* page = &area->pages[idx];
+        if (page->HasFlag(Page::Used)) {
+            idx++;
+            continue;
+        }
+        // Walking from the aligned start, every free page met is the first page of a free block.
+        page->pa_free_list.Remove();
+        area->free_lists[type][page->Order()].InsertLast(*page);
+        idx += 1 << page->Order();
+    }
+}
+
+// Expand splits free block of current_order down to order, returning upper halves to the free lists.
+void Expand(PageAllocArea& area, Page* page, size_t current_order, size_t order) noexcept {
+    while (current_order > order) {
+        current_order--;
+        Page* buddy = page + (1 << current_order);
+        buddy->SetOrder(current_order);
+        area.free_lists[PageblockType(buddy)][current_order].InsertLast(*buddy);
+    }
+}
+
+// TakeFreeBlock takes the smallest free block of at least 2^order pages from the free lists of given type.
+Page* TakeFreeBlock(size_t order, MigrateType type) noexcept {
+    for (size_t i = 0; i < page_allocator.area_count; i++) {
+        PageAllocArea& area = page_allocator.areas[i];
+
+        size_t current_order = order;
+        while (current_order <= PAGE_MAX_ALLOCATION_ORDER && area.free_lists[type][current_order].Empty()) {
+            current_order++;
+        }
+
+        if (current_order > PAGE_MAX_ALLOCATION_ORDER) {
+            continue;
+        }
+
+        Page* page = &area.free_lists[type][current_order].First();
+        page->pa_free_list.Remove();
+        Expand(area, page, current_order, order);
+        page->SetOrder(order);
+        return page;
+    }
+
+    return nullptr;
 }
+
+// StealFreeBlock falls back to the free lists of another type. The largest block is taken, so allocations of different types
+// mix in as few pageblocks as possible. A large enough block moves its whole pageblock to the requested type.
+Page* StealFreeBlock(size_t order, MigrateType type) noexcept {
+    MigrateType other = type == MIGRATE_MOVABLE ? MIGRATE_UNMOVABLE : MIGRATE_MOVABLE;
+
+    for (size_t current_order = PAGE_MAX_ALLOCATION_ORDER + 1; current_order-- > order; ) {
+        for (size_t i = 0; i < page_allocator.area_count; i++) {
+            PageAllocArea& area = page_allocator.areas[i];
+            if (area.free_lists[other][current_order].Empty()) {
+                continue;
+            }
+
+            Page* page = &area.free_lists[other][current_order].First();
+            if (current_order + 1 < PAGEBLOCK_ORDER) {
+                page->pa_free_list.Remove();
+                Expand(area, page, current_order, order);
+                page->SetOrder(order);
+                return page;
+            }
+
+            if (current_order >= PAGEBLOCK_ORDER) {
+                // The whole block is free: just relabel all pageblocks it covers.
+                for (size_t j = 0; j < (1ull << current_order); j += PAGEBLOCK_PAGES) {
+                    SetPageblockType(page + j, type);
+                }
+                page->pa_free_list.Remove();
+                area.free_lists[type][current_order].InsertLast(*page);
+            } else {
+                // At least half of the pageblock is free: claim it.
+                Page* head = PageblockHead(page);
+                SetPageblockType(head, type);
+                MoveFreePages(head, type);
+            }
+            return TakeFreeBlock(order, type);
+        }
+    }
+
+    return nullptr;
+}
+
+}
+
 void DoInitArea(PageAllocArea* area) noexcept {
     for (size_t i = 0; i < area->size_in_pages; i++) {
         new (&area->pages[i]) Page(area);
         area->pages[i].SetFlag(Page::Used);
+        // Most memory ends up in user pages and the page cache, unmovable allocations steal pageblocks on demand.
+        if (i % PAGEBLOCK_PAGES == 0) {
+            area->pages[i].SetFlag(Page::MovableBlock);
+        }
     }
 
     size_t current_idx = 0;
@@ -40,56 +173,37 @@ void DoInitArea(PageAllocArea* area) noexcept {
             area->pages[current_idx + i].ClearFlag(Page::Used);
         }
 
-        area->free_lists[order].InsertLast(*page);
+        area->free_lists[MIGRATE_MOVABLE][order].InsertLast(*page);
 
         current_idx += block_size;
     }
 }
 
-Page* DoAllocPage(size_t order, AllocFlags) noexcept {
-    IrqSafeScopeLocker locker(page_alloc_lock);
-
-    for (size_t i = 0; i < page_allocator.area_count; i++) {
-        PageAllocArea& area = page_allocator.areas[i];
-
-        size_t current_order = order;
-        while (current_order <= PAGE_MAX_ALLOCATION_ORDER && area.free_lists[current_order].Empty()) {
-            current_order++;
-        }
-
-        if (current_order > PAGE_MAX_ALLOCATION_ORDER) {
-            continue;
-        }
-
-        Page* page = &area.free_lists[current_order].First();
-        page->pa_free_list.Remove();
-
-        while (current_order > order) {
-            current_order--;
-            size_t half_size = 1 << current_order;
-            
-            Page* buddy = page + half_size;
-            
-            buddy->SetOrder(current_order);
-            area.free_lists[current_order].InsertLast(*buddy);
-        }
+// BuddyAlloc takes 2^order pages from the free lists of given type, falling back to other types. Must be called with page_alloc_lock held.
+Page* BuddyAlloc(size_t order, MigrateType type) noexcept {
+    Page* page = TakeFreeBlock(order, type);
+    if (!page) {
+        page = StealFreeBlock(order, type);
+    }
+    if (!page) {
+        return nullptr;
+    }
 
-        page->SetOrder(order);
-        
-        size_t page_cnt = 1 << order;
-        for (size_t j = 0; j < page_cnt; j++) {
-            page[j].SetFlag(Page::Used);
+    size_t page_cnt = 1 << order;
+    for (size_t j = 0; j < page_cnt; j++) {
+        page[j].SetFlag(Page::Used);
+        if (type == MIGRATE_MOVABLE) {
+            page[j].SetFlag(Page::Movable);
+        } else {
+            page[j].ClearFlag(Page::Movable);
         }
-
-        return page;
     }
 
-    return nullptr;
+    return page;
 }
 
-void DoFreePage(Page* page) noexcept {
-    IrqSafeScopeLocker locker(page_alloc_lock);
-
+// BuddyFree returns pages to the free lists, merging them with free buddies. Must be called with page_alloc_lock held.
+void BuddyFree(Page* page) noexcept {
     PageAllocArea* area = page->Area();
     size_t order = page->Order();
     
@@ -120,7 +234,138 @@ void DoFreePage(Page* page) noexcept {
     }
 
     page->SetOrder(order);
-    area->free_lists[order].InsertLast(*page);
+    area->free_lists[PageblockType(page)][order].InsertLast(*page);
+}
+
+Page* DoAllocPage(size_t order, AllocFlags flags) noexcept {
+    MigrateType type = flags.Has(AllocFlag::Movable) ? MIGRATE_MOVABLE : MIGRATE_UNMOVABLE;
+    if (order != 0) {
+        IrqSafeScopeLocker locker(page_alloc_lock);
+        return BuddyAlloc(order, type);
+    }
+
+    // Preemption could move the task to another CPU meanwhile, the lock keeps the cache consistent anyway.
+    PerCpuPages* pcp = &pcp_pages[PER_CPU_GET(cpu_id)];
+    return WithIrqSafeLocked(pcp->lock, [&]() -> Page* {
+        if (pcp->count[type] == 0) {
+            RawScopeLocker locker(page_alloc_lock);
+            while (pcp->count[type] < PCP_BATCH) {
+                Page* p = BuddyAlloc(0, type);
+                if (!p) {
+                    break;
+                }
+                pcp->pages[type][pcp->count[type]++] = p;
+            }
+        }
+        if (pcp->count[type] == 0) {
+            return nullptr;
+        }
+        return pcp->pages[type][--pcp->count[type]];
+    });
+}
+
+void DoFreePage(Page* page) noexcept {
+    if (page->Order() != 0) {
+        IrqSafeScopeLocker locker(page_alloc_lock);
+        BuddyFree(page);
+        return;
+    }
+
+    MigrateType type = page->HasFlag(Page::Movable) ? MIGRATE_MOVABLE : MIGRATE_UNMOVABLE;
+    PerCpuPages* pcp = &pcp_pages[PER_CPU_GET(cpu_id)];
+    WithIrqSafeLocked(pcp->lock, [&]() {
+        if (pcp->count[type] == PCP_HIGH) {
+            // Drain the coldest pages.
+            RawScopeLocker locker(page_alloc_lock);
+            for (size_t i = 0; i < PCP_BATCH; i++) {
+                BuddyFree(pcp->pages[type][i]);
+            }
+            pcp->count[type] -= PCP_BATCH;
+            memmove(&pcp->pages[type][0], &pcp->pages[type][PCP_BATCH], pcp->count[type] * sizeof(Page*));
+        }
+        pcp->pages[type][pcp->count[type]++] = page;
+    });
+}
+
+// DrainPerCpuPages returns pages cached by all CPUs to the free lists, so they could be allocated by any CPU and merge
+// into larger blocks. Returns number of drained pages.
+size_t DrainPerCpuPages() noexcept {
+    size_t drained = 0;
+    for (size_t cpu = 0; cpu < cpu_count; cpu++) {
+        PerCpuPages& pcp = pcp_pages[cpu];
+        IrqSafeScopeLocker pcp_locker(pcp.lock);
+        RawScopeLocker locker(page_alloc_lock);
+        for (size_t type = 0; type < MIGRATE_TYPES; type++) {
+            for (size_t i = 0; i < pcp.count[type]; i++) {
+                BuddyFree(pcp.pages[type][i]);
+            }
+            drained += pcp.count[type];
+            pcp.count[type] = 0;
+        }
+    }
+    return drained;
+}
+
+// IsolateFreeBlocks takes free blocks inside the aligned block of 2^order pages out of the free lists.
+// Fails without isolating anything if the block has used pages which aren't movable.
+bool IsolateFreeBlocks(Page* block, size_t order, ListHead<Page, &Page::pa_free_list>& isolated) noexcept {
+    IrqSafeScopeLocker locker(page_alloc_lock);
+
+    size_t end = 1 << order;
+    size_t used = 0;
+    for (size_t idx = 0; idx < end; idx++) {
+        if (block[idx].HasFlag(Page::Used)) {
+            if (!block[idx].HasFlag(Page::Movable)) {
+                return false;
+            }
+            used++;
+        }
+    }
+    // The block could have been freed meanwhile. Otherwise every free block inside it starts on the walk below.
+    if (used == 0) {
+        return false;
+    }
+
+    for (size_t idx = 0; idx < end; ) {
+        Page* page = &block[idx];
+        if (page->HasFlag(Page::Used)) {
+            idx++;
+            continue;
+        }
+        size_t page_cnt = 1 << page->Order();
+        page->pa_free_list.Remove();
+        // Isolated pages look like movable ones, so the block could be isolated again after migration.
+        for (size_t i = 0; i < page_cnt; i++) {
+            page[i].SetFlag(Page::Used | Page::Movable);
+        }
+        isolated.InsertLast(*page);
+        idx += page_cnt;
+    }
+    return true;
+}
+
+// PutbackFreeBlocks returns blocks taken by IsolateFreeBlocks to the free lists.
+void PutbackFreeBlocks(ListHead<Page, &Page::pa_free_list>& isolated) noexcept {
+    IrqSafeScopeLocker locker(page_alloc_lock);
+    while (!isolated.Empty()) {
+        Page* page = &isolated.First();
+        page->pa_free_list.Remove();
+        BuddyFree(page);
+    }
+}
+
+void FreeBlockCounts(size_t (&counts)[MIGRATE_TYPES][PAGE_MAX_ALLOCATION_ORDER + 1]) noexcept {
+    IrqSafeScopeLocker locker(page_alloc_lock);
+    for (size_t type = 0; type < MIGRATE_TYPES; type++) {
+        for (size_t order = 0; order <= PAGE_MAX_ALLOCATION_ORDER; order++) {
+            counts[type][order] = 0;
+            for (size_t i = 0; i < page_allocator.area_count; i++) {
+                for ([[maybe_unused]] Page& page : page_allocator.areas[i].free_lists[type][order]) {
+                    counts[type][order]++;
+                }
+            }
+        }
+    }
 }
 
 }
@@ -15,6 +15,12 @@ namespace mm {
 enum class AllocFlag {
     SkipKasan = 1 << 0,
     NoSleep = 1 << 1,
+    // Page could be relocated by compaction (anonymous and page cache pages). Honored for single pages only.
+    Movable = 1 << 2,
+    // Don't compact memory if there is no free block of requested order.
+    NoCompact = 1 << 3,
+    // Zero the allocated pages. Single pages come from per-CPU reserves zeroed in background, if possible.
+    Zero = 1 << 4,
 };
 using AllocFlags = BitFlags<AllocFlag>;
 
@@ -24,6 +30,15 @@ constexpr size_t PAGE_MAX_ALLOCATION_ORDER_BITS = 4;
 constexpr size_t PAGE_MAX_ALLOCATION_AREAS_BITS = 4;
 constexpr size_t PAGE_MAX_ALLOCATION_ORDER = 11;
 
+// Free memory is grouped by migrate type in blocks of 2^PAGEBLOCK_ORDER pages, so unmovable allocations don't pin every high-order block.
+constexpr size_t PAGEBLOCK_ORDER = 9;
+
+enum MigrateType {
+    MIGRATE_UNMOVABLE = 0,
+    MIGRATE_MOVABLE = 1,
+    MIGRATE_TYPES = 2,
+};
+
 // Page is a descriptor of a physical page.
 struct Page {
 public:
@@ -37,6 +52,16 @@ public:
 
     static constexpr uint32_t HasBuffer = 1 << 7;
 
+    // Page was allocated with AllocFlag::Movable.
+    static constexpr uint32_t Movable = 1 << 8;
+    // Set on the first page of a pageblock which groups movable allocations.
+    static constexpr uint32_t MovableBlock = 1 << 9;
+
+    // Page is on an LRU list of reclaimable pages, see mm/lru.h.
+    static constexpr uint32_t Lru = 1 << 10;
+    static constexpr uint32_t Active = 1 << 11;
+    static constexpr uint32_t Referenced = 1 << 12;
+
 private:
     // Those fields are always in use by page allocator.
     std::atomic<uint64_t> flags;
@@ -54,6 +79,8 @@ public:
     union {
         void* oa_freelist;
         void* buffer_owner;
+        // Inode which page cache owns the page.
+        void* pc_owner;
     };
 
     union {
@@ -65,6 +92,7 @@ public:
         size_t oa_used_blocks;
         ListNode pc_dirty_list;
     };
+    ListNode lru_list;
     RefCounted ref_count;
 
 public:
@@ -124,7 +152,7 @@ struct PageAllocArea {
     size_t pages_total = 0;
     std::atomic<size_t> pages_allocated = 0;
 
-    ListHead<Page, &Page::pa_free_list> free_lists[PAGE_MAX_ALLOCATION_ORDER + 1];
+    ListHead<Page, &Page::pa_free_list> free_lists[MIGRATE_TYPES][PAGE_MAX_ALLOCATION_ORDER + 1];
 };
 
 constexpr size_t MAX_ALLOCATION_AREAS = 1 << PAGE_MAX_ALLOCATION_AREAS_BITS;
@@ -135,6 +163,10 @@ struct PageAlloc {
     size_t page_count;
 
     Page* page_storage;
+
+    // Index of the first area overlapping each 2 MiB section of the direct physical mapping, used by Page::FromAddr.
+    uint8_t* sections;
+    size_t section_count;
 };
 
 // AllocPage allocates continuous memory region contains at least 2^order pages.
@@ -143,9 +175,25 @@ Page* AllocPage(size_t order, mm::AllocFlags flags = {}) noexcept;
 // FreePage frees pages at given base address.
 void FreePage(Page* page) noexcept;
 
+// SplitPage turns allocated block of 2^order pages into independent pages, each of them must be freed separately.
+void SplitPage(Page* page) noexcept;
+
+// ZeroPagesStart starts the low priority thread which fills per-CPU reserves of zeroed pages.
+void ZeroPagesStart() noexcept;
+
 // FreePagesCount return number of free pages in system.
 size_t FreePagesCount() noexcept;
 
+// FreeBlockCounts returns number of free blocks of each migrate type and order.
+void FreeBlockCounts(size_t (&counts)[MIGRATE_TYPES][PAGE_MAX_ALLOCATION_ORDER + 1]) noexcept;
+
+// FragmentationIndex tells why allocation of given order would fail: values near 0 mean lack of memory, near 1000 mean fragmentation.
+// Returns -1000 if there is a free block of the order.
+int FragmentationIndex(size_t order) noexcept;
+
+// DumpFragmentation prints free blocks, fragmentation indexes and compaction counters.
+void DumpFragmentation() noexcept;
+
 // PageAllocOrderBySize returns minimal order that will satisfy allocation of given size.
 inline size_t PageAllocOrderBySize(size_t size) noexcept {
     size_t order = 0;
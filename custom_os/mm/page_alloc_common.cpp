@@ -2,6 +2,7 @@
 #include <array>
 
 #include "defs.h"
+#include "kernel/irq.h"
 #include "kernel/multiboot.h"
 #include "kernel/panic.h"
 #include "lib/common.h"
@@ -10,6 +11,7 @@
 #include "mm/page_alloc.h"
 #include "mm/paging.h"
 #include "mm/kasan.h"
+#include "mm/reclaim.h"
 #include "linker.h"
 
 namespace mm {
@@ -19,14 +21,34 @@ PageAlloc page_allocator;
 void DoFreePage(Page* page) noexcept;
 Page* DoAllocPage(size_t order, AllocFlags flags) noexcept;
 void DoInitArea(PageAllocArea* area) noexcept;
+Page* CompactPages(size_t order, AllocFlags flags) noexcept;
+size_t DirectReclaim(size_t order) noexcept;
+size_t DrainPerCpuPages() noexcept;
+Page* TakeZeroedPage(AllocFlags flags) noexcept;
 
 static bool early_page_alloc_enabled = true;
 
+constexpr size_t PAGE_SECTION_BITS = 21;
+constexpr uint8_t PAGE_SECTION_NO_AREA = 0xff;
+static_assert(MAX_ALLOCATION_AREAS < PAGE_SECTION_NO_AREA);
+
 Page* Page::FromAddr(void* ptr) noexcept {
     uintptr_t addr = (uintptr_t)ptr;
-    for (size_t i = 0; i < page_allocator.area_count; i++) {
+    if (addr < KERNEL_DIRECT_PHYS_MAPPING_START) {
+        return nullptr;
+    }
+    size_t section = (addr - KERNEL_DIRECT_PHYS_MAPPING_START) >> PAGE_SECTION_BITS;
+    if (section >= page_allocator.section_count) {
+        return nullptr;
+    }
+
+    // Areas are sorted by address. Usually the section belongs to a single area, but an area could end and the next one start inside it.
+    for (size_t i = page_allocator.sections[section]; i < page_allocator.area_count; i++) {
         PageAllocArea* area = &page_allocator.areas[i];
-        if (area->base <= addr && addr < area->base + area->size_in_pages * PAGE_SIZE) {
+        if (addr < area->base) {
+            break;
+        }
+        if (addr < area->base + area->size_in_pages * PAGE_SIZE) {
             size_t page_idx = (addr - area->base) / PAGE_SIZE;
             Page* page = &area->pages[page_idx];
             BUG_ON(!page->HasFlag(Page::Used));
@@ -52,13 +74,36 @@ Page::Page(PageAllocArea* area) noexcept {
 }
 
 Page* AllocPage(size_t order, mm::AllocFlags flags) noexcept {
-    UNUSED(flags);
-
     if (order >= PAGE_MAX_ALLOCATION_ORDER) {
         return nullptr;
     }
 
+    if (order == 0 && flags.Has(AllocFlag::Zero)) {
+        Page* page = TakeZeroedPage(flags);
+        if (page) {
+            if (!flags.Has(AllocFlag::SkipKasan)) {
+                kasan::Unpoison((uintptr_t)page->Virt(), PAGE_SIZE);
+            }
+            return page;
+        }
+    }
+
     Page* page = DoAllocPage(order, flags);
+    if (!page && DrainPerCpuPages() > 0) {
+        // The last free pages could be cached by other CPUs.
+        page = DoAllocPage(order, flags);
+    }
+    bool can_sleep = !flags.Has(AllocFlag::NoSleep) && kern::IsIrqEnabled();
+    if (!page && can_sleep && DirectReclaim(order) > 0) {
+        page = DoAllocPage(order, flags);
+    }
+    if (!page && order > 0 && can_sleep && !flags.Has(AllocFlag::NoCompact)) {
+        // Memory could be free, but too fragmented for the order.
+        page = CompactPages(order, flags);
+    }
+    if (can_sleep) {
+        WakeReclaim();
+    }
 
     if (page) {
         page->Area()->pages_allocated.fetch_add(1 << page->Order(), std::memory_order_relaxed);
@@ -67,6 +112,10 @@ Page* AllocPage(size_t order, mm::AllocFlags flags) noexcept {
         if (!flags.Has(AllocFlag::SkipKasan)) {
             kasan::Unpoison((uintptr_t)page->Virt(), (1 << page->Order()) * PAGE_SIZE);
         }
+        if (flags.Has(AllocFlag::Zero)) {
+            // Pages allocated with SkipKasan stay poisoned.
+            KASAN_NO_INTERCEPT(memset)(page->Virt(), 0, (1 << page->Order()) * PAGE_SIZE);
+        }
     }
 
     return page;
@@ -82,6 +131,16 @@ void FreePage(Page* page) noexcept {
     DoFreePage(page);
 }
 
+void SplitPage(Page* page) noexcept {
+    BUG_ON_NULL(page);
+    BUG_ON(!page->HasFlag(Page::Used));
+
+    size_t page_cnt = 1 << page->Order();
+    for (size_t i = 0; i < page_cnt; i++) {
+        page[i].SetOrder(0);
+    }
+}
+
 
 constexpr int START_FREE = 0;
 constexpr int END_FREE = 1;
@@ -221,6 +280,38 @@ void AllocPageStorage() noexcept {
     printk("[mm] page storage at %p-%p (%lu pages)\n", page_allocator.page_storage, ALIGN_UP(page_allocator.page_storage + page_allocator.page_count, PAGE_SIZE), pagesNeeded);
 }
 
+void AllocPageSections() noexcept {
+    uintptr_t end = KERNEL_DIRECT_PHYS_MAPPING_START;
+    for (size_t i = 0; i < page_allocator.area_count; i++) {
+        PageAllocArea* area = &page_allocator.areas[i];
+        end = std::max(end, area->base + area->size_in_pages * PAGE_SIZE);
+    }
+
+    page_allocator.section_count = DIV_ROUNDUP(end - KERNEL_DIRECT_PHYS_MAPPING_START, 1ull << PAGE_SECTION_BITS);
+    page_allocator.sections = (uint8_t*)EarlyAllocPage(DIV_ROUNDUP(page_allocator.section_count, PAGE_SIZE));
+    if (!page_allocator.sections) {
+        panic("cannot allocate page sections table (%lu sections)", page_allocator.section_count);
+    }
+}
+
+// InitPageSections fills the sections table. Must be called after all early allocations, when areas don't change anymore.
+void InitPageSections() noexcept {
+    memset(page_allocator.sections, PAGE_SECTION_NO_AREA, page_allocator.section_count);
+
+    // Go backwards, so the section keeps the first area overlapping it.
+    for (size_t i = page_allocator.area_count; i-- > 0; ) {
+        PageAllocArea* area = &page_allocator.areas[i];
+        if (area->size_in_pages == 0) {
+            continue;
+        }
+        size_t first = (area->base - KERNEL_DIRECT_PHYS_MAPPING_START) >> PAGE_SECTION_BITS;
+        size_t last = (area->base + area->size_in_pages * PAGE_SIZE - 1 - KERNEL_DIRECT_PHYS_MAPPING_START) >> PAGE_SECTION_BITS;
+        for (size_t section = first; section <= last; section++) {
+            page_allocator.sections[section] = i;
+        }
+    }
+}
+
 void InitArea(PageAllocArea* area) noexcept {
     area->pages = page_allocator.page_storage;
 
@@ -233,11 +324,13 @@ void InitArea(PageAllocArea* area) noexcept {
 
 void InitPageAlloc() noexcept {
     AllocPageStorage();
+    AllocPageSections();
     early_page_alloc_enabled = false;
 
     for (size_t i = 0; i < page_allocator.area_count; i++) {
         InitArea(&page_allocator.areas[i]);
     }
+    InitPageSections();
 
     printk("[kernel] initialized page alloc with %lu pages (%lu MBytes)\n", page_allocator.page_count, page_allocator.page_count * PAGE_SIZE / MB);
 }
@@ -16,13 +16,18 @@
 #define PTE_GLOBAL       (1ull << 8)
 #define PTE_NX           (1ull << 63)
 
+// Ignored by CPU, used by OS.
+#define PTE_COW          (1ull << 9)
+// Not present entry holding a swap slot instead of the page address.
+#define PTE_SWAP         (1ull << 10)
+
 // Set by CPU.
 #define PTE_ACCESSED     (1ull << 5)
 #define PTE_DIRTY        (1ull << 6)
 
 #define PTE_COUNT      512
 
-#define PTE_FLAGS_MASK (PTE_PRESENT | PTE_WRITE | PTE_USER | PTE_WRITETHROUGH | PTE_NO_CACHE | PTE_PAGE_SIZE | PTE_GLOBAL | PTE_NX)
+#define PTE_FLAGS_MASK (PTE_PRESENT | PTE_WRITE | PTE_USER | PTE_WRITETHROUGH | PTE_NO_CACHE | PTE_PAGE_SIZE | PTE_GLOBAL | PTE_COW | PTE_NX)
 #define PTE_ADDR_MASK  0x0000fffffffff000
 
 #define P4E_ADDR_BITS       39
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <atomic>
+
+#include "kernel/kernel_thread.h"
+#include "kernel/panic.h"
+#include "kernel/printk.h"
+#include "kernel/time.h"
+#include "kernel/wait.h"
+#include "lib/locking.h"
+#include "mm/page_alloc.h"
+#include "mm/reclaim.h"
+
+namespace mm {
+
+extern PageAlloc page_allocator;
+
+namespace {
+
+using namespace time::literals;
+
+// Objects are scanned in batches, so LRU locks aren't held with IRQs disabled for long.
+constexpr size_t RECLAIM_BATCH = 32;
+
+// The first pass scans 1/2^RECLAIM_PRIORITY_MAX of every cache, each next pass doubles it.
+constexpr size_t RECLAIM_PRIORITY_MAX = 6;
+
+// The reclaim thread rechecks free memory even if nobody woke it.
+constexpr uint64_t RECLAIM_PERIOD = 1_s;
+
+constexpr size_t MAX_SHRINKERS = 8;
+
+// Shrinkers are only appended: reclaim reads the count and then the slots below it without the lock, because Scan
+// could sleep.
+SpinLock shrinkers_lock;
+Shrinker* shrinkers[MAX_SHRINKERS];
+std::atomic<size_t> shrinker_count = 0;
+
+kern::WaitQueue reclaim_wq;
+
+std::atomic<uint64_t> pages_scanned = 0;
+std::atomic<uint64_t> pages_reclaimed = 0;
+std::atomic<uint64_t> direct_reclaims = 0;
+std::atomic<uint64_t> reclaim_wakeups = 0;
+
+// The reclaim thread starts working below the low watermark and stops above the high one.
+size_t WatermarkLow() noexcept {
+    return page_allocator.page_count / 64;
+}
+
+size_t WatermarkHigh() noexcept {
+    return page_allocator.page_count / 32;
+}
+
+// ShrinkOne scans up to nr objects of the shrinker in batches, stops when enough pages are freed.
+size_t ShrinkOne(Shrinker& shrinker, size_t nr, size_t goal) noexcept {
+    size_t scanned = 0;
+    size_t freed = 0;
+    while (scanned < nr && freed < goal) {
+        ShrinkResult res = shrinker.Scan(std::min(nr - scanned, RECLAIM_BATCH));
+        if (res.scanned == 0) {
+            break;
+        }
+        scanned += res.scanned;
+        freed += res.freed_pages;
+    }
+
+    pages_scanned.fetch_add(scanned, std::memory_order_relaxed);
+    pages_reclaimed.fetch_add(freed, std::memory_order_relaxed);
+    return freed;
+}
+
+void ReclaimThread(void*) noexcept {
+    for (;;) {
+        time::Time deadline = time::NowMonotonic().Add(RECLAIM_PERIOD);
+        reclaim_wq.WaitCondDeadline([]() {
+            return FreePagesCount() < WatermarkLow();
+        }, deadline);
+
+        while (FreePagesCount() < WatermarkHigh()) {
+            if (ReclaimPages(RECLAIM_BATCH) == 0) {
+                // Caches are busy or empty: don't spin until the next period.
+                time::SleepUntil(deadline);
+                break;
+            }
+        }
+    }
+}
+
+}
+
+void RegisterShrinker(Shrinker& shrinker) noexcept {
+    IrqSafeScopeLocker locker(shrinkers_lock);
+    size_t idx = shrinker_count.load(std::memory_order_relaxed);
+    BUG_ON(idx == MAX_SHRINKERS);
+    shrinkers[idx] = &shrinker;
+    shrinker_count.store(idx + 1, std::memory_order_release);
+}
+
+size_t ReclaimPages(size_t nr) noexcept {
+    size_t freed = 0;
+    size_t nr_shrinkers = shrinker_count.load(std::memory_order_acquire);
+    for (size_t priority = RECLAIM_PRIORITY_MAX + 1; priority-- > 0 && freed < nr; ) {
+        for (size_t i = 0; i < nr_shrinkers; i++) {
+            Shrinker& shrinker = *shrinkers[i];
+            size_t count = shrinker.Count();
+            size_t to_scan = std::max(count >> priority, std::min(count, RECLAIM_BATCH));
+            freed += ShrinkOne(shrinker, to_scan, nr - freed);
+            if (freed >= nr) {
+                break;
+            }
+        }
+    }
+    return freed;
+}
+
+size_t DirectReclaim(size_t order) noexcept {
+    direct_reclaims.fetch_add(1, std::memory_order_relaxed);
+    return ReclaimPages(std::max<size_t>(1 << order, RECLAIM_BATCH));
+}
+
+bool MemoryPressure() noexcept {
+    return FreePagesCount() < WatermarkHigh();
+}
+
+void WakeReclaim() noexcept {
+    if (FreePagesCount() >= WatermarkLow()) {
+        return;
+    }
+    reclaim_wakeups.fetch_add(1, std::memory_order_relaxed);
+    reclaim_wq.WakeAll();
+}
+
+void ReclaimStart() noexcept {
+    auto err = kern::CreateKthread(ReclaimThread, nullptr);
+    if (!err.Ok()) {
+        panic("cannot create reclaim thread: %e", err.Err().Code());
+    }
+}
+
+void DumpReclaimStats() noexcept {
+    printk("[mm] reclaim: %lu pages scanned, %lu pages reclaimed, %lu direct reclaims, %lu wakeups\n",
+        pages_scanned.load(std::memory_order_relaxed), pages_reclaimed.load(std::memory_order_relaxed),
+        direct_reclaims.load(std::memory_order_relaxed), reclaim_wakeups.load(std::memory_order_relaxed));
+}
+
+}
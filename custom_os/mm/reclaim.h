@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+
+namespace mm {
+
+struct ShrinkResult {
+    size_t scanned = 0;
+    size_t freed_pages = 0;
+};
+
+// Shrinker frees memory of a cache under memory pressure.
+class Shrinker {
+public:
+    // Count returns number of objects which could be freed.
+    virtual size_t Count() noexcept = 0;
+
+    // Scan looks at up to nr objects and frees unused ones.
+    virtual ShrinkResult Scan(size_t nr) noexcept = 0;
+};
+
+// RegisterShrinker adds the shrinker to the reclaim. Shrinkers are registered at initialization and never removed.
+// Allocations could reclaim meanwhile, so registration is safe against running reclaim.
+void RegisterShrinker(Shrinker& shrinker) noexcept;
+
+// ReclaimPages asks shrinkers to free at least nr pages. Returns number of freed pages.
+size_t ReclaimPages(size_t nr) noexcept;
+
+// MemoryPressure returns true while free memory is below the high watermark, so caches shouldn't grow.
+bool MemoryPressure() noexcept;
+
+// WakeReclaim wakes the reclaim thread if free memory is below the low watermark. Called on allocation.
+void WakeReclaim() noexcept;
+
+// ReclaimStart starts the thread which keeps free memory between the low and high watermarks.
+void ReclaimStart() noexcept;
+
+// DumpReclaimStats prints reclaim counters.
+void DumpReclaimStats() noexcept;
+
+}
@@ -0,0 +1,170 @@
+#include <atomic>
+
+#include "fs/block_device.h"
+#include "kernel/panic.h"
+#include "kernel/printk.h"
+#include "kernel/sched.h"
+#include "kernel/wait.h"
+#include "lib/locking.h"
+#include "mm/reclaim.h"
+#include "mm/swap.h"
+#include "mm/vmalloc.h"
+
+namespace mm {
+
+namespace {
+
+// SwapArea keeps number of swap entries referencing every slot of the disk, zero means the slot is free.
+struct SwapArea {
+    SpinLock lock;
+    BlockDevice* dev = nullptr;
+    uint32_t* slot_refs = nullptr;
+    size_t slot_count = 0;
+    // Search continues after the last reserved run, so runs reserved one after another are adjacent on the disk.
+    size_t next = 0;
+};
+
+SwapArea swap_area;
+
+// Swap I/O completions wake all waiters, each of them checks its own requests.
+kern::WaitQueue swap_wq;
+
+// FindFreeRun returns the first slot of count free slots starting at or after the cursor, or slot_count if there is none.
+size_t FindFreeRun(size_t count) noexcept {
+    size_t run = 0;
+    for (size_t i = 0; i < swap_area.slot_count; i++) {
+        size_t slot = (swap_area.next + i) % swap_area.slot_count;
+        // Runs don't wrap around the end of the disk.
+        if (slot == 0) {
+            run = 0;
+        }
+        if (swap_area.slot_refs[slot] != 0) {
+            run = 0;
+            continue;
+        }
+        if (++run == count) {
+            return slot + 1 - count;
+        }
+    }
+    return swap_area.slot_count;
+}
+
+// AnonShrinker swaps out private anonymous pages of all tasks. Pages shared via copy-on-write are skipped: there is no
+// reverse mapping to find other address spaces referencing them.
+class AnonShrinker : public Shrinker {
+public:
+    size_t Count() noexcept override {
+        return Vmem::ResidentPages();
+    }
+
+    ShrinkResult Scan(size_t nr) noexcept override {
+        return Vmem::SwapOutAny(nr);
+    }
+};
+
+AnonShrinker anon_shrinker;
+
+}
+
+bool SwapEnabled() noexcept {
+    return swap_area.dev != nullptr;
+}
+
+size_t SwapAlloc(size_t count, size_t& first) noexcept {
+    IrqSafeScopeLocker locker(swap_area.lock);
+    for (; count > 0; count /= 2) {
+        size_t slot = FindFreeRun(count);
+        if (slot == swap_area.slot_count) {
+            continue;
+        }
+        for (size_t i = slot; i < slot + count; i++) {
+            swap_area.slot_refs[i] = 1;
+        }
+        swap_area.next = (slot + count) % swap_area.slot_count;
+        first = slot;
+        return count;
+    }
+    return 0;
+}
+
+void SwapDup(size_t slot) noexcept {
+    IrqSafeScopeLocker locker(swap_area.lock);
+    BUG_ON(slot >= swap_area.slot_count || swap_area.slot_refs[slot] == 0);
+    swap_area.slot_refs[slot]++;
+}
+
+void SwapFree(size_t slot) noexcept {
+    IrqSafeScopeLocker locker(swap_area.lock);
+    BUG_ON(slot >= swap_area.slot_count || swap_area.slot_refs[slot] == 0);
+    swap_area.slot_refs[slot]--;
+}
+
+kern::Errno SwapIo(Page* const* pages, const size_t* slots, size_t count, bool write) noexcept {
+    BlockDevice* dev = swap_area.dev;
+    std::atomic<size_t> pending = count;
+    std::atomic<bool> failed = false;
+
+    for (size_t i = 0; i < count; i++) {
+        auto end_io = [&pending, &failed](const BlockDevice::BaseRequest& req) {
+            if (req.flags.Has(BlockDevice::RequestFlag::Error)) {
+                failed.store(true, std::memory_order_relaxed);
+            }
+            // The waiter could return right after the decrement, so the wait queue isn't on its stack.
+            pending.fetch_sub(1, std::memory_order_release);
+            swap_wq.WakeAll();
+        };
+
+        BlockDevice::RequestPtr req(new BlockDevice::Request(std::move(end_io)));
+        if (!req) {
+            failed.store(true, std::memory_order_relaxed);
+            pending.fetch_sub(1, std::memory_order_relaxed);
+            continue;
+        }
+        // Adjacent slots make adjacent requests, which the disk serves without seeking.
+        req->sector = slots[i] * (PAGE_SIZE / dev->SectorSize());
+        req->buf.data = pages[i]->Virt();
+        req->buf.size = PAGE_SIZE;
+        if (write) {
+            req->flags = BlockDevice::RequestFlag::Write;
+        }
+
+        if (!dev->Submit(std::move(req)).Ok()) {
+            failed.store(true, std::memory_order_relaxed);
+            pending.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    swap_wq.WaitCond([&]() {
+        return pending.load(std::memory_order_acquire) == 0;
+    });
+    return failed.load(std::memory_order_relaxed) ? kern::EIO : kern::ENOERR;
+}
+
+void SwapStart() noexcept {
+    BlockDevice* dev = BlockDevice::ByName("ata1");
+    if (!dev) {
+        printk("[mm] no swap disk found\n");
+        return;
+    }
+
+    size_t slot_count = dev->SectorCount() / (PAGE_SIZE / dev->SectorSize());
+    if (slot_count == 0) {
+        printk("[mm] swap disk is too small\n");
+        return;
+    }
+    uint32_t* slot_refs = static_cast<uint32_t*>(Kvmalloc(slot_count * sizeof(uint32_t)));
+    if (!slot_refs) {
+        printk("[mm] cannot allocate swap map of %lu slots\n", slot_count);
+        return;
+    }
+    memset(slot_refs, 0, slot_count * sizeof(uint32_t));
+
+    swap_area.slot_refs = slot_refs;
+    swap_area.slot_count = slot_count;
+    swap_area.dev = dev;
+    RegisterShrinker(anon_shrinker);
+
+    printk("[mm] swap on ata1: %lu pages\n", slot_count);
+}
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+
+#include "kernel/error.h"
+#include "mm/page_alloc.h"
+#include "mm/paging.h"
+
+namespace mm {
+
+// Pages are swapped out and read back in clusters of up to SWAP_CLUSTER pages. Clusters are collected on the stack of
+// the faulting or reclaiming task, which is small.
+constexpr size_t SWAP_CLUSTER = 16;
+
+inline bool IsSwapPte(Pte pte) noexcept {
+    return !(pte & PTE_PRESENT) && (pte & PTE_SWAP);
+}
+
+inline size_t SwapPteSlot(Pte pte) noexcept {
+    return (pte & PTE_ADDR_MASK) >> P1E_ADDR_BITS;
+}
+
+// SwapPte returns a not present entry referencing the slot.
+inline Pte SwapPte(size_t slot) noexcept {
+    return ((uint64_t)slot << P1E_ADDR_BITS) | PTE_SWAP;
+}
+
+// SwapEnabled returns true if there is a swap area.
+bool SwapEnabled() noexcept;
+
+// SwapAlloc reserves up to count adjacent free slots, fewer if the area is fragmented. Returns number of reserved slots,
+// the first one is stored into first.
+size_t SwapAlloc(size_t count, size_t& first) noexcept;
+
+// SwapDup adds a reference to the slot for a copy of its swap entry.
+void SwapDup(size_t slot) noexcept;
+
+// SwapFree drops a reference to the slot. The slot is released with the last one.
+void SwapFree(size_t slot) noexcept;
+
+// SwapIo writes pages to the slots or reads them back and waits for all requests.
+kern::Errno SwapIo(Page* const* pages, const size_t* slots, size_t count, bool write) noexcept;
+
+// SwapStart sets up the swap area on the second ATA disk, if there is one.
+void SwapStart() noexcept;
+
+}
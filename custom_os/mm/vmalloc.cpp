@@ -0,0 +1,235 @@
+#include <boost/intrusive/set.hpp>
+
+#include "kernel/irq.h"
+#include "kernel/panic.h"
+#include "lib/common.h"
+#include "lib/list.h"
+#include "lib/locking.h"
+#include "mm/kmalloc.h"
+#include "mm/new.h"
+#include "mm/obj_alloc.h"
+#include "mm/paging.h"
+#include "mm/vmalloc.h"
+#include "mm/vmem.h"
+
+namespace mm {
+
+extern mm::Pte* vmalloc_p3;
+mm::Pte* EnsureNextTable(mm::Pte* tbl, size_t idx, uint64_t raw_flags, mm::AllocFlags af_flags) noexcept;
+
+namespace {
+
+// VmallocArea is an allocated range of the vmalloc area. Every range is followed by an unmapped guard page.
+struct VmallocArea {
+    uintptr_t start = 0;
+    size_t page_count = 0;
+
+    boost::intrusive::set_member_hook<boost::intrusive::optimize_size<true>> areas_set_node;
+    ListNode deferred_list;
+};
+
+struct VmallocAreaKey {
+    using type = uintptr_t;
+
+    uintptr_t operator()(const VmallocArea& area) const noexcept {
+        return area.start;
+    }
+};
+
+TypedObjectAllocator<VmallocArea> vmalloc_area_alloc;
+
+// Protects the set of areas and page tables of the vmalloc area.
+SpinLock vmalloc_lock;
+
+// Ordered set of all allocated ranges, ordered by start address.
+boost::intrusive::set<
+    VmallocArea,
+    boost::intrusive::member_hook<VmallocArea, boost::intrusive::set_member_hook<boost::intrusive::optimize_size<true>>, &VmallocArea::areas_set_node>,
+    boost::intrusive::key_of_value<VmallocAreaKey>
+> areas_set;
+
+// Areas freed with IRQs disabled. They keep their ranges until TLBs are invalidated.
+ListHead<VmallocArea, &VmallocArea::deferred_list> deferred_areas;
+
+// LookupPte returns the last level entry of given vmalloc address. Must be called with vmalloc_lock held.
+mm::Pte* LookupPte(uintptr_t addr, bool alloc, AllocFlags flags) noexcept {
+    mm::Pte* tbl = vmalloc_p3;
+    for (size_t idx : {P3E_FROM_ADDR(addr), P2E_FROM_ADDR(addr)}) {
+        if (alloc) {
+            tbl = EnsureNextTable(tbl, idx, PTE_WRITE, flags);
+        } else if (tbl[idx] & PTE_PRESENT) {
+            tbl = static_cast<mm::Pte*>(PHYS_TO_VIRT(PteAddr(tbl[idx])));
+        } else {
+            tbl = nullptr;
+        }
+        if (!tbl) {
+            return nullptr;
+        }
+    }
+    return &tbl[P1E_FROM_ADDR(addr)];
+}
+
+// ReserveRange finds the first gap which fits the area and its guard page. Must be called with vmalloc_lock held.
+bool ReserveRange(VmallocArea& area) noexcept {
+    size_t size = (area.page_count + 1) * PAGE_SIZE;
+    uintptr_t start = KERNEL_VMALLOC_START;
+    for (const VmallocArea& other : areas_set) {
+        if (other.start - start >= size) {
+            break;
+        }
+        start = other.start + (other.page_count + 1) * PAGE_SIZE;
+    }
+    if (KERNEL_VMALLOC_START + KERNEL_VMALLOC_SIZE - start < size) {
+        return false;
+    }
+
+    area.start = start;
+    areas_set.insert(area);
+    return true;
+}
+
+// FreeArea unmaps the area, frees its pages and releases the range.
+void FreeArea(VmallocArea* area) noexcept {
+    if (!kern::IsIrqEnabled()) {
+        // TLB shootdown waits for other CPUs with IRQs enabled: finish on the next call.
+        WithIrqSafeLocked(vmalloc_lock, [&]() {
+            deferred_areas.InsertLast(*area);
+        });
+        return;
+    }
+
+    uintptr_t addrs[TlbBatch::MAX_PAGES];
+    ListHead<Page, &Page::pa_free_list> pages;
+    WithIrqSafeLocked(vmalloc_lock, [&]() {
+        for (size_t i = 0; i < area->page_count; i++) {
+            uintptr_t addr = area->start + i * PAGE_SIZE;
+            if (i < TlbBatch::MAX_PAGES) {
+                addrs[i] = addr;
+            }
+            mm::Pte* pte = LookupPte(addr, false, {});
+            if (!pte || !(*pte & PTE_PRESENT)) {
+                continue;
+            }
+            Page* page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(*pte)));
+            BUG_ON_NULL(page);
+            PteSet(pte, 0, 0);
+            pages.InsertLast(*page);
+        }
+    });
+
+    if (area->page_count <= TlbBatch::MAX_PAGES) {
+        ShootdownKernelTlb(addrs, area->page_count);
+    } else {
+        ShootdownKernelTlb(nullptr, 0);
+    }
+
+    while (!pages.Empty()) {
+        Page& page = pages.First();
+        page.pa_free_list.Remove();
+        FreePage(&page);
+    }
+
+    WithIrqSafeLocked(vmalloc_lock, [&]() {
+        areas_set.erase(areas_set.iterator_to(*area));
+    });
+    delete area;
+}
+
+void FreeDeferredAreas() noexcept {
+    if (!kern::IsIrqEnabled()) {
+        return;
+    }
+    for (;;) {
+        VmallocArea* area = WithIrqSafeLocked(vmalloc_lock, [&]() -> VmallocArea* {
+            if (deferred_areas.Empty()) {
+                return nullptr;
+            }
+            VmallocArea* first = &deferred_areas.First();
+            first->deferred_list.Remove();
+            return first;
+        });
+        if (!area) {
+            break;
+        }
+        FreeArea(area);
+    }
+}
+
+}
+
+bool IsVmallocAddr(const void* addr) noexcept {
+    uintptr_t a = (uintptr_t)addr;
+    return KERNEL_VMALLOC_START <= a && a - KERNEL_VMALLOC_START < KERNEL_VMALLOC_SIZE;
+}
+
+void* Vmalloc(size_t size, AllocFlags flags) noexcept {
+    size_t page_count = DIV_ROUNDUP(size, PAGE_SIZE);
+    if (page_count == 0 || page_count >= KERNEL_VMALLOC_SIZE / PAGE_SIZE) {
+        return nullptr;
+    }
+
+    FreeDeferredAreas();
+
+    VmallocArea* area = new (vmalloc_area_alloc, flags) VmallocArea();
+    if (!area) {
+        return nullptr;
+    }
+    area->page_count = page_count;
+    if (!WithIrqSafeLocked(vmalloc_lock, [&]() { return ReserveRange(*area); })) {
+        delete area;
+        return nullptr;
+    }
+
+    for (size_t i = 0; i < page_count; i++) {
+        Page* page = AllocPage(0, flags);
+        bool mapped = page && WithIrqSafeLocked(vmalloc_lock, [&]() {
+            mm::Pte* pte = LookupPte(area->start + i * PAGE_SIZE, true, flags);
+            if (!pte) {
+                return false;
+            }
+            PteSet(pte, 0, (uint64_t)VIRT_TO_PHYS(page->Virt()) | PTE_PRESENT | PTE_WRITE | PTE_NX);
+            return true;
+        });
+        if (!mapped) {
+            if (page) {
+                FreePage(page);
+            }
+            FreeArea(area);
+            return nullptr;
+        }
+    }
+
+    return (void*)area->start;
+}
+
+void Vfree(void* addr) noexcept {
+    if (!addr) {
+        return;
+    }
+
+    FreeDeferredAreas();
+
+    VmallocArea* area = WithIrqSafeLocked(vmalloc_lock, [&]() -> VmallocArea* {
+        auto it = areas_set.find((uintptr_t)addr);
+        return it != areas_set.end() ? &*it : nullptr;
+    });
+    BUG_ON_NULL(area);
+    FreeArea(area);
+}
+
+void* Kvmalloc(size_t size, AllocFlags flags) noexcept {
+    if (size <= PAGE_SIZE) {
+        return Kmalloc(size, flags);
+    }
+    return Vmalloc(size, flags);
+}
+
+void Kvfree(void* addr) noexcept {
+    if (IsVmallocAddr(addr)) {
+        Vfree(addr);
+    } else if (addr) {
+        Kfree(addr);
+    }
+}
+
+}
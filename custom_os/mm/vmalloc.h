@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+
+#include "mm/page_alloc.h"
+
+namespace mm {
+
+// Vmalloc allocates virtually contiguous memory backed by separate pages, so large buffers don't need high-order blocks.
+// Memory is mapped into all address spaces and isn't physically contiguous: it can't be used for DMA.
+void* Vmalloc(size_t size, AllocFlags flags = {}) noexcept;
+
+// Vfree frees memory allocated by Vmalloc.
+void Vfree(void* addr) noexcept;
+
+// IsVmallocAddr returns true if the address belongs to the vmalloc area.
+bool IsVmallocAddr(const void* addr) noexcept;
+
+// Kvmalloc allocates small objects from slabs and large ones with Vmalloc.
+void* Kvmalloc(size_t size, AllocFlags flags = {}) noexcept;
+
+// Kvfree frees memory allocated by Kvmalloc or Kmalloc.
+void Kvfree(void* addr) noexcept;
+
+}
@@ -1,13 +1,25 @@
+#include "arch/ptr.h"
+#include "fs/page_cache.h"
+#include "kernel/sched.h"
+#include "kernel/signal.h"
+#include "lib/locking.h"
+#include "mm/new.h"
+#include "mm/swap.h"
 #include "mm/vmem.h"
 
 namespace mm {
 
 uint64_t GetPteFlags(AreaFlags flags) noexcept;
 extern TypedObjectAllocator<Area> vmem_area_alloc;
+extern Page* zero_page;
 mm::Pte* EnsureNextTable(mm::Pte* tbl, size_t idx, uint64_t raw_flags, mm::AllocFlags af_flags = {}) noexcept;
 
 namespace {
 
+// Large anonymous areas are backed by 2 MiB pages where possible.
+constexpr size_t HUGE_PAGE_SIZE = 2 * MB;
+constexpr size_t HUGE_PAGE_ORDER = 9;
+
 kern::Errno ClonePageTables(mm::Pte* dst_p4, mm::Pte* src_p4) noexcept {
     for (size_t p4e = 0; p4e < P4E_FROM_ADDR(USERSPACE_ADDRESS_MAX); p4e++) {
         if (!(src_p4[p4e] & PTE_PRESENT)) {
@@ -38,7 +50,19 @@ kern::Errno ClonePageTables(mm::Pte* dst_p4, mm::Pte* src_p4) noexcept {
                 if (!(src_p2[p2e] & PTE_PRESENT)) {
                     continue;
                 }
-                BUG_ON(src_p2[p2e] & PTE_PAGE_SIZE);
+                if (src_p2[p2e] & PTE_PAGE_SIZE) {
+                    // Huge anonymous page is shared copy-on-write as a whole.
+                    Page* page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(src_p2[p2e])));
+                    BUG_ON_NULL(page);
+                    mm::Pte pte = src_p2[p2e];
+                    if (pte & PTE_WRITE) {
+                        pte = (pte & ~PTE_WRITE) | PTE_COW;
+                        PteSet(src_p2, p2e, pte);
+                    }
+                    page->Ref();
+                    PteSet(dst_p2, p2e, pte);
+                    continue;
+                }
 
                 mm::Pte* src_p1 = static_cast<mm::Pte*>(PHYS_TO_VIRT(PteAddr(src_p2[p2e])));
                 mm::Pte* dst_p1 = EnsureNextTable(dst_p2, p2e, src_p2[p2e] & PTE_FLAGS_MASK);
@@ -47,22 +71,28 @@ kern::Errno ClonePageTables(mm::Pte* dst_p4, mm::Pte* src_p4) noexcept {
                 }
 
                 for (size_t p1e = 0; p1e < PTE_COUNT; p1e++) {
+                    if (IsSwapPte(src_p1[p1e])) {
+                        // Each address space reads its own copy of the page back.
+                        SwapDup(SwapPteSlot(src_p1[p1e]));
+                        PteSet(dst_p1, p1e, src_p1[p1e]);
+                        continue;
+                    }
                     if (!(src_p1[p1e] & PTE_PRESENT)) {
                         continue;
                     }
 
-                    void* old_page_virt = PHYS_TO_VIRT(PteAddr(src_p1[p1e]));
-                    BUG_ON_NULL(old_page_virt);
+                    Page* page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(src_p1[p1e])));
+                    BUG_ON_NULL(page);
 
-                    Page* new_page = AllocPage(0);
-                    if (!new_page) {
-                        return kern::ENOMEM;
+                    // Share the page with the child. Writable pages are write protected in both address spaces and copied on first write.
+                    mm::Pte pte = src_p1[p1e];
+                    // Page cache pages are mapped writable only by shared mappings, they stay shared.
+                    if ((pte & PTE_WRITE) && !page->HasFlag(Page::InFileCache)) {
+                        pte = (pte & ~PTE_WRITE) | PTE_COW;
+                        PteSet(src_p1, p1e, pte);
                     }
-                    memcpy(new_page->Virt(), old_page_virt, PAGE_SIZE);
-
-                    mm::Pte new_pte = (uintptr_t)VIRT_TO_PHYS(new_page->Virt());
-                    new_pte |= src_p1[p1e] & PTE_FLAGS_MASK;
-                    PteSet(dst_p1, p1e, new_pte);
+                    page->Ref();
+                    PteSet(dst_p1, p1e, pte);
                 }
             }
         }
@@ -71,6 +101,118 @@ kern::Errno ClonePageTables(mm::Pte* dst_p4, mm::Pte* src_p4) noexcept {
     return kern::ENOERR;
 }
 
+// LookupP2e returns pointer to the page directory entry of given address or nullptr if there is no page directory for it.
+mm::Pte* LookupP2e(mm::Pte* p4, uintptr_t virt_addr) noexcept {
+    mm::Pte* tbl = p4;
+    for (size_t idx : {P4E_FROM_ADDR(virt_addr), P3E_FROM_ADDR(virt_addr)}) {
+        if (!(tbl[idx] & PTE_PRESENT) || (tbl[idx] & PTE_PAGE_SIZE)) {
+            return nullptr;
+        }
+        tbl = static_cast<mm::Pte*>(PHYS_TO_VIRT(PteAddr(tbl[idx])));
+    }
+    return &tbl[P2E_FROM_ADDR(virt_addr)];
+}
+
+// LookupHugePte returns pointer to the entry of 2 MiB page mapping given address or nullptr if the address isn't mapped by a huge page.
+mm::Pte* LookupHugePte(mm::Pte* p4, uintptr_t virt_addr) noexcept {
+    mm::Pte* p2e = LookupP2e(p4, virt_addr);
+    if (!p2e || !(*p2e & PTE_PRESENT) || !(*p2e & PTE_PAGE_SIZE)) {
+        return nullptr;
+    }
+    return p2e;
+}
+
+// LookupPte returns pointer to the last level page table entry of given address or nullptr if there is no page table for it.
+mm::Pte* LookupPte(mm::Pte* p4, uintptr_t virt_addr) noexcept {
+    mm::Pte* p2e = LookupP2e(p4, virt_addr);
+    if (!p2e || !(*p2e & PTE_PRESENT) || (*p2e & PTE_PAGE_SIZE)) {
+        return nullptr;
+    }
+    mm::Pte* p1 = static_cast<mm::Pte*>(PHYS_TO_VIRT(PteAddr(*p2e)));
+    return &p1[P1E_FROM_ADDR(virt_addr)];
+}
+
+// AllocHugePage allocates a physically aligned block for a 2 MiB page.
+// Faults fall back to 4 KiB pages instead of waiting for compaction.
+Page* AllocHugePage() noexcept {
+    Page* page = AllocPage(HUGE_PAGE_ORDER, AllocFlag::Movable | AllocFlag::NoCompact);
+    if (page && (uintptr_t)VIRT_TO_PHYS(page->Virt()) % HUGE_PAGE_SIZE != 0) {
+        FreePage(page);
+        return nullptr;
+    }
+    return page;
+}
+
+bool TableEmpty(const mm::Pte* tbl) noexcept {
+    for (size_t i = 0; i < PTE_COUNT; i++) {
+        if (tbl[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// UnmapTable clears entries of page table at given level (1 is the last one) in range [start, end) and frees emptied lower level tables.
+// Returns number of unmapped pages.
+size_t UnmapTable(mm::Pte* tbl, size_t level, uintptr_t start, uintptr_t end, TlbBatch& batch) noexcept {
+    const size_t shift = P1E_ADDR_BITS + 9 * (level - 1);
+    const uintptr_t entry_size = 1ull << shift;
+
+    size_t unmapped = 0;
+    for (uintptr_t addr = start; addr < end; ) {
+        uintptr_t next = std::min((addr & ~(entry_size - 1)) + entry_size, end);
+        mm::Pte& pte = tbl[(addr >> shift) & (PTE_COUNT - 1)];
+
+        if (level == 1 && IsSwapPte(pte)) {
+            SwapFree(SwapPteSlot(pte));
+            pte = 0;
+            addr = next;
+            continue;
+        }
+        if (!(pte & PTE_PRESENT) || (level > 2 && (pte & PTE_PAGE_SIZE))) {
+            addr = next;
+            continue;
+        }
+
+        if (level == 2 && (pte & PTE_PAGE_SIZE)) {
+            // Huge pages crossing bounds of the range are split by IsolateRange.
+            BUG_ON(next - addr != entry_size);
+            Page* page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(pte)));
+            BUG_ON_NULL(page);
+            pte = 0;
+            batch.AddPage(addr);
+            if (page->Unref()) {
+                batch.DeferFree(page);
+            }
+            unmapped += PTE_COUNT;
+        } else if (level == 1) {
+            Page* page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(pte)));
+            BUG_ON_NULL(page);
+            if ((pte & PTE_DIRTY) && page->HasFlag(Page::InFileCache)) {
+                // Page was written through a shared mapping.
+                PageCache::MarkDirty(*page);
+            }
+            pte = 0;
+            batch.AddPage(addr);
+            if (page->Unref()) {
+                batch.DeferFree(page);
+            }
+            unmapped++;
+        } else {
+            mm::Pte* next_tbl = static_cast<mm::Pte*>(PHYS_TO_VIRT(PteAddr(pte)));
+            unmapped += UnmapTable(next_tbl, level - 1, addr, next, batch);
+            if (TableEmpty(next_tbl)) {
+                pte = 0;
+                // Paging structure caches could still reference the table.
+                batch.AddPage(addr);
+                batch.DeferFree(Page::FromAddr(next_tbl));
+            }
+        }
+        addr = next;
+    }
+    return unmapped;
+}
+
 }
 
 void DestroyPageTables(mm::Pte* p4) noexcept {
@@ -93,17 +235,30 @@ void DestroyPageTables(mm::Pte* p4) noexcept {
                     continue;
                 }
                 if (p2[p2e] & PTE_PAGE_SIZE) {
+                    Page* page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(p2[p2e])));
+                    BUG_ON_NULL(page);
+                    if (page->Unref()) {
+                        FreePage(page);
+                    }
                     continue;
                 }
 
                 mm::Pte* p1 = static_cast<mm::Pte*>(PHYS_TO_VIRT(PteAddr(p2[p2e])));
                 for (size_t p1e = 0; p1e < PTE_COUNT; p1e++) {
+                    if (IsSwapPte(p1[p1e])) {
+                        SwapFree(SwapPteSlot(p1[p1e]));
+                        continue;
+                    }
                     if (!(p1[p1e] & PTE_PRESENT)) {
                         continue;
                     }
 
                     Page* page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(p1[p1e])));
                     BUG_ON_NULL(page);
+                    if ((p1[p1e] & PTE_DIRTY) && page->HasFlag(Page::InFileCache)) {
+                        // Page was written through a shared mapping.
+                        PageCache::MarkDirty(*page);
+                    }
                     if (page->Unref()) {
                         FreePage(page);
                     }
@@ -123,20 +278,203 @@ kern::Result<std::unique_ptr<Vmem>> Vmem::Clone() noexcept {
         return dst.Err();
     }
 
+    // The copy is visible to reclaim as soon as it's created.
+    RawScopeLocker locker(mutex_);
+    RawScopeLocker dst_locker(dst->mutex_);
+
+    for (const Area& area : areas_set_) {
+        Area* new_area = new (vmem_area_alloc) Area(area);
+        if (!new_area) {
+            return kern::ENOMEM;
+        }
+        dst->areas_set_.insert(*new_area);
+    }
+
     auto err = ClonePageTables(dst->p4_, p4_);
+    // Pages could be write protected even if cloning has failed.
+    ShootdownTlb(nullptr, 0);
     if (!err.Ok()) {
         return err;
     }
+    dst->faults_.resident = faults_.resident;
 
     return dst;
 }
 
+void Vmem::MigratePages(const Page* block, size_t count, ListHead<Page, &Page::pa_free_list>& migrated) noexcept {
+    // The allocation compacting the block could come from a page fault of this address space.
+    if (!mutex_.RawTryLock()) {
+        return;
+    }
+    MigratePagesLocked(block, count, migrated);
+    mutex_.RawUnlock();
+}
+
+void Vmem::MigratePagesLocked(const Page* block, size_t count, ListHead<Page, &Page::pa_free_list>& migrated) noexcept {
+    TlbBatch batch(*this);
+    for (size_t p4e = 0; p4e < P4E_FROM_ADDR(USERSPACE_ADDRESS_MAX); p4e++) {
+        if (!(p4_[p4e] & PTE_PRESENT)) {
+            continue;
+        }
+        mm::Pte* p3 = static_cast<mm::Pte*>(PHYS_TO_VIRT(PteAddr(p4_[p4e])));
+        for (size_t p3e = 0; p3e < PTE_COUNT; p3e++) {
+            if (!(p3[p3e] & PTE_PRESENT) || (p3[p3e] & PTE_PAGE_SIZE)) {
+                continue;
+            }
+            mm::Pte* p2 = static_cast<mm::Pte*>(PHYS_TO_VIRT(PteAddr(p3[p3e])));
+            for (size_t p2e = 0; p2e < PTE_COUNT; p2e++) {
+                // Huge pages aren't migrated, they are allocated as movable only to keep unmovable pages together.
+                if (!(p2[p2e] & PTE_PRESENT) || (p2[p2e] & PTE_PAGE_SIZE)) {
+                    continue;
+                }
+                mm::Pte* p1 = static_cast<mm::Pte*>(PHYS_TO_VIRT(PteAddr(p2[p2e])));
+                for (size_t p1e = 0; p1e < PTE_COUNT; p1e++) {
+                    if (!(p1[p1e] & PTE_PRESENT)) {
+                        continue;
+                    }
+                    Page* page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(p1[p1e])));
+                    if (page < block || page >= block + count) {
+                        continue;
+                    }
+                    // Shared pages are referenced by other address spaces, which can't be found without a reverse mapping.
+                    if (!page->HasFlag(Page::Movable) || page->HasFlag(Page::InFileCache) || page->ref_count.RefCount() != 1) {
+                        continue;
+                    }
+
+                    Page* new_page = AllocPage(0, AllocFlag::Movable);
+                    if (!new_page) {
+                        return;
+                    }
+                    if (!(p1[p1e] & PTE_PRESENT) || PteAddr(p1[p1e]) != VIRT_TO_PHYS(page->Virt())) {
+                        // The allocation has swapped the page out.
+                        FreePage(new_page);
+                        continue;
+                    }
+                    // Only the current task runs on top of its address space, nobody writes the page during the copy.
+                    memcpy(new_page->Virt(), page->Virt(), PAGE_SIZE);
+                    new_page->Ref();
+                    PteSet(p1, p1e, (uint64_t)VIRT_TO_PHYS(new_page->Virt()) | PteFlags(p1[p1e]));
+                    batch.AddPage(PTE_ADDR_FROM(p4e, p3e, p2e, p1e));
+
+                    page->Unref();
+                    migrated.InsertLast(*page);
+                }
+            }
+        }
+    }
+}
+
+ShrinkResult Vmem::SwapOut(size_t nr) noexcept {
+    ShrinkResult res;
+    Page* pages[SWAP_CLUSTER];
+    uintptr_t addrs[SWAP_CLUSTER];
+    mm::Pte old_ptes[SWAP_CLUSTER];
+    size_t count = 0;
+
+    TlbBatch batch(*this);
+    uintptr_t addr = swap_cursor_;
+    bool wrapped = false;
+    while (res.scanned < nr && count < SWAP_CLUSTER) {
+        auto it = areas_set_.upper_bound(addr);
+        if (it == areas_set_.end()) {
+            if (wrapped) {
+                break;
+            }
+            wrapped = true;
+            addr = 0;
+            continue;
+        }
+        Area& area = *it;
+        addr = std::max(addr, area.start);
+        // Pages of shared mappings are either in the page cache or shared with children.
+        if (area.flags.Has(AreaFlag::Shared)) {
+            addr = area.end;
+            continue;
+        }
+
+        for (; addr < area.end && res.scanned < nr && count < SWAP_CLUSTER; addr += PAGE_SIZE) {
+            res.scanned++;
+            mm::Pte* pte = LookupPte(p4_, addr);
+            if (!pte) {
+                // Huge pages aren't swapped out, the range without a page table is skipped at once.
+                addr = ALIGN_DOWN(addr, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE - PAGE_SIZE;
+                continue;
+            }
+            if (!(*pte & PTE_PRESENT)) {
+                continue;
+            }
+            // Shared pages are referenced by other address spaces, which can't be found without a reverse mapping. A
+            // copy-on-write page left with a single reference is private: other address spaces can't map it again while
+            // the mutex is held, and the copy read back from swap is writable.
+            Page* page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(*pte)));
+            if (!page || page == zero_page || page->HasFlag(Page::InFileCache) || page->ref_count.RefCount() != 1) {
+                continue;
+            }
+            if (*pte & PTE_ACCESSED) {
+                // The page was used since the previous pass, give it another one.
+                PteSet(pte, 0, *pte & ~PTE_ACCESSED);
+                batch.AddPage(addr);
+                continue;
+            }
+            pages[count] = page;
+            addrs[count] = addr;
+            count++;
+        }
+    }
+    swap_cursor_ = addr;
+
+    size_t slots[SWAP_CLUSTER];
+    size_t reserved = 0;
+    while (reserved < count) {
+        size_t first = 0;
+        size_t got = SwapAlloc(count - reserved, first);
+        if (got == 0) {
+            break;
+        }
+        for (size_t i = 0; i < got; i++) {
+            slots[reserved + i] = first + i;
+        }
+        reserved += got;
+    }
+
+    for (size_t i = 0; i < reserved; i++) {
+        mm::Pte* pte = LookupPte(p4_, addrs[i]);
+        old_ptes[i] = *pte;
+        PteSet(pte, 0, SwapPte(slots[i]));
+        batch.AddPage(addrs[i]);
+    }
+    // Pages are written after the invalidation, so no write through a stale TLB entry is lost.
+    batch.Flush();
+
+    if (reserved > 0 && !SwapIo(pages, slots, reserved, true).Ok()) {
+        for (size_t i = 0; i < reserved; i++) {
+            PteSet(LookupPte(p4_, addrs[i]), 0, old_ptes[i]);
+            SwapFree(slots[i]);
+        }
+        reserved = 0;
+    }
+    for (size_t i = 0; i < reserved; i++) {
+        if (pages[i]->Unref()) {
+            FreePage(pages[i]);
+        }
+    }
+    faults_.swapout += reserved;
+    faults_.resident -= reserved;
+    res.freed_pages = reserved;
+    return res;
+}
+
 kern::Result<void*> Vmem::MapPages(uintptr_t virt_addr, size_t page_count, AreaFlags flags, vfs::FilePtr file, size_t offset) noexcept {
-    if (virt_addr >= USERSPACE_ADDRESS_MAX) {
+    if (virt_addr >= USERSPACE_ADDRESS_MAX || virt_addr % PAGE_SIZE != 0) {
+        return kern::EINVAL;
+    }
+
+    if (page_count == 0 || page_count > (USERSPACE_ADDRESS_MAX - virt_addr) / PAGE_SIZE) {
         return kern::EINVAL;
     }
 
-    if (flags.Has(AreaFlag::Shared)) {
+    // Only file mappings could be shared: sharing anonymous memory with children isn't supported.
+    if (flags.Has(AreaFlag::Shared) && !file) {
         return kern::EINVAL;
     }
 
@@ -148,33 +486,608 @@ kern::Result<void*> Vmem::MapPages(uintptr_t virt_addr, size_t page_count, AreaF
         return kern::EINVAL;
     }
 
-    size_t file_start_page = offset / PAGE_SIZE;
-    for (size_t i = 0; i < page_count; i++) {
-        Page* page = mm::AllocPage(0);
-        if (!page) {
-            return kern::ENOMEM;
+    Area* area = new (vmem_area_alloc) Area();
+    if (!area) {
+        return kern::ENOMEM;
+    }
+    area->start = virt_addr;
+    area->end = virt_addr + page_count * PAGE_SIZE;
+    area->page_count = page_count;
+    area->flags = flags;
+    area->file = std::move(file);
+    area->offset = offset;
+
+    RawScopeLocker locker(mutex_);
+
+    // A fixed mapping replaces everything in its range.
+    auto it = areas_set_.upper_bound(area->start);
+    if (it != areas_set_.end() && it->Intersects(*area)) {
+        if (auto err = UnmapLocked(area->start, area->end); !err.Ok()) {
+            delete area;
+            return err;
         }
-        uint64_t pte_flags = GetPteFlags(flags) | PTE_USER;
-        auto pte = Map4KbPage(virt_addr + i * PAGE_SIZE, (uintptr_t)VIRT_TO_PHYS(page->Virt()), pte_flags);
-        if (!pte.Ok()) {
-            return pte.Err();
+    }
+    areas_set_.insert(*area);
+    MergeArea(*area);
+
+    // Pages are populated on first access by HandlePageFault.
+    return (void*)virt_addr;
+}
+
+Area* Vmem::SplitArea(Area& area, uintptr_t addr) noexcept {
+    BUG_ON(addr <= area.start || addr >= area.end || addr % PAGE_SIZE != 0);
+
+    Area* upper = new (vmem_area_alloc) Area(area);
+    if (!upper) {
+        return nullptr;
+    }
+    upper->start = addr;
+    upper->page_count = (upper->end - addr) / PAGE_SIZE;
+    if (upper->file) {
+        upper->offset += addr - area.start;
+    }
+
+    // Lower part keeps its position in the set: areas don't overlap, so shrinking the end keeps the order.
+    area.end = addr;
+    area.page_count = (addr - area.start) / PAGE_SIZE;
+    areas_set_.insert(*upper);
+    return upper;
+}
+
+kern::Errno Vmem::SplitHugePage(uintptr_t addr) noexcept {
+    mm::Pte* p2e = LookupHugePte(p4_, addr);
+    if (!p2e) {
+        return kern::ENOERR;
+    }
+
+    Page* tbl_page = AllocPage(0);
+    if (!tbl_page) {
+        return kern::ENOMEM;
+    }
+    mm::Pte* p1 = static_cast<mm::Pte*>(tbl_page->Virt());
+
+    Page* huge_page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(*p2e)));
+    BUG_ON_NULL(huge_page);
+    uint64_t raw_flags = PteFlags(*p2e) & ~PTE_PAGE_SIZE;
+
+    TlbBatch batch(*this);
+    if (huge_page->ref_count.RefCount() == 1) {
+        // Nobody else maps the page: split the block itself, so every 4 KiB page is referenced and freed on its own.
+        SplitPage(huge_page);
+        for (size_t i = 0; i < PTE_COUNT; i++) {
+            if (i > 0) {
+                huge_page[i].Ref();
+            }
+            PteSet(p1, i, (uint64_t)VIRT_TO_PHYS(huge_page[i].Virt()) | raw_flags);
+        }
+    } else {
+        // The page is shared copy-on-write with other address spaces, make private copies.
+        if (raw_flags & PTE_COW) {
+            raw_flags = (raw_flags & ~PTE_COW) | PTE_WRITE;
+        }
+        for (size_t i = 0; i < PTE_COUNT; i++) {
+            Page* page = AllocPage(0, AllocFlag::Movable);
+            if (!page) {
+                for (size_t j = 0; j < i; j++) {
+                    Page* copy = Page::FromAddr(PHYS_TO_VIRT(PteAddr(p1[j])));
+                    copy->Unref();
+                    FreePage(copy);
+                }
+                FreePage(tbl_page);
+                return kern::ENOMEM;
+            }
+            memcpy(page->Virt(), huge_page[i].Virt(), PAGE_SIZE);
+            page->Ref();
+            PteSet(p1, i, (uint64_t)VIRT_TO_PHYS(page->Virt()) | raw_flags);
+        }
+        if (huge_page->Unref()) {
+            batch.DeferFree(huge_page);
+        }
+        faults_.cow++;
+    }
+
+    PteSet(p2e, 0, (uint64_t)VIRT_TO_PHYS(p1) | PTE_PRESENT | PTE_WRITE | PTE_USER);
+    batch.AddPage(ALIGN_DOWN(addr, HUGE_PAGE_SIZE));
+    return kern::ENOERR;
+}
+
+kern::Errno Vmem::IsolateRange(uintptr_t start, uintptr_t end) noexcept {
+    for (uintptr_t bound : {start, end}) {
+        if (bound % HUGE_PAGE_SIZE != 0 && bound < USERSPACE_ADDRESS_MAX) {
+            if (auto err = SplitHugePage(bound); !err.Ok()) {
+                return err;
+            }
         }
 
-        if (file) {
-            auto file_page = file->LoadPage(file_start_page + i);
-            if (!file_page.Ok()) {
-                return file_page.Err();
+        Area* area = FindAreaByAddr(bound);
+        if (area && area->start != bound) {
+            if (!SplitArea(*area, bound)) {
+                return kern::ENOMEM;
             }
-            memcpy(page->Virt(), file_page->Virt(), PAGE_SIZE);
         }
     }
+    return kern::ENOERR;
+}
 
-    return (void*)virt_addr;
+Area& Vmem::MergeArea(Area& area) noexcept {
+    auto mergeable = [](const Area& lower, const Area& upper) {
+        if (lower.end != upper.start || lower.flags != upper.flags || lower.file.Get() != upper.file.Get()) {
+            return false;
+        }
+        return !lower.file || lower.offset + lower.page_count * PAGE_SIZE == upper.offset;
+    };
+
+    auto it = areas_set_.iterator_to(area);
+    if (auto next = std::next(it); next != areas_set_.end() && mergeable(area, *next)) {
+        // Upper area takes over the range: its key (end) stays valid.
+        Area& upper = *next;
+        upper.start = area.start;
+        upper.page_count += area.page_count;
+        upper.offset = area.offset;
+        areas_set_.erase(it);
+        delete &area;
+        it = areas_set_.iterator_to(upper);
+    }
+
+    if (it != areas_set_.begin()) {
+        auto prev = std::prev(it);
+        if (mergeable(*prev, *it)) {
+            Area& lower = *prev;
+            it->start = lower.start;
+            it->page_count += lower.page_count;
+            it->offset = lower.offset;
+            areas_set_.erase(prev);
+            delete &lower;
+        }
+    }
+    return *it;
+}
+
+void Vmem::UnmapRange(uintptr_t start, uintptr_t end, TlbBatch& batch) noexcept {
+    faults_.resident -= UnmapTable(p4_, 4, start, end, batch);
+}
+
+kern::Errno Vmem::Unmap(uintptr_t virt_addr, size_t page_count) noexcept {
+    if (virt_addr >= USERSPACE_ADDRESS_MAX || virt_addr % PAGE_SIZE != 0) {
+        return kern::EINVAL;
+    }
+    if (page_count == 0 || page_count > (USERSPACE_ADDRESS_MAX - virt_addr) / PAGE_SIZE) {
+        return kern::EINVAL;
+    }
+
+    RawScopeLocker locker(mutex_);
+    return UnmapLocked(virt_addr, virt_addr + page_count * PAGE_SIZE);
+}
+
+kern::Errno Vmem::UnmapLocked(uintptr_t start, uintptr_t end) noexcept {
+    if (auto err = IsolateRange(start, end); !err.Ok()) {
+        return err;
+    }
+
+    for (auto it = areas_set_.upper_bound(start); it != areas_set_.end() && it->start < end; ) {
+        Area* area = &*it;
+        it = areas_set_.erase(it);
+        delete area;
+    }
+
+    TlbBatch batch(*this);
+    UnmapRange(start, end, batch);
+    return kern::ENOERR;
+}
+
+kern::Errno Vmem::Protect(uintptr_t virt_addr, size_t page_count, AreaFlags flags) noexcept {
+    if (virt_addr >= USERSPACE_ADDRESS_MAX || virt_addr % PAGE_SIZE != 0) {
+        return kern::EINVAL;
+    }
+    if (page_count == 0 || page_count > (USERSPACE_ADDRESS_MAX - virt_addr) / PAGE_SIZE) {
+        return kern::EINVAL;
+    }
+    uintptr_t end = virt_addr + page_count * PAGE_SIZE;
+
+    RawScopeLocker locker(mutex_);
+
+    // Whole range must be mapped.
+    uintptr_t covered = virt_addr;
+    for (auto it = areas_set_.upper_bound(virt_addr); it != areas_set_.end() && it->start <= covered && covered < end; ++it) {
+        covered = it->end;
+    }
+    if (covered < end) {
+        return kern::ENOMEM;
+    }
+
+    if (flags.Has(AreaFlag::Write)) {
+        for (auto it = areas_set_.upper_bound(virt_addr); it != areas_set_.end() && it->start < end; ++it) {
+            if (it->flags.Has(AreaFlag::Shared) && !it->file->flags_.Has(vfs::FileFlag::Writeable)) {
+                return kern::EACCES;
+            }
+        }
+    }
+
+    if (auto err = IsolateRange(virt_addr, end); !err.Ok()) {
+        return err;
+    }
+
+    TlbBatch batch(*this);
+    for (auto it = areas_set_.upper_bound(virt_addr); it != areas_set_.end() && it->start < end; ++it) {
+        Area& area = *it;
+        bool had_write = area.flags.Has(AreaFlag::Write);
+        AreaFlags new_flags = flags;
+        for (AreaFlag kept : {AreaFlag::Fixed, AreaFlag::Shared}) {
+            if (area.flags.Has(kept)) {
+                new_flags |= kept;
+            }
+        }
+        area.flags = new_flags;
+
+        for (uintptr_t addr = area.start; addr < area.end; addr += PAGE_SIZE) {
+            mm::Pte* pte = LookupHugePte(p4_, addr);
+            if (pte) {
+                // Huge pages never cross area bounds, the whole page belongs to the area.
+                addr += HUGE_PAGE_SIZE - PAGE_SIZE;
+            } else {
+                pte = LookupPte(p4_, addr);
+            }
+            if (!pte || !(*pte & PTE_PRESENT)) {
+                continue;
+            }
+
+            mm::Pte new_pte = *pte | PTE_USER | PTE_NX;
+            if (!flags.Has(AreaFlag::Read) && !flags.Has(AreaFlag::Write) && !flags.Has(AreaFlag::Exec)) {
+                new_pte &= ~PTE_USER;
+            }
+            if (flags.Has(AreaFlag::Exec)) {
+                new_pte &= ~PTE_NX;
+            }
+            if (!flags.Has(AreaFlag::Write)) {
+                new_pte &= ~PTE_WRITE;
+            } else if (!had_write && !area.flags.Has(AreaFlag::Shared) && !(new_pte & PTE_WRITE)) {
+                // Private page could be shared with other address spaces or the page cache: the first write copies it.
+                new_pte |= PTE_COW;
+            }
+
+            if (new_pte != *pte) {
+                PteSet(pte, 0, new_pte);
+                batch.AddPage(addr);
+            }
+        }
+    }
+    batch.Flush();
+
+    for (uintptr_t addr = virt_addr; addr < end; ) {
+        Area* area = FindAreaByAddr(addr);
+        BUG_ON_NULL(area);
+        addr = MergeArea(*area).end;
+    }
+    return kern::ENOERR;
 }
 
 kern::Result<FaultStatus> Vmem::HandlePageFault(uintptr_t virt_addr, PageFaultFlags pf_flags) noexcept {
     TracePageFault(virt_addr, pf_flags);
-    return FaultStatus::AccessViolation;
+
+    RawScopeLocker locker(mutex_);
+    Area* area = FindAreaByAddr(virt_addr);
+    if (!area) {
+        return FaultStatus::InvalidAddress;
+    }
+
+    if (pf_flags.Has(PageFaultFlag::Write) && !area->flags.Has(AreaFlag::Write)) {
+        return FaultStatus::AccessViolation;
+    }
+    if (pf_flags.Has(PageFaultFlag::Exec) && !area->flags.Has(AreaFlag::Exec)) {
+        return FaultStatus::AccessViolation;
+    }
+    if (!area->flags.Has(AreaFlag::Read) && !area->flags.Has(AreaFlag::Write) && !area->flags.Has(AreaFlag::Exec)) {
+        return FaultStatus::AccessViolation;
+    }
+
+    if (!pf_flags.Has(PageFaultFlag::NoPage)) {
+        if (pf_flags.Has(PageFaultFlag::Write) && area->flags.Has(AreaFlag::Shared)) {
+            return HandleSharedWriteFault(virt_addr);
+        }
+        if (pf_flags.Has(PageFaultFlag::Write)) {
+            return HandleCowFault(virt_addr);
+        }
+        return FaultStatus::AccessViolation;
+    }
+
+    if (mm::Pte* pte = LookupPte(p4_, virt_addr); pte && IsSwapPte(*pte)) {
+        return HandleSwapFault(*area, virt_addr);
+    }
+    return HandleMissingPage(*area, virt_addr, pf_flags);
+}
+
+kern::Result<bool> Vmem::MapHugePage(Area& area, uintptr_t virt_addr) noexcept {
+    uintptr_t huge_addr = ALIGN_DOWN(virt_addr, HUGE_PAGE_SIZE);
+    if (huge_addr < area.start || area.end - huge_addr < HUGE_PAGE_SIZE) {
+        return false;
+    }
+
+    // Some pages of the range are already mapped with a page table.
+    mm::Pte* p2e = LookupP2e(p4_, huge_addr);
+    if (p2e && (*p2e & PTE_PRESENT)) {
+        return false;
+    }
+
+    Page* page = AllocHugePage();
+    if (!page) {
+        return false;
+    }
+    memset(page->Virt(), 0, HUGE_PAGE_SIZE);
+
+    page->Ref();
+    if (auto err = Map2MbPage(huge_addr, (uintptr_t)VIRT_TO_PHYS(page->Virt()), GetPteFlags(area.flags) | PTE_USER); !err.Ok()) {
+        page->Unref();
+        FreePage(page);
+        return err;
+    }
+    faults_.huge++;
+    faults_.resident += PTE_COUNT;
+    return true;
+}
+
+kern::Result<FaultStatus> Vmem::HandleMissingPage(Area& area, uintptr_t virt_addr, PageFaultFlags pf_flags) noexcept {
+    uintptr_t page_addr = PAGE_SIZE_ALIGN_DOWN(virt_addr);
+    uint64_t raw_flags = GetPteFlags(area.flags);
+
+    // First write to a large private anonymous area tries to populate the whole aligned 2 MiB range at once.
+    if (!area.file && !area.flags.Has(AreaFlag::Shared) && pf_flags.Has(PageFaultFlag::Write)) {
+        auto mapped = MapHugePage(area, virt_addr);
+        if (!mapped.Ok()) {
+            kern::SignalSend(sched::Current(), kern::Signal::SIGKILL);
+            return mapped.Err();
+        }
+        if (*mapped) {
+            return FaultStatus::Ok;
+        }
+    }
+
+    // Shared pages (zero page or page cache pages) are mapped as is, private writable mappings get a copy on first write.
+    Page* page = nullptr;
+    Page* file_page = nullptr;
+    bool shared = !pf_flags.Has(PageFaultFlag::Write) || area.flags.Has(AreaFlag::Shared);
+    if (area.file) {
+        auto loaded = area.file->LoadPage(area.offset / PAGE_SIZE + (page_addr - area.start) / PAGE_SIZE);
+        if (!loaded.Ok()) {
+            kern::SignalSend(sched::Current(), kern::Signal::SIGBUS);
+            return loaded.Err();
+        }
+        file_page = *loaded;
+        page = file_page;
+        faults_.file++;
+    } else if (shared) {
+        page = zero_page;
+        faults_.zero++;
+    } else {
+        faults_.anon++;
+    }
+
+    if (area.flags.Has(AreaFlag::Shared)) {
+        // Writes go directly to the page cache, but the first one must mark the page dirty.
+        if (pf_flags.Has(PageFaultFlag::Write)) {
+            PageCache::MarkDirty(*page);
+        } else {
+            raw_flags &= ~PTE_WRITE;
+        }
+    } else if (shared) {
+        if (raw_flags & PTE_WRITE) {
+            raw_flags = (raw_flags & ~PTE_WRITE) | PTE_COW;
+        }
+    } else {
+        Page* new_page = AllocPage(0, page ? AllocFlags(AllocFlag::Movable) : AllocFlag::Movable | AllocFlag::Zero);
+        if (!new_page) {
+            if (file_page) {
+                file_page->Unref();
+            }
+            kern::SignalSend(sched::Current(), kern::Signal::SIGKILL);
+            return kern::ENOMEM;
+        }
+        if (page) {
+            memcpy(new_page->Virt(), page->Virt(), PAGE_SIZE);
+        }
+        page = new_page;
+    }
+
+    auto prev_page = MapUserPage(page_addr, page, raw_flags);
+    if (file_page) {
+        // The mapping holds its own reference.
+        file_page->Unref();
+    }
+    if (!prev_page.Ok()) {
+        if (!shared) {
+            FreePage(page);
+        }
+        kern::SignalSend(sched::Current(), kern::Signal::SIGKILL);
+        return prev_page.Err();
+    }
+    BUG_ON(*prev_page);
+    faults_.resident++;
+
+    return FaultStatus::Ok;
+}
+
+kern::Result<FaultStatus> Vmem::HandleSwapFault(Area& area, uintptr_t virt_addr) noexcept {
+    uintptr_t page_addr = PAGE_SIZE_ALIGN_DOWN(virt_addr);
+    mm::Pte* p1 = LookupPte(p4_, page_addr) - P1E_FROM_ADDR(page_addr);
+    uintptr_t p1_addr = ALIGN_DOWN(page_addr, HUGE_PAGE_SIZE);
+
+    Page* pages[SWAP_CLUSTER];
+    size_t slots[SWAP_CLUSTER];
+    size_t idxs[SWAP_CLUSTER];
+
+    // Reclaim doesn't change swap entries, they stay valid across allocations.
+    pages[0] = AllocPage(0, AllocFlag::Movable);
+    if (!pages[0]) {
+        kern::SignalSend(sched::Current(), kern::Signal::SIGKILL);
+        return kern::ENOMEM;
+    }
+    idxs[0] = P1E_FROM_ADDR(page_addr);
+    slots[0] = SwapPteSlot(p1[idxs[0]]);
+    size_t count = 1;
+
+    // Neighbours swapped out in the same cluster are likely used together, so they are read ahead if memory is free.
+    for (size_t i = 0; i < PTE_COUNT && count < SWAP_CLUSTER; i++) {
+        if (i == idxs[0] || !IsSwapPte(p1[i]) || !area.Contains(p1_addr + i * PAGE_SIZE)) {
+            continue;
+        }
+        size_t slot = SwapPteSlot(p1[i]);
+        if (slot + SWAP_CLUSTER <= slots[0] || slots[0] + SWAP_CLUSTER <= slot) {
+            continue;
+        }
+        Page* page = AllocPage(0, AllocFlag::Movable | AllocFlag::NoSleep);
+        if (!page) {
+            break;
+        }
+        pages[count] = page;
+        slots[count] = slot;
+        idxs[count] = i;
+        count++;
+    }
+
+    if (auto err = SwapIo(pages, slots, count, false); !err.Ok()) {
+        for (size_t i = 0; i < count; i++) {
+            FreePage(pages[i]);
+        }
+        kern::SignalSend(sched::Current(), kern::Signal::SIGBUS);
+        return err;
+    }
+
+    // Swapped out pages were private, every address space gets its own copy back.
+    uint64_t raw_flags = GetPteFlags(area.flags) | PTE_PRESENT | PTE_USER;
+    for (size_t i = 0; i < count; i++) {
+        pages[i]->Ref();
+        PteSet(p1, idxs[i], (uint64_t)VIRT_TO_PHYS(pages[i]->Virt()) | raw_flags);
+        SwapFree(slots[i]);
+    }
+    faults_.swapin += count;
+    faults_.resident += count;
+
+    return FaultStatus::Ok;
+}
+
+kern::Result<FaultStatus> Vmem::HandleSharedWriteFault(uintptr_t virt_addr) noexcept {
+    uintptr_t page_addr = PAGE_SIZE_ALIGN_DOWN(virt_addr);
+    mm::Pte* pte = LookupPte(p4_, page_addr);
+    if (!pte || !(*pte & PTE_PRESENT)) {
+        return FaultStatus::AccessViolation;
+    }
+
+    Page* page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(*pte)));
+    BUG_ON_NULL(page);
+    PageCache::MarkDirty(*page);
+
+    PteSet(pte, 0, *pte | PTE_WRITE);
+    InvalidatePage(page_addr);
+
+    return FaultStatus::Ok;
+}
+
+kern::Errno Vmem::Msync(uintptr_t virt_addr, size_t page_count) noexcept {
+    if (virt_addr % PAGE_SIZE != 0 || page_count > (USERSPACE_ADDRESS_MAX - virt_addr) / PAGE_SIZE) {
+        return kern::EINVAL;
+    }
+
+    uintptr_t end = virt_addr + page_count * PAGE_SIZE;
+    RawScopeLocker locker(mutex_);
+    for (uintptr_t addr = virt_addr; addr < end; addr += PAGE_SIZE) {
+        Area* area = FindAreaByAddr(addr);
+        if (!area) {
+            return kern::ENOMEM;
+        }
+        if (!area->flags.Has(AreaFlag::Shared)) {
+            continue;
+        }
+
+        // Page stays writable after the first write fault, so catch later writes by the dirty bit.
+        mm::Pte* pte = LookupPte(p4_, addr);
+        if (!pte || !(*pte & PTE_PRESENT) || !(*pte & PTE_DIRTY)) {
+            continue;
+        }
+        PteSet(pte, 0, *pte & ~PTE_DIRTY);
+        InvalidatePage(addr);
+        PageCache::MarkDirty(*Page::FromAddr(PHYS_TO_VIRT(PteAddr(*pte))));
+    }
+
+    return kern::ENOERR;
+}
+
+kern::Result<FaultStatus> Vmem::HandleHugeCowFault(mm::Pte* p2e, uintptr_t virt_addr) noexcept {
+    uintptr_t huge_addr = ALIGN_DOWN(virt_addr, HUGE_PAGE_SIZE);
+    if (!(*p2e & PTE_COW)) {
+        return FaultStatus::AccessViolation;
+    }
+
+    Page* old_page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(*p2e)));
+    BUG_ON_NULL(old_page);
+    uint64_t raw_flags = (PteFlags(*p2e) & ~PTE_COW) | PTE_WRITE;
+
+    if (old_page->ref_count.RefCount() == 1) {
+        PteSet(p2e, 0, (uint64_t)PteAddr(*p2e) | raw_flags);
+        InvalidatePage(huge_addr);
+        return FaultStatus::Ok;
+    }
+
+    Page* new_page = AllocHugePage();
+    if (!new_page) {
+        // Fall back to private 4 KiB copies of the whole range.
+        if (auto err = SplitHugePage(huge_addr); !err.Ok()) {
+            kern::SignalSend(sched::Current(), kern::Signal::SIGKILL);
+            return err;
+        }
+        return FaultStatus::Ok;
+    }
+    memcpy(new_page->Virt(), old_page->Virt(), HUGE_PAGE_SIZE);
+    new_page->Ref();
+
+    PteSet(p2e, 0, (uint64_t)VIRT_TO_PHYS(new_page->Virt()) | raw_flags);
+    InvalidatePage(huge_addr);
+
+    if (old_page->Unref()) {
+        FreePage(old_page);
+    }
+    faults_.cow++;
+
+    return FaultStatus::Ok;
+}
+
+kern::Result<FaultStatus> Vmem::HandleCowFault(uintptr_t virt_addr) noexcept {
+    if (mm::Pte* p2e = LookupHugePte(p4_, virt_addr)) {
+        return HandleHugeCowFault(p2e, virt_addr);
+    }
+
+    uintptr_t page_addr = PAGE_SIZE_ALIGN_DOWN(virt_addr);
+    mm::Pte* pte = LookupPte(p4_, page_addr);
+    if (!pte || !(*pte & PTE_PRESENT) || !(*pte & PTE_COW)) {
+        return FaultStatus::AccessViolation;
+    }
+
+    Page* old_page = Page::FromAddr(PHYS_TO_VIRT(PteAddr(*pte)));
+    BUG_ON_NULL(old_page);
+    uint64_t raw_flags = (PteFlags(*pte) & ~PTE_COW) | PTE_WRITE;
+
+    if (old_page->ref_count.RefCount() == 1 && !old_page->HasFlag(Page::InFileCache)) {
+        // All other address spaces have already dropped the page, take it over without copying.
+        PteSet(pte, 0, (uint64_t)PteAddr(*pte) | raw_flags);
+        InvalidatePage(page_addr);
+        return FaultStatus::Ok;
+    }
+
+    Page* new_page = AllocPage(0, AllocFlag::Movable);
+    if (!new_page) {
+        kern::SignalSend(sched::Current(), kern::Signal::SIGKILL);
+        return kern::ENOMEM;
+    }
+    memcpy(new_page->Virt(), old_page->Virt(), PAGE_SIZE);
+    new_page->Ref();
+
+    PteSet(pte, 0, (uint64_t)VIRT_TO_PHYS(new_page->Virt()) | raw_flags);
+    InvalidatePage(page_addr);
+
+    if (old_page->Unref()) {
+        FreePage(old_page);
+    }
+    faults_.cow++;
+
+    return FaultStatus::Ok;
 }
 
 }
@@ -6,6 +6,9 @@
 #include "fs/vfs.h"
 #include "kernel/error.h"
 #include "lib/flags.h"
+#include "lib/list.h"
+#include "lib/mutex.h"
+#include "mm/reclaim.h"
 
 namespace mm {
 
@@ -60,17 +63,103 @@ struct AreaKey {
     }
 };
 
+// FaultCounters counts page faults resolved by Vmem.
+struct FaultCounters {
+    // Anonymous pages allocated and zeroed on first write.
+    uint64_t anon = 0;
+    // Anonymous pages mapped to the shared zero page on first read.
+    uint64_t zero = 0;
+    // Pages filled from the page cache.
+    uint64_t file = 0;
+    // Private copies made on write to copy-on-write pages.
+    uint64_t cow = 0;
+    // Anonymous 2 MiB pages allocated and zeroed on first write.
+    uint64_t huge = 0;
+    // Pages read back from swap, including ones read ahead.
+    uint64_t swapin = 0;
+    // Pages written to swap.
+    uint64_t swapout = 0;
+    // Pages currently mapped.
+    uint64_t resident = 0;
+};
+
 enum class FaultStatus {
     Ok = 0,
     InvalidAddress = 1,
     AccessViolation = 2,
 };
 
+class Vmem;
+
+// TlbBatch collects changed page table entries of an address space and invalidates them at once on all CPUs using it.
+// Pages released by the changes, including page tables, are freed only after the invalidation.
+class TlbBatch {
+public:
+    // Larger batches flush the whole address space.
+    static constexpr size_t MAX_PAGES = 32;
+
+private:
+    Vmem& vmem_;
+    uintptr_t addrs_[MAX_PAGES];
+    size_t count_ = 0;
+    bool full_ = false;
+    ListHead<Page, &Page::pa_free_list> free_list_;
+
+public:
+    explicit TlbBatch(Vmem& vmem) noexcept
+        : vmem_(vmem)
+    {}
+
+    TlbBatch(const TlbBatch&) = delete;
+
+    ~TlbBatch() noexcept {
+        Flush();
+    }
+
+    void AddPage(uintptr_t addr) noexcept {
+        if (count_ == MAX_PAGES) {
+            full_ = true;
+            return;
+        }
+        addrs_[count_++] = addr;
+    }
+
+    void AddAll() noexcept {
+        full_ = true;
+    }
+
+    // DeferFree frees page after the invalidation.
+    void DeferFree(Page* page) noexcept {
+        free_list_.InsertLast(*page);
+    }
+
+    // Flush invalidates collected entries and frees deferred pages.
+    void Flush() noexcept;
+};
+
 // Vmem manages the virtual address space, including all its page tables.
 class Vmem {
 private:
     Pte* p4_ = nullptr;
 
+    FaultCounters faults_;
+
+    // CPUs which have this address space loaded, including ones running kernel threads on top of it.
+    std::atomic<uint64_t> cpu_mask_ = 0;
+
+    // Identifies the address space in PCID slots of CPUs. Unlike the address, it's never reused.
+    uint64_t ctx_id_ = 0;
+
+    // Incremented by every TLB invalidation. CPUs which left the address space compare it to flush stale entries on return.
+    std::atomic<uint64_t> tlb_gen_ = 1;
+
+    // SwapOut continues scanning from here, so every page gets a pass to be referenced again before it's swapped out.
+    uintptr_t swap_cursor_ = 0;
+
+    // Protects areas and page tables of the user part. The owner task holds it while changing them, reclaim holds it while
+    // swapping out pages of any task.
+    Mutex mutex_;
+
     // Ordered set of all vmem areas, ordered by area.end.
     boost::intrusive::set<
         Area,
@@ -83,9 +172,69 @@ private:
     // FindAreaByAddr return mm::Area to which given address belongs.
     Area* FindAreaByAddr(uintptr_t addr) noexcept;
 
+    // HandleMissingPage populates not yet touched page of the area.
+    kern::Result<FaultStatus> HandleMissingPage(Area& area, uintptr_t virt_addr, PageFaultFlags pf_flags) noexcept;
+
+    // HandleSwapFault reads the swapped out page back together with its neighbours swapped out next to it.
+    kern::Result<FaultStatus> HandleSwapFault(Area& area, uintptr_t virt_addr) noexcept;
+
+    // HandleSharedWriteFault makes page of a shared file mapping writable and marks it dirty.
+    kern::Result<FaultStatus> HandleSharedWriteFault(uintptr_t virt_addr) noexcept;
+
+    // HandleCowFault gives the faulting task its own writable copy of a copy-on-write page.
+    kern::Result<FaultStatus> HandleCowFault(uintptr_t virt_addr) noexcept;
+
+    // HandleHugeCowFault is HandleCowFault for a 2 MiB page.
+    kern::Result<FaultStatus> HandleHugeCowFault(Pte* p2e, uintptr_t virt_addr) noexcept;
+
+    // MapHugePage maps zeroed 2 MiB page if the aligned range around the address fits into the area and isn't populated yet.
+    // Returns false if 4 KiB page should be used instead.
+    kern::Result<bool> MapHugePage(Area& area, uintptr_t virt_addr) noexcept;
+
+    // SplitHugePage replaces 2 MiB page covering the address (if any) with a page table of 4 KiB pages.
+    kern::Errno SplitHugePage(uintptr_t addr) noexcept;
+
+    // SplitArea splits area at given address and returns the upper part.
+    Area* SplitArea(Area& area, uintptr_t addr) noexcept;
+
+    // IsolateRange splits areas and huge pages crossing bounds of the range, so every one is either inside or outside of it.
+    kern::Errno IsolateRange(uintptr_t start, uintptr_t end) noexcept;
+
+    // MergeArea merges area with adjacent compatible areas and returns the resulting area.
+    Area& MergeArea(Area& area) noexcept;
+
+    // UnmapLocked removes all mappings in the range. The range must be valid.
+    kern::Errno UnmapLocked(uintptr_t start, uintptr_t end) noexcept;
+
+    // UnmapRange clears page table entries of the range and frees emptied page tables.
+    void UnmapRange(uintptr_t start, uintptr_t end, TlbBatch& batch) noexcept;
+
+    // InvalidatePage invalidates the page on this CPU only. Other CPUs flush the address space when they load it next time.
+    void InvalidatePage(uintptr_t addr) noexcept;
+
+    // LoadCr3 loads page tables with a PCID of this CPU, flushing entries of the PCID if they are stale. IRQs must be disabled.
+    void LoadCr3() noexcept;
+
+    // ShootdownTlb invalidates given pages (whole address space if addrs is nullptr) on all CPUs using it.
+    void ShootdownTlb(const uintptr_t* addrs, size_t count) noexcept;
+
+    // MigratePagesLocked is MigratePages with the mutex held.
+    void MigratePagesLocked(const Page* block, size_t count, ListHead<Page, &Page::pa_free_list>& migrated) noexcept;
+
+    // SwapOut scans up to nr pages of private mappings and writes ones not referenced since the previous scan to swap.
+    // Pages shared with other address spaces aren't swapped out. Must be called with the mutex held.
+    ShrinkResult SwapOut(size_t nr) noexcept;
+
+    friend class TlbBatch;
+    friend void HandleTlbShootdown() noexcept;
+    friend void InitGlobalVmem() noexcept;
+
 public:
     static Vmem GLOBAL;
 
+    // Links user address spaces, which are created by New, for reclaim.
+    ListNode vmems_list;
+
     static kern::Result<std::unique_ptr<Vmem>> New(AllocFlags flags = {}) noexcept;
     kern::Errno Init(AllocFlags flags) noexcept;
 
@@ -95,9 +244,33 @@ public:
     // SwitchTo switches current cpu to this address space.
     void SwitchTo() noexcept;
 
+    // Activate switches current cpu to this address space and tracks it for TLB shootdowns. Per-cpu data must be ready.
+    void Activate() noexcept;
+
+    // MapPages creates a new area. Pages are allocated lazily on first access.
     kern::Result<void*> MapPages(uintptr_t virt_addr, size_t pgcnt, AreaFlags flags, vfs::FilePtr file, size_t offset) noexcept;
 
-    // Clone returns a copy of this address space.
+    // Unmap removes all mappings in the range.
+    kern::Errno Unmap(uintptr_t virt_addr, size_t page_count) noexcept;
+
+    // Protect changes access rights of all mappings in the range. The range must be fully mapped.
+    kern::Errno Protect(uintptr_t virt_addr, size_t page_count, AreaFlags flags) noexcept;
+
+    // Msync queues pages of shared file mappings written since the last call for writeback.
+    kern::Errno Msync(uintptr_t virt_addr, size_t page_count) noexcept;
+
+    // MigratePages moves private anonymous pages of the physical block to other pages. Only pages mapped nowhere else are moved.
+    // Old pages are unreferenced and added to the migrated list instead of being freed. Does nothing if the address space
+    // is busy, e.g. when called from its own page fault.
+    void MigratePages(const Page* block, size_t count, ListHead<Page, &Page::pa_free_list>& migrated) noexcept;
+
+    // SwapOutAny swaps out pages of user address spaces in turn, skipping ones which are busy.
+    static ShrinkResult SwapOutAny(size_t nr) noexcept;
+
+    // ResidentPages returns number of pages mapped by all user address spaces.
+    static size_t ResidentPages() noexcept;
+
+    // Clone returns a copy of this address space. Writable pages become shared copy-on-write between both address spaces.
     kern::Result<std::unique_ptr<Vmem>> Clone() noexcept;
 
     kern::Errno Map2MbPage(uintptr_t virt_addr, uintptr_t phys_addr, uint64_t raw_flags, AllocFlags af_flags = {}) noexcept;
@@ -106,12 +279,22 @@ public:
 
     kern::Result<FaultStatus> HandlePageFault(uintptr_t virt_addr, PageFaultFlags pf_flags) noexcept;
 
+    const FaultCounters& Faults() const noexcept {
+        return faults_;
+    }
+
     // Dump prints page tables content in human-readable format.
     void Dump() const noexcept;
 };
 
 void TracePageFault(uintptr_t virt_addr, PageFaultFlags pf_flags) noexcept;
 
+// ShootdownKernelTlb invalidates given kernel pages (all if addrs is nullptr) on all CPUs.
+void ShootdownKernelTlb(const uintptr_t* addrs, size_t count) noexcept;
+
+// HandleTlbShootdown serves TLB shootdown request of another CPU. Called from IPI handler.
+void HandleTlbShootdown() noexcept;
+
 void InitVmem() noexcept;
 void InitGlobalVmem() noexcept;
 
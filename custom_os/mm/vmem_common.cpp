@@ -1,21 +1,35 @@
+#include <algorithm>
+#include <atomic>
+
 #include "arch/ptr.h"
 #include "arch/user.h"
 #include "fs/inode.h"
 #include "fs/vfs.h"
+#include "fs/writeback.h"
 #include "kernel/irq.h"
 #include "kernel/panic.h"
 #include "kernel/sched.h"
 #include "kernel/signal.h"
 #include "kernel/syscall.h"
 #include "lib/common.h"
+#include "lib/locking.h"
 #include "linker.h"
 #include "mm/new.h"
 #include "mm/obj_alloc.h"
 #include "mm/page_alloc.h"
 #include "mm/paging.h"
+#include "mm/swap.h"
 #include "mm/vmem.h"
 #include "uapi/mm.h"
 
+namespace arch {
+
+void SendTlbShootdown(size_t cpu) noexcept;
+
+}
+
+extern bool pcid_enabled;
+
 namespace mm {
 
 TypedObjectAllocator<Vmem> vmem_alloc;
@@ -24,7 +38,11 @@ TypedObjectAllocator<Area> vmem_area_alloc;
 typedef void* (*page_alloc_fn_t)(mm::AllocFlags);
 
 void* vmem_page_alloc_early(mm::AllocFlags flags) {
-    return EarlyAllocPage(1, flags);
+    void* addr = EarlyAllocPage(1, flags);
+    if (addr && flags.Has(AllocFlag::Zero)) {
+        KASAN_NO_INTERCEPT(memset)(addr, 0, PAGE_SIZE);
+    }
+    return addr;
 }
 
 void* vmem_page_alloc_normal(mm::AllocFlags flags) {
@@ -33,14 +51,32 @@ void* vmem_page_alloc_normal(mm::AllocFlags flags) {
 
 page_alloc_fn_t pgalloc_fn = vmem_page_alloc_early;
 
+// Page directory pointer table of the vmalloc area.
+mm::Pte* vmalloc_p3 = nullptr;
+
 Vmem Vmem::GLOBAL;
 
+std::atomic<uint64_t> next_ctx_id = 1;
+
+namespace {
+
+// User address spaces in the order SwapOutAny visits them. An address space is unlinked before it's destroyed, and its
+// mutex is taken only while it's linked, so it can't go away while reclaim holds the mutex.
+SpinLock vmems_lock;
+ListHead<Vmem, &Vmem::vmems_list> vmems;
+
+// Set while SwapOutAny runs, so allocations inside it don't swap out more pages.
+std::atomic<bool> swapping_out = false;
+
+}
+
 kern::Errno Vmem::Init(mm::AllocFlags flags) noexcept {
-    p4_ = (mm::Pte*)pgalloc_fn(flags);
+    ctx_id_ = next_ctx_id.fetch_add(1, std::memory_order_relaxed);
+
+    p4_ = (mm::Pte*)pgalloc_fn(flags | AllocFlag::Zero);
     if (!p4_) {
         return kern::ENOMEM;
     }
-    memset(p4_, '\0', PTE_COUNT * sizeof(mm::Pte));
 
     for (size_t p4e = P4E_FROM_ADDR(KERNEL_HIGHER_HALF_START); p4e < PTE_COUNT; p4e++) {
         PteSet(p4_, p4e, Vmem::GLOBAL.p4_[p4e]);
@@ -60,9 +96,67 @@ kern::Result<std::unique_ptr<Vmem>> Vmem::New(mm::AllocFlags flags) noexcept {
         return err;
     }
 
+    WithIrqSafeLocked(vmems_lock, [&]() {
+        vmems.InsertLast(*vmem);
+    });
+
     return vmem;
 }
 
+ShrinkResult Vmem::SwapOutAny(size_t nr) noexcept {
+    ShrinkResult res;
+    if (!SwapEnabled() || swapping_out.exchange(true, std::memory_order_acquire)) {
+        return res;
+    }
+
+    size_t count = 0;
+    WithIrqSafeLocked(vmems_lock, [&]() {
+        for ([[maybe_unused]] Vmem& vmem : vmems) {
+            count++;
+        }
+    });
+
+    for (size_t i = 0; i < count && res.scanned < nr; i++) {
+        Vmem* vmem = nullptr;
+        WithIrqSafeLocked(vmems_lock, [&]() {
+            if (vmems.Empty()) {
+                return;
+            }
+            // The next call starts with the following address space.
+            Vmem& first = vmems.First();
+            first.vmems_list.Remove();
+            vmems.InsertLast(first);
+            // Busy address spaces are skipped: their owners could be waiting for memory, which is being reclaimed now.
+            if (first.mutex_.RawTryLock()) {
+                vmem = &first;
+            }
+        });
+        if (!vmem) {
+            continue;
+        }
+
+        ShrinkResult part = vmem->SwapOut(nr - res.scanned);
+        vmem->mutex_.RawUnlock();
+        res.scanned += part.scanned;
+        res.freed_pages += part.freed_pages;
+    }
+
+    swapping_out.store(false, std::memory_order_release);
+    return res;
+}
+
+size_t Vmem::ResidentPages() noexcept {
+    size_t pages = 0;
+    WithIrqSafeLocked(vmems_lock, [&]() {
+        for (Vmem& vmem : vmems) {
+            pages += vmem.faults_.resident;
+        }
+    });
+    return pages;
+}
+
+mm::Pte* EnsureNextTable(mm::Pte* tbl, size_t idx, uint64_t raw_flags, mm::AllocFlags af_flags) noexcept;
+
 void InitGlobalVmem() noexcept {
     auto res = Vmem::GLOBAL.Init(AllocFlag::NoSleep | AllocFlag::SkipKasan);
     if (!res.Ok()) {
@@ -94,11 +188,26 @@ void InitGlobalVmem() noexcept {
         phys_addr += GB;
     }
 
+    // Address spaces copy top level entries of the kernel half on creation, so the vmalloc area table must exist before.
+    vmalloc_p3 = EnsureNextTable(Vmem::GLOBAL.p4_, P4E_FROM_ADDR(KERNEL_VMALLOC_START), PTE_WRITE, AllocFlag::NoSleep | AllocFlag::SkipKasan);
+    if (!vmalloc_p3) {
+        panic("cannot setup vmalloc area");
+    }
+
     Vmem::GLOBAL.SwitchTo();
 }
 
+// Shared page of zeroes backing untouched anonymous memory. Holds an extra reference, so it's never freed.
+Page* zero_page = nullptr;
+
 void InitVmem() noexcept {
     pgalloc_fn = vmem_page_alloc_normal;
+
+    zero_page = AllocPage(0, AllocFlag::Zero);
+    if (!zero_page) {
+        panic("cannot allocate zero page");
+    }
+    zero_page->Ref();
 }
 
 mm::Pte* EnsureNextTable(mm::Pte* tbl, size_t idx, uint64_t raw_flags, mm::AllocFlags af_flags = {}) noexcept {
@@ -108,13 +217,10 @@ mm::Pte* EnsureNextTable(mm::Pte* tbl, size_t idx, uint64_t raw_flags, mm::Alloc
         next_tbl = static_cast<mm::Pte*>(PHYS_TO_VIRT(PteAddr(pte)));
         tbl[idx] |= raw_flags;
     } else {
-        next_tbl = static_cast<mm::Pte*>(pgalloc_fn(af_flags));
+        next_tbl = static_cast<mm::Pte*>(pgalloc_fn(af_flags | AllocFlag::Zero));
         if (!next_tbl) {
             return nullptr;
         }
-        for (size_t i = 0; i < PTE_COUNT; i++) {
-            PteSet(next_tbl, i, 0);
-        }
         tbl[idx] = (uint64_t)VIRT_TO_PHYS(next_tbl) | PTE_PRESENT | raw_flags;
     }
     return next_tbl;
@@ -220,7 +326,7 @@ uint64_t GetPteFlags(AreaFlags flags) noexcept {
 }
 
 Area* Vmem::FindAreaByAddr(uintptr_t addr) noexcept {
-    auto it = areas_set_.lower_bound(addr);
+    auto it = areas_set_.upper_bound(addr);
     if (it == areas_set_.end()) {
         return nullptr;
     }
@@ -234,9 +340,254 @@ void Vmem::SwitchTo() noexcept {
     x86::WriteCr3((uint64_t)VIRT_TO_PHYS(p4_));
 }
 
+PER_CPU_DEFINE(Vmem*, active_vmem);
+
+namespace {
+
+// Number of PCIDs used by each CPU, PCID 0 is left for page tables loaded with SwitchTo.
+constexpr size_t TLB_NR_ASIDS = 6;
+
+// CpuTlbState tracks address spaces which own PCIDs of a CPU. Accessed only by the CPU itself with IRQs disabled.
+struct alignas(CACHE_LINE_SIZE_BYTES) CpuTlbState {
+    uint64_t ctx_ids[TLB_NR_ASIDS];
+    // Value of tlb_gen_ the entries tagged with the PCID are up to date with. Zero forces a flush on the next load.
+    uint64_t tlb_gens[TLB_NR_ASIDS];
+    size_t next_asid;
+    size_t loaded_asid;
+};
+
+CpuTlbState cpu_tlb_state[MAX_CPUS];
+
+// TlbShootdownRequest is a TLB invalidation requested from other CPUs. Only one request is in flight at a time.
+struct TlbShootdownRequest {
+    Vmem* vmem = nullptr;
+    uint64_t tlb_gen = 0;
+    const uintptr_t* addrs = nullptr;
+    // Zero count means the whole address space.
+    size_t count = 0;
+    std::atomic<size_t> pending = 0;
+};
+
+SpinLock tlb_shootdown_lock;
+TlbShootdownRequest tlb_shootdown;
+
+// CPUs which have loaded any address space. All of them could cache kernel mappings.
+std::atomic<uint64_t> kernel_cpu_mask = 0;
+
+// FlushLocalTlb invalidates given pages of the loaded PCID. Entries of the vmem are up to date with tlb_gen afterwards.
+// Nullptr vmem means kernel mappings, which are cached with every PCID: others are flushed on their next load.
+void FlushLocalTlb(Vmem* vmem, uint64_t tlb_gen, const uintptr_t* addrs, size_t count) noexcept {
+    if (count == 0) {
+        x86::WriteCr3(x86::ReadCr3());
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            arch::TlbInvalidate(addrs[i]);
+        }
+    }
+
+    kern::WithoutIrqs([&]() {
+        CpuTlbState& st = cpu_tlb_state[PER_CPU_GET(cpu_id)];
+        if (vmem) {
+            st.tlb_gens[st.loaded_asid] = std::max(st.tlb_gens[st.loaded_asid], tlb_gen);
+            return;
+        }
+        if (!pcid_enabled) {
+            return;
+        }
+        for (size_t asid = 0; asid < TLB_NR_ASIDS; asid++) {
+            if (asid != st.loaded_asid) {
+                st.tlb_gens[asid] = 0;
+            }
+        }
+    });
+}
+
+}
+
+void Vmem::LoadCr3() noexcept {
+    CpuTlbState& st = cpu_tlb_state[PER_CPU_GET(cpu_id)];
+    // Pairs with ShootdownTlb: either the shootdown reaches this CPU or its generation is seen here.
+    uint64_t gen = tlb_gen_.load(std::memory_order_seq_cst);
+    uint64_t cr3 = (uint64_t)VIRT_TO_PHYS(p4_);
+
+    if (!pcid_enabled) {
+        // Every load flushes the whole TLB.
+        st.ctx_ids[0] = ctx_id_;
+        st.tlb_gens[0] = gen;
+        st.loaded_asid = 0;
+        x86::WriteCr3(cr3);
+        return;
+    }
+
+    size_t asid = 0;
+    while (asid < TLB_NR_ASIDS && st.ctx_ids[asid] != ctx_id_) {
+        asid++;
+    }
+    bool flush = true;
+    if (asid == TLB_NR_ASIDS) {
+        // Take PCIDs round robin, entries left by the previous owner are flushed on load.
+        asid = st.next_asid;
+        st.next_asid = (st.next_asid + 1) % TLB_NR_ASIDS;
+        st.ctx_ids[asid] = ctx_id_;
+    } else {
+        flush = st.tlb_gens[asid] < gen;
+    }
+    st.tlb_gens[asid] = gen;
+    st.loaded_asid = asid;
+
+    cr3 |= asid + 1;
+    if (!flush) {
+        cr3 |= x86::CR3_NOFLUSH;
+    }
+    x86::WriteCr3(cr3);
+}
+
+void Vmem::InvalidatePage(uintptr_t addr) noexcept {
+    kern::WithoutIrqs([&]() {
+        arch::TlbInvalidate(addr);
+        uint64_t gen = tlb_gen_.fetch_add(1, std::memory_order_seq_cst) + 1;
+
+        // This CPU is up to date only if it hasn't missed any previous change.
+        CpuTlbState& st = cpu_tlb_state[PER_CPU_GET(cpu_id)];
+        if (st.ctx_ids[st.loaded_asid] == ctx_id_ && st.tlb_gens[st.loaded_asid] == gen - 1) {
+            st.tlb_gens[st.loaded_asid] = gen;
+        }
+    });
+}
+
+void Vmem::Activate() noexcept {
+    kern::WithoutIrqs([&]() {
+        Vmem* prev = PER_CPU_GET(active_vmem);
+        if (prev == this) {
+            // Kernel threads run on top of the previous address space, switching back to its task keeps TLB as is.
+            // Entries invalidated by the task on other CPUs meanwhile are flushed.
+            CpuTlbState& st = cpu_tlb_state[PER_CPU_GET(cpu_id)];
+            if (st.ctx_ids[st.loaded_asid] != ctx_id_ || st.tlb_gens[st.loaded_asid] < tlb_gen_.load(std::memory_order_relaxed)) {
+                LoadCr3();
+            }
+            return;
+        }
+
+        uint64_t cpu_bit = 1ull << PER_CPU_GET(cpu_id);
+        // Publish the CPU before loading page tables: shootdowns started after this point will reach it.
+        cpu_mask_.fetch_or(cpu_bit, std::memory_order_seq_cst);
+        kernel_cpu_mask.fetch_or(cpu_bit, std::memory_order_relaxed);
+        if (prev) {
+            prev->cpu_mask_.fetch_and(~cpu_bit, std::memory_order_relaxed);
+        }
+        PER_CPU_SET(active_vmem, this);
+        LoadCr3();
+    });
+}
+
+namespace {
+
+// SendShootdown invalidates pages on given CPUs, including the current one, and waits for others to finish.
+// Nullptr vmem means kernel mappings. Must be called with tlb_shootdown_lock held.
+void SendShootdown(Vmem* vmem, uint64_t tlb_gen, uint64_t cpu_mask, const uintptr_t* addrs, size_t count) noexcept {
+    size_t curr_cpu = PER_CPU_GET(cpu_id);
+    if (cpu_mask & (1ull << curr_cpu)) {
+        FlushLocalTlb(vmem, tlb_gen, addrs, count);
+    }
+    cpu_mask &= ~(1ull << curr_cpu);
+    if (cpu_mask == 0) {
+        return;
+    }
+
+    size_t targets = 0;
+    for (uint64_t mask = cpu_mask; mask != 0; mask &= mask - 1) {
+        targets++;
+    }
+
+    tlb_shootdown.vmem = vmem;
+    tlb_shootdown.tlb_gen = tlb_gen;
+    tlb_shootdown.addrs = addrs;
+    tlb_shootdown.count = count;
+    tlb_shootdown.pending.store(targets, std::memory_order_release);
+
+    for (size_t cpu = 0; cpu_mask != 0; cpu++, cpu_mask >>= 1) {
+        if (cpu_mask & 1) {
+            arch::SendTlbShootdown(cpu);
+        }
+    }
+
+    while (tlb_shootdown.pending.load(std::memory_order_acquire) != 0) {
+        __builtin_ia32_pause();
+    }
+}
+
+}
+
+void Vmem::ShootdownTlb(const uintptr_t* addrs, size_t count) noexcept {
+    // Page table updates must be visible before reading the mask. CPUs which aren't in the mask see the new generation.
+    uint64_t tlb_gen = tlb_gen_.fetch_add(1, std::memory_order_seq_cst) + 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // Shootdown waits for other CPUs with IRQs enabled, otherwise two CPUs shooting at each other deadlock.
+    PreemptSafeScopeLocker locker(tlb_shootdown_lock);
+    SendShootdown(this, tlb_gen, cpu_mask_.load(std::memory_order_relaxed), addrs, count);
+}
+
+void ShootdownKernelTlb(const uintptr_t* addrs, size_t count) noexcept {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    PreemptSafeScopeLocker locker(tlb_shootdown_lock);
+    SendShootdown(nullptr, 0, kernel_cpu_mask.load(std::memory_order_relaxed), addrs, count);
+}
+
+void HandleTlbShootdown() noexcept {
+    Vmem* vmem = tlb_shootdown.vmem;
+    if (!vmem) {
+        // Kernel mappings are cached regardless of the loaded address space.
+        FlushLocalTlb(nullptr, 0, tlb_shootdown.addrs, tlb_shootdown.count);
+    } else if (PER_CPU_GET(active_vmem) == vmem) {
+        sched::Task* curr = sched::Current();
+        if (curr->vmem.get() == vmem) {
+            FlushLocalTlb(vmem, tlb_shootdown.tlb_gen, tlb_shootdown.addrs, tlb_shootdown.count);
+        } else {
+            // Kernel thread runs on top of the address space lazily, just leave it instead of flushing.
+            Vmem::GLOBAL.Activate();
+        }
+    }
+    tlb_shootdown.pending.fetch_sub(1, std::memory_order_release);
+}
+
+void TlbBatch::Flush() noexcept {
+    if (full_) {
+        vmem_.ShootdownTlb(nullptr, 0);
+    } else if (count_ > 0) {
+        vmem_.ShootdownTlb(addrs_, count_);
+    }
+    count_ = 0;
+    full_ = false;
+
+    while (!free_list_.Empty()) {
+        Page& page = free_list_.First();
+        page.pa_free_list.Remove();
+        FreePage(&page);
+    }
+}
+
 void DestroyPageTables(mm::Pte* p4) noexcept;
 
 Vmem::~Vmem() noexcept {
+    if (vmems_list.next) {
+        WithIrqSafeLocked(vmems_lock, [&]() {
+            vmems_list.Remove();
+        });
+        // Wait for reclaim, which could have locked the address space before it was unlinked.
+        RawScopeLocker locker(mutex_);
+    }
+
+    if (PER_CPU_GET(active_vmem) == this) {
+        Vmem::GLOBAL.Activate();
+    }
+
+    // Make CPUs which still have the address space loaded leave it before page tables are freed.
+    if (cpu_mask_.load(std::memory_order_relaxed) != 0) {
+        ShootdownTlb(nullptr, 0);
+    }
+
     for (auto it = areas_set_.begin(); it != areas_set_.end(); ) {
         Area* area = &*it;
         area->file.Reset();
@@ -332,6 +683,8 @@ void DumpPageTables(mm::Pte* p4, bool dump_kernel_pages = false) {
 
 void Vmem::Dump() const noexcept {
     DumpPageTables(p4_);
+    printk("faults: anon=%lu zero=%lu file=%lu cow=%lu huge=%lu swapin=%lu swapout=%lu resident=%lu\n", faults_.anon, faults_.zero, faults_.file,
+        faults_.cow, faults_.huge, faults_.swapin, faults_.swapout, faults_.resident);
 }
 
 void* GetTaskIP() {
@@ -403,6 +756,9 @@ kern::Result<void*> SysMmap(sched::Task* task, uintptr_t addr, size_t sz, int pr
         if (!f->flags_.Has(vfs::FileFlag::Mappable)) {
             return kern::EINVAL;
         }
+        if ((prot & PROT_WRITE) && !f->flags_.Has(vfs::FileFlag::Writeable)) {
+            return kern::EINVAL;
+        }
     }
 
     AreaFlags mp_flags;
@@ -427,13 +783,42 @@ kern::Result<void*> SysMmap(sched::Task* task, uintptr_t addr, size_t sz, int pr
 }
 REGISTER_SYSCALL(mmap, SysMmap);
 
-kern::Errno SysMunmap(sched::Task*) noexcept {
-    return kern::ENOSYS;
+kern::Errno SysMsync(sched::Task* task, uintptr_t addr, size_t sz, int flags) noexcept {
+    if ((flags & MS_ASYNC) && (flags & MS_SYNC)) {
+        return kern::EINVAL;
+    }
+
+    if (auto err = task->vmem->Msync(addr, DIV_ROUNDUP(sz, PAGE_SIZE)); !err.Ok()) {
+        return err;
+    }
+
+    if (flags & MS_SYNC) {
+        fs::Sync();
+    }
+    return kern::ENOERR;
+}
+REGISTER_SYSCALL(msync, SysMsync);
+
+kern::Errno SysMunmap(sched::Task* task, uintptr_t addr, size_t sz) noexcept {
+    if (sz == 0) {
+        return kern::EINVAL;
+    }
+    return task->vmem->Unmap(addr, DIV_ROUNDUP(sz, PAGE_SIZE));
 }
 REGISTER_SYSCALL(munmap, SysMunmap);
 
-kern::Errno SysMprotect(sched::Task*) noexcept {
-    return kern::ENOSYS;
+kern::Errno SysMprotect(sched::Task* task, uintptr_t addr, size_t sz, int prot) noexcept {
+    AreaFlags flags;
+    if (prot & PROT_READ) {
+        flags |= AreaFlag::Read;
+    }
+    if (prot & PROT_WRITE) {
+        flags |= AreaFlag::Write;
+    }
+    if (prot & PROT_EXEC) {
+        flags |= AreaFlag::Exec;
+    }
+    return task->vmem->Protect(addr, DIV_ROUNDUP(sz, PAGE_SIZE), flags);
 }
 REGISTER_SYSCALL(mprotect, SysMprotect);
 
@@ -0,0 +1,171 @@
+#include "arch/x86/x86.h"
+#include "kernel/kernel_thread.h"
+#include "kernel/panic.h"
+#include "kernel/per_cpu.h"
+#include "kernel/sched.h"
+#include "kernel/time.h"
+#include "kernel/wait.h"
+#include "lib/locking.h"
+#include "mm/page_alloc.h"
+#include "mm/reclaim.h"
+
+extern size_t cpu_count;
+
+namespace mm {
+
+namespace {
+
+using namespace time::literals;
+
+constexpr size_t ZERO_POOL_HIGH = 16;
+// Allocations wake the zeroing thread when the reserve drops below this.
+constexpr size_t ZERO_POOL_LOW = ZERO_POOL_HIGH / 2;
+
+// The zeroing thread rechecks reserves even if nobody woke it.
+constexpr uint64_t ZERO_POOL_PERIOD = 1_s;
+
+// ZeroedPages is a reserve of zeroed pages of a CPU. The zeroing thread fills reserves of all CPUs, so it has a lock.
+struct alignas(CACHE_LINE_SIZE_BYTES) ZeroedPages {
+    SpinLock lock;
+    size_t count[MIGRATE_TYPES];
+    Page* pages[MIGRATE_TYPES][ZERO_POOL_HIGH];
+};
+
+ZeroedPages zeroed_pages[MAX_CPUS];
+
+kern::WaitQueue zero_wq;
+
+bool NeedRefill() noexcept {
+    if (MemoryPressure()) {
+        return false;
+    }
+    for (size_t cpu = 0; cpu < cpu_count; cpu++) {
+        for (size_t type = 0; type < MIGRATE_TYPES; type++) {
+            if (zeroed_pages[cpu].count[type] < ZERO_POOL_LOW) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void Refill(ZeroedPages& zp, MigrateType type) noexcept {
+    AllocFlags flags = AllocFlag::NoSleep;
+    if (type == MIGRATE_MOVABLE) {
+        flags = flags | AllocFlag::Movable;
+    }
+
+    while (!MemoryPressure()) {
+        if (WithIrqSafeLocked(zp.lock, [&]() { return zp.count[type] >= ZERO_POOL_HIGH; })) {
+            return;
+        }
+
+        Page* page = AllocPage(0, flags);
+        if (!page) {
+            return;
+        }
+        // The page is used by another task later, don't evict the working set for it.
+        x86::ClearNonTemporal(page->Virt(), PAGE_SIZE);
+
+        bool stored = WithIrqSafeLocked(zp.lock, [&]() {
+            if (zp.count[type] >= ZERO_POOL_HIGH) {
+                return false;
+            }
+            zp.pages[type][zp.count[type]++] = page;
+            return true;
+        });
+        if (!stored) {
+            FreePage(page);
+            return;
+        }
+    }
+}
+
+void ZeroPagesThread(void*) noexcept {
+    // Zeroing in advance is worth only the time nobody else wants.
+    sched::SetNice(sched::Current(), sched::NICE_MAX);
+
+    for (;;) {
+        zero_wq.WaitCondDeadline(NeedRefill, time::NowMonotonic().Add(ZERO_POOL_PERIOD));
+
+        for (size_t cpu = 0; cpu < cpu_count; cpu++) {
+            for (size_t type = 0; type < MIGRATE_TYPES; type++) {
+                Refill(zeroed_pages[cpu], (MigrateType)type);
+            }
+        }
+    }
+}
+
+// ZeroPagesShrinker returns reserved pages under memory pressure.
+class ZeroPagesShrinker : public Shrinker {
+public:
+    size_t Count() noexcept override {
+        size_t count = 0;
+        for (size_t cpu = 0; cpu < cpu_count; cpu++) {
+            for (size_t type = 0; type < MIGRATE_TYPES; type++) {
+                count += zeroed_pages[cpu].count[type];
+            }
+        }
+        return count;
+    }
+
+    ShrinkResult Scan(size_t nr) noexcept override {
+        ShrinkResult res;
+        for (size_t cpu = 0; cpu < cpu_count && res.scanned < nr; cpu++) {
+            ZeroedPages& zp = zeroed_pages[cpu];
+            for (size_t type = 0; type < MIGRATE_TYPES; type++) {
+                for (;;) {
+                    Page* page = WithIrqSafeLocked(zp.lock, [&]() -> Page* {
+                        if (zp.count[type] == 0 || res.scanned == nr) {
+                            return nullptr;
+                        }
+                        return zp.pages[type][--zp.count[type]];
+                    });
+                    if (!page) {
+                        break;
+                    }
+                    FreePage(page);
+                    res.scanned++;
+                    res.freed_pages++;
+                }
+            }
+        }
+        return res;
+    }
+};
+
+ZeroPagesShrinker zero_pages_shrinker;
+
+}
+
+// TakeZeroedPage returns a page from the reserve of this CPU. The page is accounted as allocated already.
+Page* TakeZeroedPage(AllocFlags flags) noexcept {
+    MigrateType type = flags.Has(AllocFlag::Movable) ? MIGRATE_MOVABLE : MIGRATE_UNMOVABLE;
+    // Preemption could move the task to another CPU meanwhile, the lock keeps the reserve consistent anyway.
+    ZeroedPages& zp = zeroed_pages[PER_CPU_GET(cpu_id)];
+
+    size_t left = 0;
+    Page* page = WithIrqSafeLocked(zp.lock, [&]() -> Page* {
+        if (zp.count[type] == 0) {
+            return nullptr;
+        }
+        left = --zp.count[type];
+        return zp.pages[type][left];
+    });
+
+    if (left < ZERO_POOL_LOW && !flags.Has(AllocFlag::NoSleep) && kern::IsIrqEnabled()) {
+        zero_wq.WakeAll();
+    }
+    return page;
+}
+
+void ZeroPagesStart() noexcept {
+    RegisterShrinker(zero_pages_shrinker);
+
+    auto err = kern::CreateKthread(ZeroPagesThread, nullptr);
+    if (!err.Ok()) {
+        panic("cannot create page zeroing thread: %e", err.Err().Code());
+    }
+}
+
+}
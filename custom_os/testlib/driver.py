@@ -8,7 +8,7 @@ from elftools.elf.elffile import ELFFile
 from elftools.elf.sections import SymbolTableSection
 
 class QemuDriver:
-    def __init__(self, work_dir: pathlib.Path, memory="128m", disk_img=None):
+    def __init__(self, work_dir: pathlib.Path, memory="128m", disk_img=None, swap_img=None):
         self._work_dir = work_dir
         self.kernel_iso = work_dir / "kernel.iso"
         self.kernel_bin = work_dir / "kernel.elf"
@@ -16,6 +16,7 @@ class QemuDriver:
         self.elf_file = ELFFile(self._opened_kernel_bin)
         self._memory = memory
         self._disk_img = disk_img
+        self._swap_img = swap_img
 
     def get_kernel_symbol(self, name):
         syms = self.elf_file.get_section_by_name(".symtab")
@@ -50,6 +51,10 @@ class QemuDriver:
         cmd = [
             "qemu-system-x86_64",
             "-m", self._memory,
+            # Invariant TSC lets user space read the clock through the vsyscall page. KVM passes it through from the host.
+            "-accel", "kvm",
+            "-accel", "tcg",
+            "-cpu", "max,+invtsc",
             "-device", "isa-debug-exit,iobase=0x501,iosize=0x2",
             "-qmp", f"unix:{self._work_dir}/qemu.sock,server",
             "-serial", "stdio",
@@ -63,6 +68,9 @@ class QemuDriver:
         ]
         if self._disk_img is not None:
             cmd += ["-hda", self._disk_img]
+        if self._swap_img is not None:
+            # The kernel swaps to the second disk.
+            cmd += ["-hdb", self._swap_img]
 
         self._proc = await asyncio.create_subprocess_exec(
             *cmd,
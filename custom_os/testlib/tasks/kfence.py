@@ -0,0 +1,40 @@
+import asyncio
+from testlib import asserts
+from testlib.testing import TestResult, TestBase, timeout
+
+class TestKfence(TestBase):
+    async def run(self):
+        await self.build(
+            config_values={
+                "KFENCE": True,
+                "KFENCE_SAMPLE_INTERVAL": 16,
+                "TEST_KFENCE": True,
+                "DUPLICATE_PRINTK_TO_COM2": True,
+                # The test corrupts memory on purpose, KFENCE has to report it instead of KASAN.
+                "KASAN": False,
+            },
+        )
+
+        async with asyncio.timeout(60):
+            async with self.start_driver(memory="128m") as driver:
+                checks = [b"[test] sampled one in 16 allocations", b"[test] freed objects are unmapped"]
+                corrupted = None
+                while True:
+                    line = await driver.serial_reader.readline()
+                    if len(line) == 0:
+                        asserts.fail("EOF occurred while reading output from the kernel")
+                    line = line.strip()
+                    if line.startswith(b"[test] fail"):
+                        asserts.fail(line.decode(errors="replace"))
+                    if checks and line == checks[0]:
+                        checks.pop(0)
+                    elif line.startswith(b"[test] corrupting "):
+                        corrupted = line[len(b"[test] corrupting "):]
+                    elif line.startswith(b"KFENCE: memory corruption at "):
+                        break
+
+                asserts.true_verbose(not checks, f"kernel didn't report: {checks}")
+                asserts.eq_verbose(corrupted, line.split()[4], "KFENCE reported a wrong corrupted address")
+                await asserts.expect_panic(driver)
+
+        return TestResult.ok()
@@ -0,0 +1,35 @@
+import asyncio
+from testlib import asserts
+from testlib.testing import TestResult, TestBase, timeout
+
+# mm::(anonymous namespace)::pages_reclaimed
+PAGES_RECLAIMED_SYMBOL = "_ZN2mm12_GLOBAL__N_115pages_reclaimedE"
+
+class TestReclaim(TestBase):
+    async def run(self):
+        await self.build(make_extra_vars={
+            "TEST_RECLAIM": "1"
+        })
+
+        async with asyncio.timeout(180):
+            # Test files take 96 MiB, twice the page cache could hold.
+            async with self.start_driver(memory="64m") as driver:
+                syms = driver.get_kernel_symbol(PAGES_RECLAIMED_SYMBOL)
+                asserts.true_verbose(syms, f"kernel has no symbol {PAGES_RECLAIMED_SYMBOL}")
+                addr = syms[0].entry.st_value
+
+                # The counter can't be read once the VM exits, so sample it while the test runs.
+                reclaimed = 0
+                exited = asyncio.create_task(driver.wait())
+                while not exited.done():
+                    try:
+                        mem = await driver.read_virt_mem(addr, 8)
+                    except Exception:
+                        break
+                    reclaimed = max(reclaimed, int.from_bytes(mem, "little"))
+                    await asyncio.sleep(0.5)
+
+                await asserts.expect_success(driver)
+                asserts.true_verbose(reclaimed > 0, "no pages were reclaimed while reading files bigger than memory")
+
+        return TestResult.ok()
@@ -0,0 +1,31 @@
+import asyncio
+from testlib import asserts
+from testlib.testing import TestResult, TestBase, timeout
+
+class TestSwap(TestBase):
+    async def run(self):
+        await self.build(
+            config_values={
+                "DUPLICATE_PRINTK_TO_COM2": True,
+            },
+            make_extra_vars={
+                "TEST_SWAP": "1",
+            },
+        )
+        asserts.true_verbose((self.work_dir / "swap.img").exists(), "swap.img wasn't built")
+
+        async with asyncio.timeout(300):
+            # The test maps 72 MiB, more than the VM has: it passes only if pages go to the 64 MiB swap disk.
+            async with self.start_driver(memory="64m") as driver:
+                swap_on = False
+                while True:
+                    line = await driver.serial_reader.readline()
+                    if len(line) == 0:
+                        break
+                    if line.startswith(b"[mm] swap on "):
+                        swap_on = True
+
+                await asserts.expect_success(driver)
+                asserts.true_verbose(swap_on, "kernel didn't find the swap disk")
+
+        return TestResult.ok()
@@ -0,0 +1,17 @@
+import asyncio
+from testlib import asserts
+from testlib.testing import TestResult, TestBase, timeout
+
+class TestVmalloc(TestBase):
+    async def run(self):
+        await self.build(
+            config_values={
+                "TEST_VMALLOC": True,
+            },
+        )
+
+        async with asyncio.timeout(60):
+            async with self.start_driver(memory="128m") as driver:
+                await asserts.expect_success(driver)
+
+        return TestResult.ok()
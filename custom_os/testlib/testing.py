@@ -37,9 +37,13 @@ class TestBase:
         disk_img = None
         if os.path.exists(self.work_dir / "disk.img"):
             disk_img = self.work_dir / "disk.img"
+        swap_img = None
+        if os.path.exists(self.work_dir / "swap.img"):
+            swap_img = self.work_dir / "swap.img"
         return QemuDriver(
             work_dir=self.work_dir,
             disk_img=disk_img,
+            swap_img=swap_img,
             memory=memory,
         )
 
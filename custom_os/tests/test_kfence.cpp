@@ -0,0 +1,86 @@
+#include "kernel/irq.h"
+#include "mm/kfence.h"
+#include "mm/obj_alloc.h"
+#include "mm/paging.h"
+#include "tests/common.h"
+
+namespace mm {
+
+extern mm::Pte* vmalloc_p3;
+
+}
+
+namespace {
+
+constexpr size_t OBJ_SIZE = 100;
+constexpr size_t SAMPLES = 3;
+
+mm::ObjectAllocator alloc(OBJ_SIZE);
+
+// IsMapped walks the kernel page tables covering the vmalloc area and the KFENCE pool.
+bool IsMapped(uintptr_t addr) noexcept {
+    mm::Pte* tbl = mm::vmalloc_p3;
+    for (size_t idx : {P3E_FROM_ADDR(addr), P2E_FROM_ADDR(addr)}) {
+        if (!(tbl[idx] & PTE_PRESENT)) {
+            return false;
+        }
+        tbl = static_cast<mm::Pte*>(PHYS_TO_VIRT(mm::PteAddr(tbl[idx])));
+    }
+    return tbl[P1E_FROM_ADDR(addr)] & PTE_PRESENT;
+}
+
+}
+
+void KernelPid1() noexcept {
+    printk("==== Running KFENCE test ====\n");
+
+    // The countdown is per CPU: with IRQs disabled no other task allocates here and shifts the samples.
+    void* sampled[SAMPLES];
+    size_t sampled_at[SAMPLES];
+    size_t count = 0;
+    kern::WithoutIrqs([&]() {
+        for (size_t i = 0; i < SAMPLES * CONFIG_KFENCE_SAMPLE_INTERVAL; i++) {
+            void* obj = alloc.Alloc();
+            FAIL_ON_NULL(obj, "cannot allocate object #%lu", i);
+            if (!kfence::IsKfenceAddr(obj)) {
+                alloc.Free(obj);
+                continue;
+            }
+            FAIL_ON(count == SAMPLES, "more than %lu of %lu allocations were sampled", SAMPLES, i + 1);
+            sampled[count] = obj;
+            sampled_at[count] = i;
+            count++;
+        }
+    });
+    FAIL_ON(count != SAMPLES, "%lu of %lu allocations were sampled, expected %lu", count,
+        SAMPLES * CONFIG_KFENCE_SAMPLE_INTERVAL, SAMPLES);
+    for (size_t i = 1; i < SAMPLES; i++) {
+        FAIL_ON(sampled_at[i] - sampled_at[i - 1] != CONFIG_KFENCE_SAMPLE_INTERVAL,
+            "allocations #%lu and #%lu were sampled, expected one in %lu", sampled_at[i - 1], sampled_at[i],
+            (size_t)CONFIG_KFENCE_SAMPLE_INTERVAL);
+    }
+
+    for (void* obj : sampled) {
+        uintptr_t page = ALIGN_DOWN((uintptr_t)obj, PAGE_SIZE);
+        FAIL_ON((uintptr_t)obj + OBJ_SIZE > page + PAGE_SIZE, "object %p crosses its page", obj);
+        FAIL_ON(!IsMapped(page), "page of object %p isn't mapped", obj);
+        FAIL_ON(IsMapped(page - PAGE_SIZE) || IsMapped(page + PAGE_SIZE), "guard page of object %p is mapped", obj);
+        memset(obj, 0x5a, OBJ_SIZE);
+    }
+    printk("[test] sampled one in %lu allocations\n", (size_t)CONFIG_KFENCE_SAMPLE_INTERVAL);
+
+    for (size_t i = 0; i + 1 < SAMPLES; i++) {
+        alloc.Free(sampled[i]);
+        FAIL_ON(IsMapped(ALIGN_DOWN((uintptr_t)sampled[i], PAGE_SIZE)), "freed object %p is still mapped", sampled[i]);
+    }
+    printk("[test] freed objects are unmapped\n");
+
+    // Objects are placed at either end of their pages, the canary fills the other side.
+    uint8_t* obj = static_cast<uint8_t*>(sampled[SAMPLES - 1]);
+    uint8_t* corrupted = (uintptr_t)obj % PAGE_SIZE == 0 ? obj + OBJ_SIZE : obj - 1;
+    printk("[test] corrupting %p\n", corrupted);
+    *corrupted = 0;
+    alloc.Free(obj);
+
+    FAIL("corruption at %p wasn't reported", corrupted);
+}
@@ -3,6 +3,16 @@
 #include "tests/test_page_alloc_common.h"
 
 void KernelPid1() noexcept {
+    // Movable and unmovable pages are grouped in different pageblocks.
+    mm::Page* movable = mm::AllocPage(0, mm::AllocFlag::Movable);
+    mm::Page* unmovable = mm::AllocPage(0);
+    FAIL_ON_NULL(movable, "cannot allocate movable page");
+    FAIL_ON_NULL(unmovable, "cannot allocate unmovable page");
+    FAIL_ON(movable->Area() == unmovable->Area() && movable->Id() >> mm::PAGEBLOCK_ORDER == unmovable->Id() >> mm::PAGEBLOCK_ORDER,
+        "movable page %p and unmovable page %p share a pageblock", movable->Virt(), unmovable->Virt());
+    mm::FreePage(movable);
+    mm::FreePage(unmovable);
+
     size_t allocated = 0;
     size_t allocated_user = 0;
     PageWithPointers* root = TestAllocAll(0, &allocated);
@@ -26,6 +36,7 @@ void KernelPid1() noexcept {
             freed++;
         }
     }
+    FAIL_ON(mm::FragmentationIndex(1) != -1000, "no free order 1 blocks after freeing all pages");
 
     // After this point, simple linked list allocator can't allocate two continous pages.
     for (size_t i = 0; i < 100; i++) {
@@ -53,6 +53,7 @@ void KernelPid1() noexcept {
 
     uint64_t allocations = total_allocated_objs.load(std::memory_order_relaxed);
     printk("done %d allocations in total\n", allocations);
+    mm::ObjectAllocator::DumpStats();
     // 95 Mbytes in test (KASAN pages accounted), 511 – size of object.
     const uint64_t MIN_ALLOCATIONS = 95 * (1 << 20) / 511;
     FAIL_ON(allocations < MIN_ALLOCATIONS, "too few allocations %ld, should be at least %ld", allocations, MIN_ALLOCATIONS);
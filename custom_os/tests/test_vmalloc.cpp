@@ -0,0 +1,116 @@
+#include "kernel/irq.h"
+#include "mm/paging.h"
+#include "mm/vmalloc.h"
+#include "tests/common.h"
+
+namespace mm {
+
+extern mm::Pte* vmalloc_p3;
+
+}
+
+namespace {
+
+// More pages than TlbBatch::MAX_PAGES, so freeing flushes the whole TLB; the small area flushes single pages.
+constexpr size_t BIG_PAGES = 100;
+
+// IsMapped walks the vmalloc page tables without allocating missing ones.
+bool IsMapped(uintptr_t addr) noexcept {
+    mm::Pte* tbl = mm::vmalloc_p3;
+    for (size_t idx : {P3E_FROM_ADDR(addr), P2E_FROM_ADDR(addr)}) {
+        if (!(tbl[idx] & PTE_PRESENT)) {
+            return false;
+        }
+        tbl = static_cast<mm::Pte*>(PHYS_TO_VIRT(mm::PteAddr(tbl[idx])));
+    }
+    return tbl[P1E_FROM_ADDR(addr)] & PTE_PRESENT;
+}
+
+void CheckMapped(void* addr, size_t pages) noexcept {
+    for (size_t i = 0; i < pages; i++) {
+        uintptr_t page = (uintptr_t)addr + i * PAGE_SIZE;
+        FAIL_ON(!IsMapped(page), "page %lu of area %p isn't mapped", i, addr);
+    }
+    FAIL_ON(IsMapped((uintptr_t)addr + pages * PAGE_SIZE), "guard page of area %p is mapped", addr);
+}
+
+void CheckUnmapped(void* addr, size_t pages) noexcept {
+    for (size_t i = 0; i <= pages; i++) {
+        FAIL_ON(IsMapped((uintptr_t)addr + i * PAGE_SIZE), "page %lu of freed area %p is still mapped", i, addr);
+    }
+}
+
+// Fill writes every word of the area, so all pages must be distinct and writable to pass Check.
+void Fill(void* addr, size_t pages, uint64_t seed) noexcept {
+    uint64_t* words = static_cast<uint64_t*>(addr);
+    for (size_t i = 0; i < pages * PAGE_SIZE / sizeof(uint64_t); i++) {
+        words[i] = seed ^ i;
+    }
+}
+
+void Check(void* addr, size_t pages, uint64_t seed) noexcept {
+    uint64_t* words = static_cast<uint64_t*>(addr);
+    for (size_t i = 0; i < pages * PAGE_SIZE / sizeof(uint64_t); i++) {
+        FAIL_ON(words[i] != (seed ^ i), "word %lu of area %p is %lx, expected %lx", i, addr, words[i], seed ^ i);
+    }
+}
+
+void* AllocChecked(size_t size) noexcept {
+    void* addr = mm::Vmalloc(size);
+    FAIL_ON_NULL(addr, "cannot vmalloc %lu bytes", size);
+    FAIL_ON(!mm::IsVmallocAddr(addr), "vmalloc returned %p outside of the vmalloc area", addr);
+    FAIL_IF_UNALIGNED(addr, PAGE_SIZE, "vmalloc returned unaligned pointer %p", addr);
+    return addr;
+}
+
+}
+
+void KernelPid1() noexcept {
+    printk("==== Running vmalloc test ====\n");
+
+    // Partial last page is rounded up.
+    void* big = AllocChecked(BIG_PAGES * PAGE_SIZE - 100);
+    CheckMapped(big, BIG_PAGES);
+    Fill(big, BIG_PAGES, 0x1111);
+    Check(big, BIG_PAGES, 0x1111);
+
+    void* small = AllocChecked(PAGE_SIZE);
+    CheckMapped(small, 1);
+    Fill(small, 1, 0x2222);
+    Check(small, 1, 0x2222);
+    uintptr_t big_end = (uintptr_t)big + (BIG_PAGES + 1) * PAGE_SIZE;
+    FAIL_ON((uintptr_t)small + 2 * PAGE_SIZE > (uintptr_t)big && (uintptr_t)small < big_end,
+        "area %p overlaps area %p or its guard page", small, big);
+    printk("[test] allocated %p and %p\n", big, small);
+
+    // The range is the first gap which fits, so it's reused as soon as it's released.
+    mm::Vfree(big);
+    CheckUnmapped(big, BIG_PAGES);
+    void* again = AllocChecked(BIG_PAGES * PAGE_SIZE);
+    FAIL_ON(again != big, "freed range %p isn't reused, got %p", big, again);
+    CheckMapped(again, BIG_PAGES);
+    Fill(again, BIG_PAGES, 0x3333);
+    Check(again, BIG_PAGES, 0x3333);
+    // The other area is untouched.
+    Check(small, 1, 0x2222);
+
+    // With IRQs disabled TLBs can't be shot down: the area stays mapped and reserved until the next call.
+    kern::WithoutIrqs([&]() {
+        mm::Vfree(again);
+        CheckMapped(again, BIG_PAGES);
+    });
+    void* deferred = AllocChecked(BIG_PAGES * PAGE_SIZE);
+    FAIL_ON(deferred != again, "deferred range %p isn't released before allocation, got %p", again, deferred);
+    CheckMapped(deferred, BIG_PAGES);
+    Fill(deferred, BIG_PAGES, 0x4444);
+    Check(deferred, BIG_PAGES, 0x4444);
+
+    mm::Vfree(deferred);
+    mm::Vfree(small);
+    CheckUnmapped(deferred, BIG_PAGES);
+    CheckUnmapped(small, 1);
+
+    printk("[test] done\n");
+
+    TEST_OK();
+}
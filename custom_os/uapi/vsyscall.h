@@ -0,0 +1,7 @@
+#pragma once
+
+// Vsyscall pages are mapped read-only into every address space at this address.
+#define VSYSCALL_ADDR 0xffffffffff600000ull
+
+// int gettimeofday(struct timeval* tv), returns -1 if the clock can't be read from user space.
+#define VSYSCALL_GETTIMEOFDAY (VSYSCALL_ADDR + 0x0)
@@ -22,3 +22,8 @@ int mprotect(void* addr, size_t length, int prot) {
     int64_t res = SYSCALL3(SYS_mprotect, addr, length, prot);
     return SET_ERRNO(res);
 }
+
+int msync(void* addr, size_t length, int flags) {
+    int64_t res = SYSCALL3(SYS_msync, addr, length, flags);
+    return SET_ERRNO(res);
+}
@@ -15,7 +15,11 @@
 
 #define MAP_FAILED (NULL)
 
+#define MS_ASYNC (1 << 0)
+#define MS_SYNC  (1 << 2)
+
 
 void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
 int munmap(void* addr, size_t length);
 int mprotect(void* addr, size_t len, int prot);
+int msync(void* addr, size_t length, int flags);
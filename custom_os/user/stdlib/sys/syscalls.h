@@ -19,4 +19,7 @@
 #define SYS_mprotect 16
 #define SYS_sched_yield 17
 #define SYS_sync 18
-#define SYS_sleep 19
\ No newline at end of file
+#define SYS_sleep 19
+#define SYS_gettimeofday 20
+#define SYS_nice 21
+#define SYS_msync 22
@@ -0,0 +1,18 @@
+#include <sys/time.h>
+#include <sys/syscalls.h>
+#include <stdlib_private/syscalls.h>
+#include <uapi/vsyscall.h>
+
+typedef int (*vsyscall_gettimeofday_t)(struct timeval* tv);
+
+int gettimeofday(struct timeval* tv, void* tz) {
+    (void)tz;
+
+    // Read the clock directly from the vsyscall page, fall back to the syscall if kernel doesn't allow that.
+    if (((vsyscall_gettimeofday_t)VSYSCALL_GETTIMEOFDAY)(tv) == 0) {
+        return 0;
+    }
+
+    int res = SYSCALL1(SYS_gettimeofday, tv);
+    return SET_ERRNO(res);
+}
@@ -1,3 +1,5 @@
 #pragma once
 
 #include <uapi/time.h>
+
+int gettimeofday(struct timeval* tv, void* tz);
@@ -7,3 +7,6 @@
 #define MAP_ANONYMOUS (1 << 0)
 #define MAP_SHARED    (1 << 1)
 #define MAP_FIXED     (1 << 2)
+
+#define MS_ASYNC (1 << 0)
+#define MS_SYNC  (1 << 2)
@@ -58,3 +58,11 @@ void sync() {
 unsigned int sleep(unsigned int seconds) {
     return SYSCALL1(SYS_sleep, seconds);
 }
+
+int nice(int inc) {
+    int res = SYSCALL1(SYS_nice, inc);
+    if (SET_ERRNO(res) < 0) {
+        return -1;
+    }
+    return 20 - res;
+}
@@ -17,3 +17,4 @@ pid_t getppid();
 int pipe(int pipefd[2]);
 void sync();
 unsigned int sleep(unsigned int seconds);
+int nice(int inc);
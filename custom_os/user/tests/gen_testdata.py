@@ -1,6 +1,29 @@
+import array
+import os
+import shutil
+import sys
+
+# Must match tests_reclaim.c.
+RECLAIM_FILES = 2048
+RECLAIM_FILE_SIZE = 48 * 1024
+
+def gen_reclaim_files():
+    os.makedirs("gentestdata/reclaim", exist_ok=True)
+    words = RECLAIM_FILE_SIZE // 4
+    for idx in range(RECLAIM_FILES):
+        data = array.array("I", ((idx << 16) ^ i for i in range(words)))
+        with open(f"gentestdata/reclaim/{idx:04}", "wb") as f:
+            f.write(data.tobytes())
+
 def main():
     with open("gentestdata/big_letters.txt", "w") as f:
         for i in range(26):
             print(chr(64 + i) * 5000, file=f, end='')
 
+    # Files for the reclaim test don't fit into the disk image of other tests.
+    if "--reclaim" in sys.argv:
+        gen_reclaim_files()
+    else:
+        shutil.rmtree("gentestdata/reclaim", ignore_errors=True)
+
 main()
@@ -2,7 +2,9 @@
 
 #include <sched.h>
 #include <stdatomic.h>
+#include <sys/mman.h>
 #include <sys/syscalls.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -156,6 +158,74 @@ TEST(wait_signal) {
     ASSERT(WTERMSIG(status) == SIGKILL);
 }
 
+#define COW_REGION_ADDR  0x200000000
+#define COW_REGION_PAGES 1024
+
+static volatile char* map_cow_region(void) {
+    volatile char* mem = mmap((void*)COW_REGION_ADDR, COW_REGION_PAGES * 4096, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_MSG_ERRNO(mem != MAP_FAILED, "mmap failed");
+    for (size_t i = 0; i < COW_REGION_PAGES; i++) {
+        mem[i * 4096] = 'p';
+    }
+    return mem;
+}
+
+// Test that writes after fork are private to the writer, both in parent and in child.
+TEST_FORK(fork_cow_private_writes) {
+    volatile char* mem = map_cow_region();
+
+    pid_t pid = ASSERT_NO_ERR(fork());
+    if (pid == 0) {
+        for (size_t i = 0; i < COW_REGION_PAGES; i += 2) {
+            ASSERT(mem[i * 4096] == 'p');
+            mem[i * 4096] = 'c';
+        }
+        for (size_t i = 0; i < COW_REGION_PAGES; i++) {
+            ASSERT(mem[i * 4096] == (i % 2 == 0 ? 'c' : 'p'));
+        }
+        exit(0);
+    }
+    for (size_t i = 1; i < COW_REGION_PAGES; i += 2) {
+        mem[i * 4096] = 'q';
+    }
+
+    int status;
+    ASSERT_NO_ERR(waitpid(pid, &status, 0));
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    for (size_t i = 0; i < COW_REGION_PAGES; i++) {
+        ASSERT(mem[i * 4096] == (i % 2 == 0 ? 'p' : 'q'));
+    }
+
+    // Kernel writes into copy-on-write pages too.
+    pid = ASSERT_NO_ERR(fork());
+    if (pid == 0) {
+        exit(0);
+    }
+    ASSERT_NO_ERR(waitpid(pid, (int*)(mem + 4096), 0));
+    ASSERT(WIFEXITED(*(int*)(mem + 4096)));
+}
+
+// Measure fork latency of a process with 4 MiB of resident memory.
+TEST_FORK(fork_latency_bench) {
+    const int N_FORKS = 100;
+    map_cow_region();
+
+    struct timeval start, end;
+    ASSERT_NO_ERR(gettimeofday(&start, NULL));
+    for (int i = 0; i < N_FORKS; i++) {
+        pid_t pid = ASSERT_NO_ERR(fork());
+        if (pid == 0) {
+            _exit(0);
+        }
+        int status;
+        ASSERT_NO_ERR(waitpid(pid, &status, 0));
+    }
+    ASSERT_NO_ERR(gettimeofday(&end, NULL));
+
+    long usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+    printf("fork+exit+wait with %d KiB resident: %ld usec per iteration\n", COW_REGION_PAGES * 4, usec / N_FORKS);
+}
+
 #if TARGET_ARCH == x86
 TEST(fork_x86_regs_copied) {
     int64_t pid;
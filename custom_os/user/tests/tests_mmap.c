@@ -1,3 +1,4 @@
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -88,3 +89,208 @@ TEST_FORK(many_mmaps) {
         ASSERT(buf[2 * i * 4096] == 'a');
     }
 }
+
+TEST_FORK(mmap_anon_zero_fill) {
+    const size_t N_PAGES = 64;
+    volatile char* addr = mmap((void*)0x100000000, N_PAGES * 4096, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_FIXED | MAP_PRIVATE, -1, 0);
+    ASSERT_MSG_ERRNO(addr != MAP_FAILED, "mmap failed");
+
+    // Untouched pages read as zeroes, writes to one page don't leak into others.
+    for (size_t i = 0; i < N_PAGES; i++) {
+        ASSERT(addr[i * 4096] == 0 && addr[i * 4096 + 4095] == 0);
+    }
+    for (size_t i = 0; i < N_PAGES; i += 2) {
+        addr[i * 4096 + 1] = 'z';
+    }
+    for (size_t i = 0; i < N_PAGES; i++) {
+        ASSERT(addr[i * 4096 + 1] == (i % 2 == 0 ? 'z' : 0));
+    }
+
+    // Fixed mapping replaces the overlapped one.
+    ASSERT(mmap((void*)addr, 4096, PROT_READ, MAP_ANONYMOUS | MAP_FIXED | MAP_PRIVATE, -1, 0) == (void*)addr);
+    ASSERT(addr[1] == 0);
+    ASSERT(addr[2 * 4096 + 1] == 'z');
+}
+
+TEST_FORK(mmap_file_private_write) {
+    int fd = ASSERT_NO_ERR(open("/etc/gentestdata/big_letters.txt", O_RDONLY));
+    unsigned char* ro = mmap((void*)0x100000000, 5000 * 26, PROT_READ, MAP_FIXED | MAP_PRIVATE, fd, 0);
+    ASSERT_MSG_ERRNO(ro != MAP_FAILED, "mmap failed");
+    close(fd);
+
+    fd = ASSERT_NO_ERR(open("/etc/gentestdata/big_letters.txt", O_RDWR));
+    unsigned char* rw = mmap((void*)0x200000000, 5000 * 26, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE, fd, 0);
+    ASSERT_MSG_ERRNO(rw != MAP_FAILED, "mmap failed");
+    close(fd);
+
+    // Both mappings share page cache pages until the private one is written.
+    check_mapping(rw);
+    for (size_t i = 0; i < 5000 * 26; i += 4096) {
+        rw[i] = '!';
+    }
+    check_mapping(ro);
+    for (size_t i = 0; i < 5000 * 26; i += 4096) {
+        ASSERT(rw[i] == '!');
+    }
+}
+
+TEST_FORK(mmap_file_shared_write) {
+    int fd = ASSERT_NO_ERR(open("/etc/test1", O_RDWR | O_CREAT, 0777));
+    char buf[8192];
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = 'x';
+    }
+    ASSERT(ASSERT_NO_ERR(write(fd, buf, sizeof(buf))) == sizeof(buf));
+
+    char* addr = mmap((void*)0x100000000, sizeof(buf), PROT_READ | PROT_WRITE, MAP_FIXED | MAP_SHARED, fd, 0);
+    ASSERT_MSG_ERRNO(addr != MAP_FAILED, "mmap failed");
+    ASSERT(addr[0] == 'x' && addr[sizeof(buf) - 1] == 'x');
+
+    // Writes are visible to the child through the inherited mapping and vice versa.
+    addr[1] = 'p';
+    pid_t pid = ASSERT_NO_ERR(fork());
+    if (pid == 0) {
+        ASSERT(addr[1] == 'p');
+        addr[4097] = 'c';
+        ASSERT_NO_ERR(msync(addr, sizeof(buf), MS_ASYNC));
+        exit(0);
+    }
+    int status;
+    ASSERT_NO_ERR(waitpid(pid, &status, 0));
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    ASSERT(addr[4097] == 'c');
+
+    // And to read().
+    addr[2] = 'q';
+    ASSERT_NO_ERR(msync(addr, sizeof(buf), MS_SYNC));
+    int fd2 = ASSERT_NO_ERR(open("/etc/test1", O_RDONLY));
+    ASSERT(ASSERT_NO_ERR(read(fd2, buf, sizeof(buf))) == sizeof(buf));
+    ASSERT(buf[0] == 'x' && buf[1] == 'p' && buf[2] == 'q' && buf[4097] == 'c');
+    close(fd2);
+    close(fd);
+}
+
+// expect_segv checks that reading (or writing) of given address kills the process with SIGSEGV.
+static void expect_segv(volatile char* addr, bool write) {
+    pid_t pid = ASSERT_NO_ERR(fork());
+    if (pid == 0) {
+        if (write) {
+            *addr = 'w';
+        } else {
+            (void)*addr;
+        }
+        exit(0);
+    }
+    int status;
+    ASSERT_NO_ERR(waitpid(pid, &status, 0));
+    ASSERT_MSG(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV, "child process should be terminated with SIGSEGV, but status is %x", status);
+}
+
+TEST_FORK(munmap_range) {
+    char* addr = mmap((void*)0x100000000, 4 * 4096, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_FIXED | MAP_PRIVATE, -1, 0);
+    ASSERT_MSG_ERRNO(addr != MAP_FAILED, "mmap failed");
+    for (size_t i = 0; i < 4; i++) {
+        addr[i * 4096] = 'a' + i;
+    }
+
+    // Unmapping the middle splits the mapping.
+    ASSERT_NO_ERR(munmap(addr + 4096, 2 * 4096));
+    ASSERT(addr[0] == 'a' && addr[3 * 4096] == 'd');
+    expect_segv(addr + 4096, false);
+    expect_segv(addr + 2 * 4096, true);
+
+    // Unmapping of not mapped range is fine.
+    ASSERT_NO_ERR(munmap(addr, 8 * 4096));
+    expect_segv(addr, false);
+    expect_segv(addr + 3 * 4096, false);
+
+    ASSERT(munmap(addr + 1, 4096) == -1 && errno == EINVAL);
+}
+
+TEST_FORK(mprotect_guard) {
+    char* addr = mmap((void*)0x100000000, 3 * 4096, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_FIXED | MAP_PRIVATE, -1, 0);
+    ASSERT_MSG_ERRNO(addr != MAP_FAILED, "mmap failed");
+    addr[0] = 'a';
+    addr[4096] = 'b';
+
+    // Guard page in the middle.
+    ASSERT_NO_ERR(mprotect(addr + 4096, 4096, PROT_NONE));
+    expect_segv(addr + 4096, false);
+    addr[2 * 4096] = 'c';
+
+    // Read only pages keep their content.
+    ASSERT_NO_ERR(mprotect(addr, 3 * 4096, PROT_READ));
+    ASSERT(addr[0] == 'a' && addr[4096] == 'b' && addr[2 * 4096] == 'c');
+    expect_segv(addr, true);
+
+    // And become writable again.
+    ASSERT_NO_ERR(mprotect(addr, 3 * 4096, PROT_READ | PROT_WRITE));
+    addr[4096] = 'B';
+    ASSERT(addr[4096] == 'B');
+
+    // Whole range must be mapped.
+    ASSERT(mprotect(addr, 4 * 4096, PROT_READ) == -1 && errno == ENOMEM);
+}
+
+TEST_FORK(mmap_anon_huge) {
+    // Starts in the middle of 2 MiB page, so both huge and regular pages are used.
+    const size_t size = 8 * 1024 * 1024;
+    char* addr = mmap((void*)0x100100000, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_FIXED | MAP_PRIVATE, -1, 0);
+    ASSERT_MSG_ERRNO(addr != MAP_FAILED, "mmap failed");
+    for (size_t i = 0; i < size; i += 4096) {
+        ASSERT(addr[i] == 0);
+        addr[i] = (char)(i / 4096);
+    }
+
+    // Child gets a copy-on-write copy.
+    pid_t pid = ASSERT_NO_ERR(fork());
+    if (pid == 0) {
+        for (size_t i = 0; i < size; i += 4096) {
+            ASSERT(addr[i] == (char)(i / 4096));
+            addr[i] = 'c';
+        }
+        exit(0);
+    }
+    int status;
+    ASSERT_NO_ERR(waitpid(pid, &status, 0));
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    for (size_t i = 0; i < size; i += 4096) {
+        ASSERT(addr[i] == (char)(i / 4096));
+    }
+
+    // Partial unmap and protection change split huge pages.
+    char* hole = (char*)0x100400000 + 3 * 4096;
+    ASSERT_NO_ERR(munmap(hole, 4096));
+    expect_segv(hole, false);
+    ASSERT(hole[-4096] == (char)((hole - 4096 - addr) / 4096));
+    ASSERT(hole[4096] == (char)((hole + 4096 - addr) / 4096));
+
+    char* ro = (char*)0x100600000 + 5 * 4096;
+    ASSERT_NO_ERR(mprotect(ro, 4096, PROT_READ));
+    expect_segv(ro, true);
+    ro[4096] = 'w';
+    ASSERT(ro[0] == (char)((ro - addr) / 4096) && ro[4096] == 'w');
+}
+
+// Unmapping of a range populated with 4 KiB pages tears down its page tables: every page faults afterwards, a new
+// mapping starts zeroed.
+TEST_FORK(munmap_populated_range) {
+    const size_t n_pages = 4096;
+    char* addr = mmap((void*)0x100000000, n_pages * 4096, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_FIXED | MAP_PRIVATE, -1, 0);
+    ASSERT_MSG_ERRNO(addr != MAP_FAILED, "mmap failed");
+    // Read first, so the region isn't backed by huge pages.
+    for (size_t i = 0; i < n_pages; i++) {
+        ASSERT(addr[i * 4096] == 0);
+        addr[i * 4096] = 'x';
+    }
+
+    ASSERT_NO_ERR(munmap(addr, n_pages * 4096));
+    expect_segv(addr, false);
+    expect_segv(addr + n_pages / 2 * 4096, true);
+    expect_segv(addr + (n_pages - 1) * 4096, false);
+
+    ASSERT(mmap(addr, n_pages * 4096, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_FIXED | MAP_PRIVATE, -1, 0) == addr);
+    for (size_t i = 0; i < n_pages; i++) {
+        ASSERT(addr[i * 4096] == 0);
+    }
+}
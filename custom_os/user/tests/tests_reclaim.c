@@ -0,0 +1,45 @@
+#include "common.h"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// Must match gen_testdata.py. Ext2 resolves only direct blocks, so the files are at most 48 KiB each, but together
+// they are bigger than memory of the test VM.
+#define RECLAIM_FILES 2048
+#define RECLAIM_FILE_SIZE (48 * 1024)
+
+static uint32_t file_buf[RECLAIM_FILE_SIZE / sizeof(uint32_t)];
+
+static void read_file(int idx) {
+    char path[] = "/etc/gentestdata/reclaim/0000";
+    char* digits = path + sizeof(path) - 5;
+    for (int i = 3, n = idx; i >= 0; i--, n /= 10) {
+        digits[i] = '0' + n % 10;
+    }
+
+    int fd = ASSERT_NO_ERR(open(path, O_RDONLY));
+    size_t total = 0;
+    while (total < RECLAIM_FILE_SIZE) {
+        ssize_t res = ASSERT_NO_ERR(read(fd, (char*)file_buf + total, RECLAIM_FILE_SIZE - total));
+        ASSERT_MSG(res > 0, "unexpected end of %s at %lu\n", path, total);
+        total += res;
+    }
+    ASSERT_NO_ERR(close(fd));
+
+    for (size_t i = 0; i < RECLAIM_FILE_SIZE / sizeof(uint32_t); i++) {
+        uint32_t expected = ((uint32_t)idx << 16) ^ i;
+        ASSERT_MSG(file_buf[i] == expected, "word %lu of %s is 0x%x, expected 0x%x\n", i, path, file_buf[i], expected);
+    }
+}
+
+// The page cache can't hold all files: reading them evicts earlier ones, and the second pass reads them from the disk
+// again.
+TEST(read_files_bigger_than_memory) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int idx = 0; idx < RECLAIM_FILES; idx++) {
+            read_file(idx);
+        }
+        printf("pass %d: read %d MiB\n", pass, RECLAIM_FILES * (RECLAIM_FILE_SIZE / 1024) / 1024);
+    }
+}
@@ -0,0 +1,91 @@
+#include "common.h"
+
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <unistd.h>
+
+TEST_FORK(nice_basic) {
+    ASSERT(nice(0) == 0);
+    ASSERT(nice(5) == 5);
+    ASSERT(nice(-3) == 2);
+
+    // Nice value is clamped to [-20, 19].
+    ASSERT(nice(100) == 19);
+    ASSERT(nice(-100) == -20);
+    ASSERT(nice(20) == 0);
+}
+
+TEST_FORK(nice_inherited_by_fork) {
+    ASSERT(nice(7) == 7);
+
+    pid_t pid = ASSERT_NO_ERR(fork());
+    if (pid == 0) {
+        exit(nice(0));
+    }
+
+    int status = 0;
+    ASSERT_NO_ERR(waitpid(pid, &status, 0));
+    ASSERT(WIFEXITED(status));
+    ASSERT(WEXITSTATUS(status) == 7);
+}
+
+// spin_until busy loops until the deadline and returns number of loop iterations done.
+static uint64_t spin_until(struct timeval deadline) {
+    uint64_t iters = 0;
+    for (;;) {
+        for (int i = 0; i < 1000; i++) {
+            // Tell compiler don't optimize this loop.
+            __asm__ volatile ("");
+        }
+        iters++;
+
+        struct timeval now;
+        ASSERT_NO_ERR(gettimeofday(&now, NULL));
+        if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_usec >= deadline.tv_usec)) {
+            return iters;
+        }
+    }
+}
+
+TEST_FORK(cpu_share_follows_nice) {
+    // Weights of nice 0 and nice 5 are 1024 and 335. Tests run on a single CPU, so both workers compete for it.
+    const int nices[2] = {0, 5};
+    pid_t workers[2];
+    int fds[2];
+    ASSERT_NO_ERR(pipe(fds));
+
+    struct timeval deadline;
+    ASSERT_NO_ERR(gettimeofday(&deadline, NULL));
+    deadline.tv_sec += 2;
+
+    for (int i = 0; i < 2; i++) {
+        workers[i] = ASSERT_NO_ERR(fork());
+        if (workers[i] == 0) {
+            close(fds[0]);
+            ASSERT(nice(nices[i]) == nices[i]);
+            uint64_t result[2] = {i, spin_until(deadline)};
+            ASSERT(write(fds[1], result, sizeof(result)) == sizeof(result));
+            exit(0);
+        }
+    }
+    close(fds[1]);
+
+    uint64_t iters[2] = {0, 0};
+    for (int i = 0; i < 2; i++) {
+        uint64_t result[2];
+        ASSERT(read(fds[0], result, sizeof(result)) == sizeof(result));
+        ASSERT(result[0] < 2);
+        iters[result[0]] = result[1];
+    }
+    for (int i = 0; i < 2; i++) {
+        int status = 0;
+        ASSERT_NO_ERR(waitpid(workers[i], &status, 0));
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // Niced worker still runs, but gets about a third of the share of the other one.
+    printf("iterations: nice 0: %lu, nice 5: %lu\n", iters[0], iters[1]);
+    ASSERT(iters[1] > 0);
+    ASSERT(iters[0] > 2 * iters[1] && iters[0] < 5 * iters[1]);
+}
@@ -0,0 +1,72 @@
+#include "common.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SWAP_BASE ((void*)0x100000000)
+// Bigger than memory of the test VM (64 MiB), but fits into it together with the swap disk (64 MiB).
+#define SWAP_AREA_SIZE (72ul << 20)
+// The child rewrites only the beginning of the area, which is swapped out first. Memory is exhausted by the time of the
+// fork, so its copies go to swap too, next to the entries still referenced by the parent.
+#define SWAP_CHILD_SIZE (8ul << 20)
+
+static uint64_t* map_area() {
+    volatile uint64_t* words = mmap(SWAP_BASE, SWAP_AREA_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_FIXED | MAP_PRIVATE, -1, 0);
+    ASSERT_MSG_ERRNO(words != MAP_FAILED, "mmap failed");
+
+    // Reading first maps the zero page with page tables, so writes get 4 KiB pages: 2 MiB pages are never swapped out.
+    for (size_t i = 0; i < SWAP_AREA_SIZE / sizeof(uint64_t); i += 4096 / sizeof(uint64_t)) {
+        ASSERT_MSG(words[i] == 0, "word %lu of untouched area is 0x%lx\n", i, words[i]);
+    }
+    return (uint64_t*)words;
+}
+
+static void fill(uint64_t* words, size_t size, uint64_t seed) {
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+        words[i] = (seed << 48) ^ i;
+    }
+}
+
+static void check(const uint64_t* words, size_t size, uint64_t seed) {
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+        uint64_t expected = (seed << 48) ^ i;
+        ASSERT_MSG(words[i] == expected, "word %lu is 0x%lx, expected 0x%lx\n", i, words[i], expected);
+    }
+}
+
+// Every pass over the area reads back pages swapped out by the previous one.
+TEST_FORK(swap_anon_bigger_than_memory) {
+    uint64_t* words = map_area();
+    fill(words, SWAP_AREA_SIZE, 1);
+    for (int pass = 0; pass < 2; pass++) {
+        check(words, SWAP_AREA_SIZE, 1);
+        printf("pass %d: checked %lu MiB\n", pass, SWAP_AREA_SIZE >> 20);
+    }
+
+    // Swapped out pages are private: a partial rewrite doesn't affect the rest.
+    fill(words, SWAP_CHILD_SIZE, 2);
+    check(words, SWAP_CHILD_SIZE, 2);
+    check(words + SWAP_CHILD_SIZE / sizeof(uint64_t), SWAP_AREA_SIZE - SWAP_CHILD_SIZE, 1);
+}
+
+// Swap entries copied by fork reference the same slots, each process gets its own copy on swap in.
+TEST_FORK(swap_entries_shared_across_fork) {
+    uint64_t* words = map_area();
+    fill(words, SWAP_AREA_SIZE, 1);
+
+    pid_t pid = ASSERT_NO_ERR(fork());
+    if (pid == 0) {
+        check(words, SWAP_CHILD_SIZE, 1);
+        fill(words, SWAP_CHILD_SIZE, 3);
+        check(words, SWAP_CHILD_SIZE, 3);
+        exit(0);
+    }
+    int status;
+    ASSERT_NO_ERR(waitpid(pid, &status, 0));
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // Pages the parent kept mapped across the fork are private again and can be swapped out to read the rest back.
+    check(words, SWAP_AREA_SIZE, 1);
+}
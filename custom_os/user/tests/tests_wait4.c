@@ -5,6 +5,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/syscalls.h>
+#include <stdlib_private/syscalls.h>
+#include <uapi/vsyscall.h>
 
 int timeval_compare(struct timeval a, struct timeval b) {
     if (a.tv_sec < b.tv_sec) {
@@ -172,3 +176,34 @@ TEST(wait4_rusage_sleep_recursive) {
         ASSERT(ru.ru_utime.tv_sec == 0);
     }
 }
+
+TEST(gettimeofday_monotonic) {
+    struct timeval prev;
+    ASSERT_NO_ERR(gettimeofday(&prev, NULL));
+    for (int i = 0; i < 100000; i++) {
+        struct timeval now;
+        ASSERT_NO_ERR(gettimeofday(&now, NULL));
+        ASSERT(now.tv_usec >= 0 && now.tv_usec < 1000000);
+        ASSERT(timeval_compare(now, prev) >= 0);
+        prev = now;
+    }
+
+    struct timeval start, end;
+    ASSERT_NO_ERR(gettimeofday(&start, NULL));
+    sleep(1);
+    ASSERT_NO_ERR(gettimeofday(&end, NULL));
+    struct timeval diff = timeval_sub(end, start);
+    ASSERT(diff.tv_sec >= 1 && diff.tv_sec < 3);
+}
+
+TEST(gettimeofday_vsyscall) {
+    // Test VMs have an invariant TSC, so the clock is read from the vsyscall page without entering the kernel.
+    int (*vsyscall_gettimeofday)(struct timeval*) = (int (*)(struct timeval*))VSYSCALL_GETTIMEOFDAY;
+
+    struct timeval fast, slow;
+    ASSERT(vsyscall_gettimeofday(&fast) == 0);
+    ASSERT(SYSCALL1(SYS_gettimeofday, &slow) == 0);
+    ASSERT(fast.tv_usec >= 0 && fast.tv_usec < 1000000);
+    ASSERT(timeval_compare(slow, fast) >= 0);
+    ASSERT(timeval_sub(slow, fast).tv_sec == 0);
+}